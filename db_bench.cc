@@ -0,0 +1,681 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <map>
+
+#include "db_bench.h"
+#include "db_core.h"
+
+// Save/Load round-trips go through a per-process file in the temp directory so
+// an interrupted run never leaves it in the working tree.
+static const std::string &SaveFile() {
+  static const std::string path =
+      (std::filesystem::temp_directory_path() /
+       ("db_bench." + std::to_string(getpid()) + ".bin"))
+          .string();
+  return path;
+}
+static const size_t kScanLength = 100;
+
+static volatile uint64_t sink;
+
+template <class K> class KeyFactory;
+
+template <> class KeyFactory<uint64_t> {
+public:
+  static const char *Name() { return "uint64"; }
+  static uint64_t Random(RandomGenerator &generator) {
+    return generator.Uint64();
+  }
+  static uint64_t Sequential(size_t index) { return index; }
+};
+
+template <> class KeyFactory<double> {
+public:
+  static const char *Name() { return "double"; }
+  static double Random(RandomGenerator &generator) {
+    return generator.Uniform();
+  }
+  static double Sequential(size_t index) { return static_cast<double>(index); }
+};
+
+template <> class KeyFactory<std::string> {
+public:
+  static const char *Name() { return "string"; }
+  static std::string Random(RandomGenerator &generator) {
+    return generator.Uuid(24);
+  }
+  static std::string Sequential(size_t index) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%024zu", index);
+    return buffer;
+  }
+};
+
+// A Map that maintains its hash index for point lookups.
+template <class K> class IndexedMap : public Map<K, uint64_t> {
+public:
+  IndexedMap() : Map<K, uint64_t>(IndexedPolicy()) {}
+
+private:
+  static MapPolicy IndexedPolicy() {
+    MapPolicy policy;
+    policy.hash_index = true;
+    return policy;
+  }
+};
+
+// Keeps the two node arenas of an ArenaMap. It is a base class of its own so
+// that the arenas are constructed before the tree and destroyed after it.
+class NodeArenas {
+protected:
+  HugePageResource leaf_arena_;
+  HugePageResource inner_arena_;
+};
+
+// A Map whose leaves and inner nodes come from separate huge page arenas.
+template <class K>
+class ArenaMap : private NodeArenas, public Map<K, uint64_t> {
+public:
+  ArenaMap() : Map<K, uint64_t>(MapPolicy(), &leaf_arena_, &inner_arena_) {}
+};
+
+template <class K>
+inline void Insert(Map<K, uint64_t> &tree, const K &key, uint64_t value) {
+  tree.Put(key, value);
+}
+
+template <class K>
+inline void Insert(std::map<K, uint64_t> &tree, const K &key,
+                   uint64_t value) {
+  tree[key] = value;
+}
+
+template <class K>
+inline bool Contains(Map<K, uint64_t> &tree, const K &key) {
+  return tree.Contains(key);
+}
+
+template <class K>
+inline bool Contains(std::map<K, uint64_t> &tree, const K &key) {
+  return tree.find(key) != tree.end();
+}
+
+template <class K> inline void Erase(Map<K, uint64_t> &tree, const K &key) {
+  tree.Erase(key);
+}
+
+template <class K>
+inline void Erase(std::map<K, uint64_t> &tree, const K &key) {
+  tree.erase(key);
+}
+
+template <class K>
+inline uint64_t Scan(Map<K, uint64_t> &tree, const K &key, size_t length) {
+  uint64_t sum = 0;
+  MapIterator<K, uint64_t> it = tree.Find(key);
+  for (size_t i = 0; i < length && it != tree.End(); i++, ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t Scan(std::map<K, uint64_t> &tree, const K &key,
+                     size_t length) {
+  uint64_t sum = 0;
+  typename std::map<K, uint64_t>::iterator it = tree.find(key);
+  for (size_t i = 0; i < length && it != tree.end(); i++, ++it) {
+    sum += it->second;
+  }
+  return sum;
+}
+
+template <class K>
+inline bool Contains(FrozenMap<K, uint64_t> &tree, const K &key) {
+  return tree.Contains(key);
+}
+
+template <class K>
+inline uint64_t Scan(FrozenMap<K, uint64_t> &tree, const K &key,
+                     size_t length) {
+  uint64_t sum = 0;
+  FrozenMapIterator<K, uint64_t> it = tree.Find(key);
+  for (size_t i = 0; i < length && it != tree.End(); i++, ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K> inline uint64_t FullScan(Map<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  tree.ForEachBlock([&sum](const K *keys, const uint64_t *values,
+                           size_t count) { sum += SumBlock(values, count); });
+  return sum;
+}
+
+template <class K> inline uint64_t FullScan(std::map<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    sum += it->second;
+  }
+  return sum;
+}
+
+template <class K> inline uint64_t FullScan(FrozenMap<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (FrozenMapIterator<K, uint64_t> it = tree.Begin(); it != tree.End();
+       ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K> inline uint64_t IteratorScan(Map<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (MapIterator<K, uint64_t> it = tree.Begin(); it != tree.End(); ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t IteratorScan(std::map<K, uint64_t> &tree) {
+  return FullScan(tree);
+}
+
+template <class K>
+inline uint64_t IteratorScan(FrozenMap<K, uint64_t> &tree) {
+  return FullScan(tree);
+}
+
+template <class K>
+inline void Insert(Multimap<K, uint64_t> &tree, const K &key,
+                   uint64_t value) {
+  tree.Put(key, value);
+}
+
+template <class K>
+inline void Insert(std::multimap<K, uint64_t> &tree, const K &key,
+                   uint64_t value) {
+  tree.emplace(key, value);
+}
+
+template <class K>
+inline bool Contains(Multimap<K, uint64_t> &tree, const K &key) {
+  return tree.Contains(key);
+}
+
+template <class K>
+inline bool Contains(std::multimap<K, uint64_t> &tree, const K &key) {
+  return tree.find(key) != tree.end();
+}
+
+template <class K>
+inline void Erase(Multimap<K, uint64_t> &tree, const K &key) {
+  tree.Erase(key);
+}
+
+template <class K>
+inline void Erase(std::multimap<K, uint64_t> &tree, const K &key) {
+  tree.erase(key);
+}
+
+template <class K>
+inline uint64_t Scan(Multimap<K, uint64_t> &tree, const K &key,
+                     size_t length) {
+  uint64_t sum = 0;
+  MultimapIterator<K, uint64_t> it = tree.Find(key);
+  for (size_t i = 0; i < length && it != tree.End(); i++, ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t Scan(std::multimap<K, uint64_t> &tree, const K &key,
+                     size_t length) {
+  uint64_t sum = 0;
+  typename std::multimap<K, uint64_t>::iterator it = tree.find(key);
+  for (size_t i = 0; i < length && it != tree.end(); i++, ++it) {
+    sum += it->second;
+  }
+  return sum;
+}
+
+template <class K> inline uint64_t FullScan(Multimap<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (MultimapIterator<K, uint64_t> it = tree.Begin(); it != tree.End();
+       ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t FullScan(std::multimap<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (auto it = tree.begin(); it != tree.end(); ++it) {
+    sum += it->second;
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t IteratorScan(Multimap<K, uint64_t> &tree) {
+  return FullScan(tree);
+}
+
+template <class K>
+inline uint64_t IteratorScan(std::multimap<K, uint64_t> &tree) {
+  return FullScan(tree);
+}
+
+template <class K>
+inline void Insert(ValueLogMap<K, uint64_t> &tree, const K &key,
+                   uint64_t value) {
+  tree.Put(key, value);
+}
+
+template <class K>
+inline bool Contains(ValueLogMap<K, uint64_t> &tree, const K &key) {
+  return tree.Contains(key);
+}
+
+template <class K>
+inline void Erase(ValueLogMap<K, uint64_t> &tree, const K &key) {
+  tree.Erase(key);
+}
+
+template <class K>
+inline uint64_t Scan(ValueLogMap<K, uint64_t> &tree, const K &key,
+                     size_t length) {
+  uint64_t sum = 0;
+  ValueLogMapIterator<K, uint64_t> it = tree.Find(key);
+  for (size_t i = 0; i < length && it != tree.End(); i++, ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K> inline uint64_t FullScan(ValueLogMap<K, uint64_t> &tree) {
+  uint64_t sum = 0;
+  for (ValueLogMapIterator<K, uint64_t> it = tree.Begin(); it != tree.End();
+       ++it) {
+    sum += it.GetValue();
+  }
+  return sum;
+}
+
+template <class K>
+inline uint64_t IteratorScan(ValueLogMap<K, uint64_t> &tree) {
+  return FullScan(tree);
+}
+
+template <class K> inline bool Parallel(const Map<K, uint64_t> &tree) {
+  return true;
+}
+
+template <class T> inline bool Parallel(const T &tree) { return false; }
+
+template <class K>
+inline uint64_t ParallelScan(Map<K, uint64_t> &tree, size_t threads) {
+  return tree.ParallelReduce(
+      uint64_t(0),
+      [](uint64_t &sum, const K &, const uint64_t &value) { sum += value; },
+      [](uint64_t left, uint64_t right) { return left + right; }, threads);
+}
+
+template <class T> inline uint64_t ParallelScan(T &tree, size_t threads) {
+  return FullScan(tree);
+}
+
+template <class K> inline bool Queue(const Map<K, uint64_t> &tree) {
+  return true;
+}
+
+template <class T> inline bool Queue(const T &tree) { return false; }
+
+template <class K> inline void PopFront(Map<K, uint64_t> &tree) {
+  tree.PopFront();
+}
+
+template <class T> inline void PopFront(T &tree) {}
+
+template <class K> inline void EraseFront(Map<K, uint64_t> &tree) {
+  tree.Erase(tree.Begin());
+}
+
+template <class T> inline void EraseFront(T &tree) {}
+
+template <class T, class K>
+inline void Populate(T &tree, const std::vector<K> &keys) {
+  for (size_t i = 0; i < keys.size(); i++) {
+    Insert(tree, keys[i], i);
+  }
+}
+
+template <class K>
+inline void Populate(FrozenMap<K, uint64_t> &tree,
+                     const std::vector<K> &keys) {
+  Map<K, uint64_t> source;
+  Populate(source, keys);
+  tree = source.Freeze();
+}
+
+template <class K> inline bool Persistent(const Map<K, uint64_t> &tree) {
+  return true;
+}
+
+template <class K>
+inline bool Persistent(const std::map<K, uint64_t> &tree) {
+  return false;
+}
+
+template <class K> inline void Save(Map<K, uint64_t> &tree) {
+  tree.Save(SaveFile());
+}
+
+template <class K> inline void Save(std::map<K, uint64_t> &tree) {}
+
+template <class K> inline void Load(Map<K, uint64_t> &tree) {
+  tree.Load(SaveFile());
+}
+
+template <class K> inline void Load(std::map<K, uint64_t> &tree) {}
+
+template <class K>
+inline bool Persistent(const Multimap<K, uint64_t> &tree) {
+  return true;
+}
+
+template <class K>
+inline bool Persistent(const std::multimap<K, uint64_t> &tree) {
+  return false;
+}
+
+template <class K> inline void Save(Multimap<K, uint64_t> &tree) {
+  tree.Save(SaveFile());
+}
+
+template <class K> inline void Save(std::multimap<K, uint64_t> &tree) {}
+
+template <class K> inline void Load(Multimap<K, uint64_t> &tree) {
+  tree.Load(SaveFile());
+}
+
+template <class K> inline void Load(std::multimap<K, uint64_t> &tree) {}
+
+template <class K>
+inline bool Persistent(const ValueLogMap<K, uint64_t> &tree) {
+  return true;
+}
+
+template <class K> inline void Save(ValueLogMap<K, uint64_t> &tree) {
+  tree.Save(SaveFile());
+}
+
+template <class K> inline void Load(ValueLogMap<K, uint64_t> &tree) {
+  tree.Load(SaveFile());
+}
+
+template <class K> class Workload {
+public:
+  Workload(size_t size, uint64_t seed);
+  std::vector<K> random_keys;
+  std::vector<K> sequential_keys;
+  std::vector<K> missing_keys;
+  std::vector<size_t> lookup_order;
+  std::vector<size_t> erase_order;
+};
+
+template <class K> Workload<K>::Workload(size_t size, uint64_t seed) {
+  RandomGenerator generator(seed);
+  random_keys.resize(size);
+  sequential_keys.resize(size);
+  missing_keys.resize(size);
+  lookup_order.resize(size);
+  erase_order.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    random_keys[i] = KeyFactory<K>::Random(generator);
+    sequential_keys[i] = KeyFactory<K>::Sequential(i);
+    missing_keys[i] = KeyFactory<K>::Random(generator);
+    lookup_order[i] = generator.Uint64() % size;
+    erase_order[i] = i;
+  }
+  for (size_t i = size; i > 1; i--) {
+    std::swap(erase_order[i - 1], erase_order[generator.Uint64() % i]);
+  }
+}
+
+template <class T, class K> class Suite {
+public:
+  Suite(const std::string &container, const Workload<K> &workload,
+        const BenchmarkOptions &options, BenchmarkReporter &reporter);
+  void Run();
+  void RunReads();
+
+private:
+  template <class Setup, class Body>
+  void Measure(const std::string &phase, size_t operations, Setup setup,
+               Body body);
+  void Fill(T &tree);
+  std::string container_;
+  const Workload<K> &workload_;
+  const BenchmarkOptions &options_;
+  BenchmarkReporter &reporter_;
+};
+
+template <class T, class K>
+Suite<T, K>::Suite(const std::string &container, const Workload<K> &workload,
+                   const BenchmarkOptions &options,
+                   BenchmarkReporter &reporter)
+    : container_(container), workload_(workload), options_(options),
+      reporter_(reporter) {}
+
+template <class T, class K> void Suite<T, K>::Fill(T &tree) {
+  Populate(tree, workload_.random_keys);
+}
+
+template <class T, class K>
+template <class Setup, class Body>
+void Suite<T, K>::Measure(const std::string &phase, size_t operations,
+                          Setup setup, Body body) {
+  const std::string name =
+      container_ + "/" + KeyFactory<K>::Name() + "/" + phase;
+  if (name.find(options_.filter) == std::string::npos) {
+    return;
+  }
+  BenchmarkResult result;
+  result.container = container_;
+  result.key_type = KeyFactory<K>::Name();
+  result.phase = phase;
+  result.size = workload_.random_keys.size();
+  result.operations = operations;
+  BenchmarkTimer timer;
+  BenchmarkCounter counter;
+  for (size_t i = 0; i < options_.warmup + options_.repeats; i++) {
+    T *tree = new T();
+    if (!setup(*tree)) {
+      delete tree;
+      return;
+    }
+    counter.Start();
+    timer.Start();
+    body(*tree);
+    const double elapsed = timer.Stop();
+    const double misses = counter.Stop();
+    delete tree;
+    if (i >= options_.warmup) {
+      result.samples.push_back(elapsed);
+      if (counter.Available()) {
+        result.tlb_misses.push_back(misses);
+      }
+    }
+  }
+  reporter_.Report(result);
+}
+
+template <class T, class K> void Suite<T, K>::RunReads() {
+  const Workload<K> &w = workload_;
+  const size_t size = w.random_keys.size();
+  auto filled = [this](T &tree) {
+    Fill(tree);
+    return true;
+  };
+  Measure("lookup_hit", size, filled, [&w](T &tree) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < w.lookup_order.size(); i++) {
+      found += Contains(tree, w.random_keys[w.lookup_order[i]]);
+    }
+    sink = found;
+  });
+  Measure("lookup_miss", size, filled, [&w](T &tree) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < w.missing_keys.size(); i++) {
+      found += Contains(tree, w.missing_keys[i]);
+    }
+    sink = found;
+  });
+  const size_t scans = std::max<size_t>(1, size / kScanLength);
+  Measure("range_scan", scans * kScanLength, filled, [&w, scans](T &tree) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < scans; i++) {
+      sum += Scan(tree, w.random_keys[w.lookup_order[i]], kScanLength);
+    }
+    sink = sum;
+  });
+  Measure("full_scan", size, filled, [](T &tree) { sink = FullScan(tree); });
+  Measure("iterator_scan", size, filled,
+          [](T &tree) { sink = IteratorScan(tree); });
+  const size_t threads = options_.threads;
+  Measure("parallel_scan", size,
+          [this](T &tree) {
+            Fill(tree);
+            return Parallel(tree);
+          },
+          [threads](T &tree) { sink = ParallelScan(tree, threads); });
+}
+
+template <class T, class K> void Suite<T, K>::Run() {
+  const Workload<K> &w = workload_;
+  const size_t size = w.random_keys.size();
+  auto empty = [](T &tree) { return true; };
+  auto filled = [this](T &tree) {
+    Fill(tree);
+    return true;
+  };
+  Measure("random_insert", size, empty, [&w](T &tree) {
+    for (size_t i = 0; i < w.random_keys.size(); i++) {
+      Insert(tree, w.random_keys[i], i);
+    }
+  });
+  Measure("sequential_insert", size, empty, [&w](T &tree) {
+    for (size_t i = 0; i < w.sequential_keys.size(); i++) {
+      Insert(tree, w.sequential_keys[i], i);
+    }
+  });
+  RunReads();
+  Measure("random_erase", size, filled, [&w](T &tree) {
+    for (size_t i = 0; i < w.erase_order.size(); i++) {
+      Erase(tree, w.random_keys[w.erase_order[i]]);
+    }
+  });
+  auto queued = [this](T &tree) {
+    Fill(tree);
+    return Queue(tree);
+  };
+  Measure("pop_front", size, queued, [size](T &tree) {
+    for (size_t i = 0; i < size; i++) {
+      PopFront(tree);
+    }
+  });
+  Measure("erase_front", size, queued, [size](T &tree) {
+    for (size_t i = 0; i < size; i++) {
+      EraseFront(tree);
+    }
+  });
+  Measure("save", size,
+          [this](T &tree) {
+            Fill(tree);
+            return Persistent(tree);
+          },
+          [](T &tree) { Save(tree); });
+  Measure("load", size,
+          [this](T &tree) {
+            if (!Persistent(tree)) {
+              return false;
+            }
+            T saved;
+            Fill(saved);
+            Save(saved);
+            return true;
+          },
+          [](T &tree) { Load(tree); });
+}
+
+template <class K>
+static void RunKeyType(const BenchmarkOptions &options,
+                       BenchmarkReporter &reporter) {
+  for (size_t i = 0; i < options.sizes.size(); i++) {
+    Workload<K> workload(options.sizes[i], options.seed);
+    Suite<Map<K, uint64_t>, K>("bptree", workload, options, reporter).Run();
+    Suite<IndexedMap<K>, K>("hashed", workload, options, reporter).Run();
+    Suite<ArenaMap<K>, K>("arena", workload, options, reporter).Run();
+    Suite<std::map<K, uint64_t>, K>("std::map", workload, options, reporter)
+        .Run();
+    Suite<Multimap<K, uint64_t>, K>("multimap", workload, options, reporter)
+        .Run();
+    Suite<std::multimap<K, uint64_t>, K>("std::multimap", workload, options,
+                                         reporter)
+        .Run();
+    Suite<ValueLogMap<K, uint64_t>, K>("valuelog", workload, options, reporter)
+        .Run();
+    Suite<FrozenMap<K, uint64_t>, K>("frozen", workload, options, reporter)
+        .RunReads();
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchmarkOptions options;
+  if (!options.Parse(argc, argv)) {
+    std::cerr << "usage: " << argv[0]
+              << " [--format=text|csv|json] [--filter=substring]"
+                 " [--sizes=n1,n2,...] [--warmup=n] [--repeats=n] [--seed=n]"
+                 " [--threads=n]"
+              << std::endl;
+    return 1;
+  }
+  BenchmarkReporter reporter(options.format, std::cout);
+  reporter.Begin();
+  RunKeyType<uint64_t>(options, reporter);
+  RunKeyType<double>(options, reporter);
+  RunKeyType<std::string>(options, reporter);
+  reporter.End();
+  std::remove(SaveFile().c_str());
+  return 0;
+}
@@ -0,0 +1,405 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class BenchmarkOptions {
+public:
+  BenchmarkOptions();
+  bool Parse(int argc, char **argv);
+  std::string format;
+  std::string filter;
+  std::string distribution;
+  std::vector<size_t> sizes;
+  size_t operations;
+  size_t threads;
+  size_t warmup;
+  size_t repeats;
+  uint64_t seed;
+};
+
+BenchmarkOptions::BenchmarkOptions()
+    : format("text"), sizes{1000, 10000, 100000, 1000000},
+      operations(0), threads(0), warmup(1), repeats(5), seed(123456789) {}
+
+bool BenchmarkOptions::Parse(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string argument = argv[i];
+    const size_t equals = argument.find('=');
+    if (argument.compare(0, 2, "--") != 0 || equals == std::string::npos) {
+      std::cerr << "unknown argument " << argument << std::endl;
+      return false;
+    }
+    const std::string name = argument.substr(2, equals - 2);
+    const std::string value = argument.substr(equals + 1);
+    if (name == "format") {
+      format = value;
+    } else if (name == "filter") {
+      filter = value;
+    } else if (name == "distribution") {
+      distribution = value;
+    } else if (name == "operations") {
+      operations = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "threads") {
+      threads = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "warmup") {
+      warmup = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "repeats") {
+      repeats = std::max<size_t>(1, std::strtoull(value.c_str(), nullptr, 10));
+    } else if (name == "seed") {
+      seed = std::strtoull(value.c_str(), nullptr, 10);
+    } else if (name == "sizes") {
+      sizes.clear();
+      size_t begin = 0;
+      while (begin < value.length()) {
+        size_t end = value.find(',', begin);
+        if (end == std::string::npos) {
+          end = value.length();
+        }
+        sizes.push_back(
+            std::strtoull(value.substr(begin, end - begin).c_str(), nullptr,
+                          10));
+        begin = end + 1;
+      }
+    } else {
+      std::cerr << "unknown argument " << argument << std::endl;
+      return false;
+    }
+  }
+  if (format != "text" && format != "csv" && format != "json") {
+    std::cerr << "unknown format " << format << std::endl;
+    return false;
+  }
+  return true;
+}
+
+class BenchmarkTimer {
+public:
+  BenchmarkTimer();
+  void Start();
+  double Stop();
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+BenchmarkTimer::BenchmarkTimer() : start_(std::chrono::steady_clock::now()) {}
+
+void BenchmarkTimer::Start() { start_ = std::chrono::steady_clock::now(); }
+
+double BenchmarkTimer::Stop() {
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start_;
+  return elapsed.count();
+}
+
+// Counts the data TLB read misses of the calling thread with
+// perf_event_open. Where the kernel or the machine does not offer the event,
+// for example in most virtual machines, Available() is false and the
+// reporters print n/a instead.
+class BenchmarkCounter {
+public:
+  BenchmarkCounter();
+  ~BenchmarkCounter();
+  bool Available() const;
+  void Start();
+  double Stop();
+
+private:
+  int fd_;
+};
+
+BenchmarkCounter::BenchmarkCounter() : fd_(-1) {
+#ifdef __linux__
+  perf_event_attr attributes;
+  memset(&attributes, 0, sizeof(attributes));
+  attributes.size = sizeof(attributes);
+  attributes.type = PERF_TYPE_HW_CACHE;
+  attributes.config = PERF_COUNT_HW_CACHE_DTLB |
+                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attributes.disabled = 1;
+  attributes.exclude_kernel = 1;
+  attributes.exclude_hv = 1;
+  fd_ = syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+#endif
+}
+
+BenchmarkCounter::~BenchmarkCounter() {
+#ifdef __linux__
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+#endif
+}
+
+bool BenchmarkCounter::Available() const { return fd_ >= 0; }
+
+void BenchmarkCounter::Start() {
+#ifdef __linux__
+  if (fd_ >= 0) {
+    ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+double BenchmarkCounter::Stop() {
+  uint64_t count = 0;
+#ifdef __linux__
+  if (fd_ >= 0) {
+    ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+      count = 0;
+    }
+  }
+#endif
+  return static_cast<double>(count);
+}
+
+class BenchmarkResult {
+public:
+  std::string container;
+  std::string key_type;
+  std::string phase;
+  size_t size;
+  size_t operations;
+  std::vector<double> samples;
+  std::vector<double> tlb_misses;
+  double Median() const;
+  double Minimum() const;
+  double Maximum() const;
+  double Mean() const;
+  double Percentile(double fraction) const;
+  double TlbMisses() const;
+};
+
+double BenchmarkResult::Median() const {
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  const size_t middle = sorted.size() / 2;
+  if (sorted.size() % 2 == 0) {
+    return 0.5 * (sorted[middle - 1] + sorted[middle]);
+  }
+  return sorted[middle];
+}
+
+// Returns the median number of data TLB misses per operation, or a
+// negative number if they were not counted.
+double BenchmarkResult::TlbMisses() const {
+  if (tlb_misses.empty()) {
+    return -1.0;
+  }
+  std::vector<double> sorted = tlb_misses;
+  std::sort(sorted.begin(), sorted.end());
+  return sorted[sorted.size() / 2] / std::max<size_t>(1, operations);
+}
+
+double BenchmarkResult::Minimum() const {
+  return *std::min_element(samples.begin(), samples.end());
+}
+
+double BenchmarkResult::Maximum() const {
+  return *std::max_element(samples.begin(), samples.end());
+}
+
+double BenchmarkResult::Mean() const {
+  double sum = 0.0;
+  for (size_t i = 0; i < samples.size(); i++) {
+    sum += samples[i];
+  }
+  return sum / samples.size();
+}
+
+double BenchmarkResult::Percentile(double fraction) const {
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  const size_t rank = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+class BenchmarkReporter {
+public:
+  BenchmarkReporter(const std::string &format, std::ostream &stream);
+  void Begin();
+  void BeginLatency();
+  void Report(const BenchmarkResult &result);
+  void ReportLatency(const BenchmarkResult &result);
+  void End();
+
+private:
+  std::string format_;
+  std::ostream &stream_;
+  size_t count_;
+};
+
+BenchmarkReporter::BenchmarkReporter(const std::string &format,
+                                     std::ostream &stream)
+    : format_(format), stream_(stream), count_(0) {}
+
+void BenchmarkReporter::Begin() {
+  char line[256];
+  if (format_ == "json") {
+    stream_ << "[" << std::endl;
+  } else if (format_ == "csv") {
+    stream_ << "container,key_type,phase,size,operations,repeats,"
+               "median_ns_per_op,min_ns_per_op,max_ns_per_op,mean_ns_per_op,"
+               "dtlb_misses_per_op"
+            << std::endl;
+  } else {
+    snprintf(line, sizeof(line), "%-13s %-8s %-18s %10s %12s %12s %12s %10s",
+             "container", "key", "phase", "size", "median_ns", "min_ns",
+             "max_ns", "dtlb_miss");
+    stream_ << line << std::endl;
+  }
+}
+
+void BenchmarkReporter::BeginLatency() {
+  char line[256];
+  if (format_ == "json") {
+    stream_ << "[" << std::endl;
+  } else if (format_ == "csv") {
+    stream_ << "container,workload,operation,records,operations,ops_per_sec,"
+               "p50_ns,p90_ns,p99_ns,p999_ns,max_ns"
+            << std::endl;
+  } else {
+    snprintf(line, sizeof(line),
+             "%-10s %-18s %-8s %10s %10s %12s %10s %10s %10s %10s %10s",
+             "container", "workload", "op", "records", "count", "ops/sec",
+             "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns");
+    stream_ << line << std::endl;
+  }
+}
+
+void BenchmarkReporter::ReportLatency(const BenchmarkResult &result) {
+  const double seconds = 1e-9 * result.Mean() * result.samples.size();
+  const double throughput = seconds > 0.0 ? result.operations / seconds : 0.0;
+  char line[512];
+  if (format_ == "json") {
+    snprintf(line, sizeof(line),
+             "%s  {\"container\": \"%s\", \"workload\": \"%s\", "
+             "\"operation\": \"%s\", \"records\": %zu, "
+             "\"operations\": %zu, \"ops_per_sec\": %.1f, "
+             "\"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, "
+             "\"p999_ns\": %.1f, \"max_ns\": %.1f}",
+             count_ == 0 ? "" : ",\n", result.container.c_str(),
+             result.key_type.c_str(), result.phase.c_str(), result.size,
+             result.operations, throughput, result.Percentile(0.5),
+             result.Percentile(0.9), result.Percentile(0.99),
+             result.Percentile(0.999), result.Maximum());
+    stream_ << line;
+  } else if (format_ == "csv") {
+    snprintf(line, sizeof(line),
+             "%s,%s,%s,%zu,%zu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f",
+             result.container.c_str(), result.key_type.c_str(),
+             result.phase.c_str(), result.size, result.operations, throughput,
+             result.Percentile(0.5), result.Percentile(0.9),
+             result.Percentile(0.99), result.Percentile(0.999),
+             result.Maximum());
+    stream_ << line << std::endl;
+  } else {
+    snprintf(line, sizeof(line),
+             "%-10s %-18s %-8s %10zu %10zu %12.0f %10.0f %10.0f %10.0f "
+             "%10.0f %10.0f",
+             result.container.c_str(), result.key_type.c_str(),
+             result.phase.c_str(), result.size, result.operations, throughput,
+             result.Percentile(0.5), result.Percentile(0.9),
+             result.Percentile(0.99), result.Percentile(0.999),
+             result.Maximum());
+    stream_ << line << std::endl;
+  }
+  count_++;
+}
+
+void BenchmarkReporter::Report(const BenchmarkResult &result) {
+  const double scale = 1.0 / std::max<size_t>(1, result.operations);
+  const double misses = result.TlbMisses();
+  char line[512];
+  char tlb[32];
+  if (format_ == "json") {
+    if (misses < 0.0) {
+      snprintf(tlb, sizeof(tlb), "null");
+    } else {
+      snprintf(tlb, sizeof(tlb), "%.3f", misses);
+    }
+    snprintf(line, sizeof(line),
+             "%s  {\"container\": \"%s\", \"key_type\": \"%s\", "
+             "\"phase\": \"%s\", \"size\": %zu, \"operations\": %zu, "
+             "\"repeats\": %zu, \"median_ns_per_op\": %.3f, "
+             "\"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f, "
+             "\"mean_ns_per_op\": %.3f, \"dtlb_misses_per_op\": %s}",
+             count_ == 0 ? "" : ",\n", result.container.c_str(),
+             result.key_type.c_str(), result.phase.c_str(), result.size,
+             result.operations, result.samples.size(),
+             result.Median() * scale, result.Minimum() * scale,
+             result.Maximum() * scale, result.Mean() * scale, tlb);
+    stream_ << line;
+  } else if (format_ == "csv") {
+    if (misses < 0.0) {
+      tlb[0] = '\0';
+    } else {
+      snprintf(tlb, sizeof(tlb), "%.3f", misses);
+    }
+    snprintf(line, sizeof(line),
+             "%s,%s,%s,%zu,%zu,%zu,%.3f,%.3f,%.3f,%.3f,%s",
+             result.container.c_str(), result.key_type.c_str(),
+             result.phase.c_str(), result.size, result.operations,
+             result.samples.size(), result.Median() * scale,
+             result.Minimum() * scale, result.Maximum() * scale,
+             result.Mean() * scale, tlb);
+    stream_ << line << std::endl;
+  } else {
+    if (misses < 0.0) {
+      snprintf(tlb, sizeof(tlb), "n/a");
+    } else {
+      snprintf(tlb, sizeof(tlb), "%.3f", misses);
+    }
+    snprintf(line, sizeof(line),
+             "%-13s %-8s %-18s %10zu %12.2f %12.2f %12.2f %10s",
+             result.container.c_str(), result.key_type.c_str(),
+             result.phase.c_str(), result.size, result.Median() * scale,
+             result.Minimum() * scale, result.Maximum() * scale, tlb);
+    stream_ << line << std::endl;
+  }
+  count_++;
+}
+
+void BenchmarkReporter::End() {
+  if (format_ == "json") {
+    stream_ << std::endl << "]" << std::endl;
+  }
+}
@@ -22,25 +22,54 @@ SOFTWARE. */
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <deque>
+#include <exception>
 #include <fstream>
 #include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <stack>
+#include <stdexcept>
+#include <thread>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #undef INNER_NODE_BINARY_SEARCH
 #undef OUTER_NODE_BINARY_SEARCH
+#undef OUTER_NODE_INTERPOLATION_SEARCH
+#undef MAP_LATENCY_HISTOGRAMS
+#undef MAP_LATENCY_RDTSC
+#undef MAP_SUBTREE_COUNTS
+
+#ifdef MAP_LATENCY_RDTSC
+#include <x86intrin.h>
+#endif
+
+#if __cplusplus > 201703L
+#include <compare>
+#endif
 
 #define INNER_NODE_DEGREE 32
 #define OUTER_NODE_DEGREE 32
+#define MAP_LATENCY_SAMPLE_INTERVAL 64
+#define MAP_PREFETCH_DISTANCE 4
+#define MAP_CACHE_LINE_SIZE 64
 
 class RandomGenerator {
 public:
@@ -88,6 +117,247 @@ std::string RandomGenerator::Uuid(size_t length) {
   return uuid;
 }
 
+// Runs a fixed set of independent tasks on several threads. Every thread
+// starts with a contiguous share of the tasks and works through it from the
+// front; a thread that runs dry steals from the back of another queue, far
+// away from where its owner is working. The calling thread works as well.
+class WorkStealingPool {
+public:
+  WorkStealingPool(size_t threads = 0);
+  virtual ~WorkStealingPool();
+  size_t Threads() const;
+  void Run(size_t tasks, const std::function<void(size_t)> &task);
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> tasks;
+  };
+  bool Next(size_t worker, size_t &task);
+  void Work(size_t worker, const std::function<void(size_t)> &task);
+  size_t threads_;
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::atomic<bool> failed_;
+  std::mutex error_mutex_;
+  std::exception_ptr error_;
+};
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+    : threads_(threads), failed_(false) {
+  if (threads_ == 0) {
+    threads_ = std::max<size_t>(1, std::thread::hardware_concurrency());
+  }
+  for (size_t i = 0; i < threads_; i++) {
+    queues_.emplace_back(new Queue());
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {}
+
+size_t WorkStealingPool::Threads() const { return threads_; }
+
+// Returns once all tasks are done. The first exception thrown by a task
+// stops the remaining ones from starting and is rethrown here.
+void WorkStealingPool::Run(size_t tasks,
+                           const std::function<void(size_t)> &task) {
+  const size_t workers = std::min(threads_, tasks);
+  for (size_t i = 0; i < workers; i++) {
+    const size_t begin = tasks * i / workers;
+    const size_t end = tasks * (i + 1) / workers;
+    for (size_t j = begin; j < end; j++) {
+      queues_[i]->tasks.push_back(j);
+    }
+  }
+  failed_ = false;
+  error_ = nullptr;
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers; i++) {
+    threads.emplace_back(&WorkStealingPool::Work, this, i, std::cref(task));
+  }
+  if (workers > 0) {
+    Work(0, task);
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  for (size_t i = 0; i < workers; i++) {
+    queues_[i]->tasks.clear();
+  }
+  if (error_ != nullptr) {
+    std::rethrow_exception(error_);
+  }
+}
+
+bool WorkStealingPool::Next(size_t worker, size_t &task) {
+  if (failed_) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queues_[worker]->mutex);
+    std::deque<size_t> &own = queues_[worker]->tasks;
+    if (!own.empty()) {
+      task = own.front();
+      own.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues_.size(); i++) {
+    Queue &victim = *queues_[(worker + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.back();
+      victim.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::Work(size_t worker,
+                            const std::function<void(size_t)> &task) {
+  size_t index;
+  while (Next(worker, index)) {
+    try {
+      task(index);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      if (error_ == nullptr) {
+        error_ = std::current_exception();
+      }
+      failed_ = true;
+    }
+  }
+}
+
+// Hands out memory from 2 MB chunks that are mapped with mmap and advised as
+// transparent huge pages, so that a tree of many small nodes is covered by
+// few TLB entries. Blocks are carved off the current chunk front to back and
+// released blocks are kept on free lists per 16 byte size class for reuse;
+// chunks are only unmapped when the resource is destroyed. Blocks that are
+// larger than kMaxBlock or need more than kGranularity alignment come from
+// upstream. If mmap fails, chunks come from upstream as well, and if the
+// kernel declines the advice, the chunk is simply backed by regular pages.
+// The resource is not thread-safe, just like the trees that allocate from
+// it.
+class HugePageResource : public std::pmr::memory_resource {
+public:
+  static const size_t kChunkSize = size_t(2) << 20;
+  static const size_t kGranularity = 16;
+  static const size_t kMaxBlock = size_t(64) << 10;
+  HugePageResource(
+      std::pmr::memory_resource *upstream = std::pmr::new_delete_resource());
+  HugePageResource(const HugePageResource &) = delete;
+  HugePageResource &operator=(const HugePageResource &) = delete;
+  virtual ~HugePageResource();
+  size_t Chunks() const;
+  size_t HugeChunks() const;
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *block, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override;
+
+private:
+  struct Chunk {
+    char *memory;
+    bool mapped;
+  };
+  void NewChunk();
+  std::pmr::memory_resource *upstream_;
+  std::vector<Chunk> chunks_;
+  std::vector<void *> free_lists_;
+  char *cursor_;
+  char *end_;
+  size_t huge_chunks_;
+};
+
+HugePageResource::HugePageResource(std::pmr::memory_resource *upstream)
+    : upstream_(upstream), free_lists_(kMaxBlock / kGranularity, nullptr),
+      cursor_(nullptr), end_(nullptr), huge_chunks_(0) {}
+
+HugePageResource::~HugePageResource() {
+  for (size_t i = 0; i < chunks_.size(); i++) {
+    if (chunks_[i].mapped) {
+      munmap(chunks_[i].memory, kChunkSize);
+    } else {
+      upstream_->deallocate(chunks_[i].memory, kChunkSize, kGranularity);
+    }
+  }
+}
+
+size_t HugePageResource::Chunks() const { return chunks_.size(); }
+
+// Returns how many chunks the kernel accepted the huge page advice for.
+// Whether it actually backs them with huge pages depends on the setting in
+// /sys/kernel/mm/transparent_hugepage/enabled and on memory fragmentation.
+size_t HugePageResource::HugeChunks() const { return huge_chunks_; }
+
+void *HugePageResource::do_allocate(size_t bytes, size_t alignment) {
+  if (bytes > kMaxBlock || alignment > kGranularity) {
+    return upstream_->allocate(bytes, alignment);
+  }
+  const size_t size_class = (std::max<size_t>(1, bytes) - 1) / kGranularity;
+  void *block = free_lists_[size_class];
+  if (block != nullptr) {
+    free_lists_[size_class] = *static_cast<void **>(block);
+    return block;
+  }
+  const size_t size = (size_class + 1) * kGranularity;
+  if (static_cast<size_t>(end_ - cursor_) < size) {
+    NewChunk();
+  }
+  block = cursor_;
+  cursor_ += size;
+  return block;
+}
+
+void HugePageResource::do_deallocate(void *block, size_t bytes,
+                                     size_t alignment) {
+  if (bytes > kMaxBlock || alignment > kGranularity) {
+    upstream_->deallocate(block, bytes, alignment);
+    return;
+  }
+  const size_t size_class = (std::max<size_t>(1, bytes) - 1) / kGranularity;
+  *static_cast<void **>(block) = free_lists_[size_class];
+  free_lists_[size_class] = block;
+}
+
+bool HugePageResource::do_is_equal(
+    const std::pmr::memory_resource &other) const noexcept {
+  return this == &other;
+}
+
+// Maps twice the chunk size and trims it down to an aligned chunk, since
+// the kernel can only use a huge page for an aligned 2 MB range.
+void HugePageResource::NewChunk() {
+  Chunk chunk = {nullptr, false};
+  void *memory = mmap(nullptr, 2 * kChunkSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory != MAP_FAILED) {
+    char *begin = static_cast<char *>(memory);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(begin);
+    const size_t head = (kChunkSize - address % kChunkSize) % kChunkSize;
+    if (head > 0) {
+      munmap(begin, head);
+    }
+    munmap(begin + head + kChunkSize, kChunkSize - head);
+    chunk.memory = begin + head;
+    chunk.mapped = true;
+#ifdef MADV_HUGEPAGE
+    if (madvise(chunk.memory, kChunkSize, MADV_HUGEPAGE) == 0) {
+      huge_chunks_++;
+    }
+#endif
+  } else {
+    chunk.memory =
+        static_cast<char *>(upstream_->allocate(kChunkSize, kGranularity));
+  }
+  chunks_.push_back(chunk);
+  cursor_ = chunk.memory;
+  end_ = chunk.memory + kChunkSize;
+}
+
 template <class T> class Serializer;
 
 template <class T> class Serializer {
@@ -102,15 +372,20 @@ public:
   }
 };
 
-template <> class Serializer<std::string> {
+// Strings and vectors are serialized alike for every allocator, so trees of
+// std::pmr::string keys or std::pmr::vector values share the file format.
+template <class A>
+class Serializer<std::basic_string<char, std::char_traits<char>, A>> {
+  typedef std::basic_string<char, std::char_traits<char>, A> String;
+
 public:
-  size_t Serialize(const std::string &object, std::ostream &stream) {
+  size_t Serialize(const String &object, std::ostream &stream) {
     size_t length = object.length();
     stream.write((const char *)&length, sizeof(size_t));
     stream.write((const char *)&object[0], length);
     return sizeof(size_t) + length;
   }
-  size_t Deserialize(std::string &object, std::istream &stream) {
+  size_t Deserialize(String &object, std::istream &stream) {
     object.clear();
     size_t length;
     stream.read((char *)&length, sizeof(size_t));
@@ -221,9 +496,9 @@ public:
   }
 };
 
-template <class T> class Serializer<std::vector<T>> {
+template <class T, class A> class Serializer<std::vector<T, A>> {
 public:
-  size_t Serialize(const std::vector<T> &object, std::ostream &stream) {
+  size_t Serialize(const std::vector<T, A> &object, std::ostream &stream) {
     size_t size = object.size();
     stream.write((const char *)&size, sizeof(size_t));
     for (size_t i = 0; i < size; i++) {
@@ -231,7 +506,7 @@ public:
     }
     return sizeof(size_t) + size * sizeof(T);
   }
-  size_t Deserialize(std::vector<T> &object, std::istream &stream) {
+  size_t Deserialize(std::vector<T, A> &object, std::istream &stream) {
     object.clear();
     size_t size;
     stream.read((char *)&size, sizeof(size_t));
@@ -243,10 +518,14 @@ public:
   }
 };
 
-template <> class Serializer<std::vector<std::string>> {
+template <class C, class A>
+class Serializer<
+    std::vector<std::basic_string<char, std::char_traits<char>, C>, A>> {
+  typedef std::vector<std::basic_string<char, std::char_traits<char>, C>, A>
+      Vector;
+
 public:
-  size_t Serialize(const std::vector<std::string> &object,
-                   std::ostream &stream) {
+  size_t Serialize(const Vector &object, std::ostream &stream) {
     size_t result = 0;
     size_t size = object.size();
     stream.write((const char *)&size, sizeof(size_t));
@@ -259,7 +538,7 @@ public:
     }
     return result;
   }
-  size_t Deserialize(std::vector<std::string> &object, std::istream &stream) {
+  size_t Deserialize(Vector &object, std::istream &stream) {
     size_t result = 0;
     object.clear();
     size_t size;
@@ -282,20 +561,573 @@ template <class T> Serializer<T> &SerializerInstance() {
   return serializer;
 }
 
+template <class T> class HeapSize {
+public:
+  size_t Measure(const T &) { return 0; }
+};
+
+template <class A>
+class HeapSize<std::basic_string<char, std::char_traits<char>, A>> {
+  typedef std::basic_string<char, std::char_traits<char>, A> String;
+
+public:
+  size_t Measure(const String &object) {
+    static const size_t local_capacity = std::string().capacity();
+    return object.capacity() > local_capacity ? object.capacity() + 1 : 0;
+  }
+};
+
+template <class T, class A> class HeapSize<std::vector<T, A>> {
+public:
+  size_t Measure(const std::vector<T, A> &object) {
+    size_t result = object.capacity() * sizeof(T);
+    for (size_t i = 0; i < object.size(); i++) {
+      result += HeapSize<T>().Measure(object[i]);
+    }
+    return result;
+  }
+};
+
+template <class T> class StandardHash {
+public:
+  size_t Hash(const T &object) { return std::hash<T>()(object); }
+};
+
+template <class A>
+class StandardHash<std::basic_string<char, std::char_traits<char>, A>> {
+public:
+  typedef void is_transparent;
+  size_t Hash(std::string_view object) {
+    return std::hash<std::string_view>()(object);
+  }
+};
+
+template <class T> class KeyHash : public StandardHash<T> {};
+
+// The ascending order of operator<. Compare is the matching three-way
+// comparison, negative, zero or positive, and uses operator<=> where the key
+// type provides it so that one call decides both less and equal.
+template <class T> class NaturalCompare {
+public:
+  bool Less(const T &left, const T &right) const { return left < right; }
+  int Compare(const T &left, const T &right) const {
+#if __cplusplus > 201703L
+    if constexpr (std::three_way_comparable<T>) {
+      const auto order = left <=> right;
+      return order < 0 ? -1 : (order > 0 ? 1 : 0);
+    }
+#endif
+    return left < right ? -1 : (right < left ? 1 : 0);
+  }
+};
+
+// Transparent: string views and literals are compared against the keys
+// without building a std::string.
+template <class A>
+class NaturalCompare<std::basic_string<char, std::char_traits<char>, A>> {
+public:
+  typedef void is_transparent;
+  bool Less(std::string_view left, std::string_view right) const {
+    return left.compare(right) < 0;
+  }
+  int Compare(std::string_view left, std::string_view right) const {
+    return left.compare(right);
+  }
+};
+
+// The default order of the keys of a tree. For descending, case-insensitive
+// or composite orders specialize it, or pass a class with the same const
+// members as the Compare parameter of Map. Less must be a strict weak order
+// and Compare consistent with it. Keys that compare equal must hash alike
+// when the hash index is enabled, so specialize KeyHash along with it.
+template <class T> class KeyCompare : public NaturalCompare<T> {};
+
+// Adapts the Less of a key order to the standard algorithms.
+template <class C> class KeyLess {
+public:
+  KeyLess(const C &compare) : compare_(compare) {}
+  template <class A, class B>
+  bool operator()(const A &left, const B &right) const {
+    return compare_.Less(left, right);
+  }
+
+private:
+  const C &compare_;
+};
+
+// Tells whether a key order or KeyHash accepts other types than the key,
+// which enables the lookup overloads for them.
+template <class T, class = void>
+class IsTransparent : public std::false_type {};
+
+template <class T>
+class IsTransparent<T, typename std::conditional<
+                           true, void, typename T::is_transparent>::type>
+    : public std::true_type {};
+
+template <class C, class Q>
+using TransparentKey =
+    typename std::enable_if<IsTransparent<C>::value, Q>::type;
+
+// Finds the first key not less than key in a sorted vector. Arithmetic keys
+// in their natural order guess the position by interpolating between the
+// first and the last key and gallop from there, so the cost grows with the
+// logarithm of the guess error instead of the node size. Other keys and
+// orders use binary search.
+template <class K, class C,
+          bool = std::is_arithmetic<K>::value &&
+                 std::is_base_of<NaturalCompare<K>, C>::value>
+class KeySearch {
+public:
+  template <class Q>
+  static size_t LowerBound(const std::pmr::vector<K> &keys, const Q &key,
+                           const C &compare) {
+    return std::lower_bound(keys.begin(), keys.end(), key,
+                            KeyLess<C>(compare)) -
+           keys.begin();
+  }
+};
+
+template <class K, class C> class KeySearch<K, C, true> {
+public:
+  static size_t LowerBound(const std::pmr::vector<K> &keys, const K &key,
+                           const C &) {
+    const size_t size = keys.size();
+    if (size == 0 || !(keys.front() < key)) {
+      return 0;
+    }
+    if (keys.back() < key) {
+      return size;
+    }
+    const double front = static_cast<double>(keys.front());
+    const double fraction =
+        (static_cast<double>(key) - front) /
+        (static_cast<double>(keys.back()) - front);
+    const size_t guess = std::min<size_t>(size - 1, fraction * (size - 1));
+    size_t low;
+    size_t high;
+    size_t step = 1;
+    if (keys[guess] < key) {
+      low = guess;
+      while (low + step < size && keys[low + step] < key) {
+        low += step;
+        step *= 2;
+      }
+      high = std::min(low + step, size);
+    } else {
+      high = guess;
+      while (high >= step && !(keys[high - step] < key)) {
+        high -= step;
+        step *= 2;
+      }
+      low = high >= step ? high - step : 0;
+    }
+    return std::lower_bound(keys.begin() + low, keys.begin() + high, key) -
+           keys.begin();
+  }
+};
+
+// Copies a stored key with the resource of its array. The plain copy
+// constructor of allocator-aware keys such as std::pmr::string would take the
+// default resource instead.
+template <class K>
+inline K CopyKey(const std::pmr::vector<K> &keys, size_t index) {
+  if constexpr (std::uses_allocator<
+                    K, std::pmr::polymorphic_allocator<K>>::value) {
+    return K(keys[index], keys.get_allocator().resource());
+  } else {
+    return keys[index];
+  }
+}
+
+// Prefetches the count elements at data, one cache line at a time, so that
+// the misses on all of them overlap instead of being taken one by one. The
+// empty asm statement keeps the compiler from treating functions that only
+// prefetch as free of side effects and dropping the calls to them.
+template <class T> inline void PrefetchArray(const T *data, size_t count) {
+  const uintptr_t end = reinterpret_cast<uintptr_t>(data + count);
+  for (uintptr_t line = reinterpret_cast<uintptr_t>(data) &
+                        ~uintptr_t(MAP_CACHE_LINE_SIZE - 1);
+       line < end; line += MAP_CACHE_LINE_SIZE) {
+    __builtin_prefetch(reinterpret_cast<const void *>(line));
+    asm volatile("");
+  }
+}
+
+template <class V> inline void AssignValue(V &target) { target = V(); }
+
+template <class V, class U> inline void AssignValue(V &target, U &&value) {
+  target = std::forward<U>(value);
+}
+
+template <class V, class U, class... Args>
+inline void AssignValue(V &target, U &&first, Args &&... args) {
+  target = V(std::forward<U>(first), std::forward<Args>(args)...);
+}
+
+// Reductions over the contiguous values of a leaf. Four independent
+// accumulators break the dependency chain, so the loops pipeline and
+// vectorize for arithmetic values.
+template <class V> inline V SumBlock(const V *values, size_t count) {
+  V sums[4] = {V(), V(), V(), V()};
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    sums[0] += values[i];
+    sums[1] += values[i + 1];
+    sums[2] += values[i + 2];
+    sums[3] += values[i + 3];
+  }
+  for (; i < count; i++) {
+    sums[0] += values[i];
+  }
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+template <class V> inline V MinBlock(const V *values, size_t count) {
+  V minima[4] = {values[0], values[0], values[0], values[0]};
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    minima[0] = values[i] < minima[0] ? values[i] : minima[0];
+    minima[1] = values[i + 1] < minima[1] ? values[i + 1] : minima[1];
+    minima[2] = values[i + 2] < minima[2] ? values[i + 2] : minima[2];
+    minima[3] = values[i + 3] < minima[3] ? values[i + 3] : minima[3];
+  }
+  for (; i < count; i++) {
+    minima[0] = values[i] < minima[0] ? values[i] : minima[0];
+  }
+  return std::min(std::min(minima[0], minima[1]),
+                  std::min(minima[2], minima[3]));
+}
+
+template <class V> inline V MaxBlock(const V *values, size_t count) {
+  V maxima[4] = {values[0], values[0], values[0], values[0]};
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    maxima[0] = maxima[0] < values[i] ? values[i] : maxima[0];
+    maxima[1] = maxima[1] < values[i + 1] ? values[i + 1] : maxima[1];
+    maxima[2] = maxima[2] < values[i + 2] ? values[i + 2] : maxima[2];
+    maxima[3] = maxima[3] < values[i + 3] ? values[i + 3] : maxima[3];
+  }
+  for (; i < count; i++) {
+    maxima[0] = maxima[0] < values[i] ? values[i] : maxima[0];
+  }
+  return std::max(std::max(maxima[0], maxima[1]),
+                  std::max(maxima[2], maxima[3]));
+}
+
+// One partial result of a parallel traversal, alone on its cache line so that
+// threads storing neighbouring results do not invalidate each other's lines.
+template <class T> struct alignas(MAP_CACHE_LINE_SIZE) PaddedPartial {
+  T value;
+};
+
+// Monoid over the elements of a tree. When enabled, every inner node caches
+// the aggregate of each child's subtree and Map::Aggregate combines these
+// summaries with the two partial leaves at the ends of a key range. Lift
+// maps an element into the monoid and Combine must be associative with
+// Identity as neutral element; it is always called in key order. Specialize
+// the template for your key and value types, for example by deriving from
+// SummaryAggregate below.
+template <class K, class V> class MapAggregate {
+public:
+  typedef char Type;
+  static const bool enabled = false;
+  static Type Identity() { return Type(); }
+  static Type Lift(const K &, const V &) { return Type(); }
+  static Type Combine(const Type &left, const Type &) { return left; }
+};
+
+template <class V> struct ValueSummary {
+  size_t count = 0;
+  V sum = V();
+  V minimum = V();
+  V maximum = V();
+};
+
+// Count, sum, minimum and maximum of arithmetic values.
+template <class K, class V> class SummaryAggregate {
+public:
+  typedef ValueSummary<V> Type;
+  static const bool enabled = true;
+  static Type Identity() { return Type(); }
+  static Type Lift(const K &, const V &value) {
+    Type summary;
+    summary.count = 1;
+    summary.sum = value;
+    summary.minimum = value;
+    summary.maximum = value;
+    return summary;
+  }
+  static Type Combine(const Type &left, const Type &right) {
+    if (left.count == 0) {
+      return right;
+    }
+    if (right.count == 0) {
+      return left;
+    }
+    Type summary;
+    summary.count = left.count + right.count;
+    summary.sum = left.sum + right.sum;
+    summary.minimum = std::min(left.minimum, right.minimum);
+    summary.maximum = std::max(left.maximum, right.maximum);
+    return summary;
+  }
+};
+
+#define MAP_COUNT(counter)                                                     \
+  do {                                                                         \
+    if (policy_.count_operations) {                                            \
+      counters_.counter++;                                                     \
+    }                                                                          \
+  } while (false)
+
+struct MapCounters {
+  size_t outer_splits = 0;
+  size_t inner_splits = 0;
+  size_t root_splits = 0;
+  size_t redistributions = 0;
+  size_t coalesces = 0;
+  size_t root_collapses = 0;
+  size_t leaf_releases = 0;
+};
+
+#ifdef MAP_LATENCY_HISTOGRAMS
+#define MAP_TIME(histogram) LatencyTimer map_latency_timer(latencies_.histogram)
+#else
+#define MAP_TIME(histogram)
+#endif
+
+// Log-linear histogram with 16 sub-buckets per power of two, which bounds the
+// relative error of every reported value by 1/16.
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  void Record(uint64_t value);
+  bool Sample();
+  void Merge(const LatencyHistogram &histogram);
+  void Reset();
+  uint64_t Count() const;
+  uint64_t Minimum() const;
+  uint64_t Maximum() const;
+  double Mean() const;
+  uint64_t Percentile(double fraction) const;
+  size_t CountBuckets() const;
+  uint64_t BucketCount(size_t index) const;
+  uint64_t BucketLimit(size_t index) const;
+
+protected:
+  static constexpr size_t kSubBucketBits = 4;
+  static constexpr size_t kSubBuckets = 1 << kSubBucketBits;
+  static constexpr size_t kBuckets = (65 - kSubBucketBits) * kSubBuckets;
+  static size_t BucketIndex(uint64_t value);
+  uint64_t buckets_[kBuckets];
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t minimum_;
+  uint64_t maximum_;
+  uint64_t sequence_;
+};
+
+LatencyHistogram::LatencyHistogram() { Reset(); }
+
+inline size_t LatencyHistogram::BucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+  const size_t magnitude = 63 - __builtin_clzll(value);
+  const size_t shift = magnitude - kSubBucketBits;
+  return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+}
+
+inline void LatencyHistogram::Record(uint64_t value) {
+  buckets_[BucketIndex(value)]++;
+  count_++;
+  sum_ += value;
+  minimum_ = std::min(minimum_, value);
+  maximum_ = std::max(maximum_, value);
+}
+
+inline bool LatencyHistogram::Sample() {
+  return ++sequence_ % MAP_LATENCY_SAMPLE_INTERVAL == 0;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &histogram) {
+  for (size_t i = 0; i < kBuckets; i++) {
+    buckets_[i] += histogram.buckets_[i];
+  }
+  count_ += histogram.count_;
+  sum_ += histogram.sum_;
+  minimum_ = std::min(minimum_, histogram.minimum_);
+  maximum_ = std::max(maximum_, histogram.maximum_);
+}
+
+void LatencyHistogram::Reset() {
+  std::fill(buckets_, buckets_ + kBuckets, 0);
+  count_ = 0;
+  sum_ = 0;
+  minimum_ = std::numeric_limits<uint64_t>::max();
+  maximum_ = 0;
+  sequence_ = 0;
+}
+
+inline uint64_t LatencyHistogram::Count() const { return count_; }
+
+inline uint64_t LatencyHistogram::Minimum() const {
+  return count_ == 0 ? 0 : minimum_;
+}
+
+inline uint64_t LatencyHistogram::Maximum() const { return maximum_; }
+
+inline double LatencyHistogram::Mean() const {
+  return count_ == 0 ? 0.0 : static_cast<double>(sum_) / count_;
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  const uint64_t rank = std::max<uint64_t>(1, fraction * count_ + 0.5);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      return std::max(minimum_, std::min(maximum_, BucketLimit(i)));
+    }
+  }
+  return maximum_;
+}
+
+inline size_t LatencyHistogram::CountBuckets() const { return kBuckets; }
+
+inline uint64_t LatencyHistogram::BucketCount(size_t index) const {
+  return buckets_[index];
+}
+
+// Returns the largest value that is recorded in the bucket at index.
+uint64_t LatencyHistogram::BucketLimit(size_t index) const {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const size_t shift = index / kSubBuckets - 1;
+  const uint64_t lower = (kSubBuckets + index % kSubBuckets) << shift;
+  return lower + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+// Records the lifetime of the enclosing scope in the histogram when the
+// histogram asks for a sample. Ticks are nanoseconds of the steady clock or
+// processor cycles when MAP_LATENCY_RDTSC is defined.
+class LatencyTimer {
+public:
+  LatencyTimer(LatencyHistogram &histogram);
+  ~LatencyTimer();
+  static uint64_t Now();
+
+private:
+  LatencyHistogram *histogram_;
+  uint64_t start_;
+};
+
+inline LatencyTimer::LatencyTimer(LatencyHistogram &histogram)
+    : histogram_(nullptr), start_(0) {
+  if (histogram.Sample()) {
+    histogram_ = &histogram;
+    start_ = Now();
+  }
+}
+
+inline LatencyTimer::~LatencyTimer() {
+  if (histogram_ != nullptr) {
+    histogram_->Record(Now() - start_);
+  }
+}
+
+inline uint64_t LatencyTimer::Now() {
+#ifdef MAP_LATENCY_RDTSC
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+struct MapLatencies {
+  LatencyHistogram put;
+  LatencyHistogram find;
+  LatencyHistogram erase;
+  LatencyHistogram save;
+  LatencyHistogram load;
+  LatencyHistogram split;
+  LatencyHistogram rebalance;
+};
+
+// Shapes a single tree: load_fill is the fraction of the node degrees that
+// Load fills, split_ratio the fraction of keys a splitting node keeps. Splits
+// at the right (left) edge of the leaf chain keep sequential_split_ratio
+// (one minus it) instead when detect_sequential is set, so ascending or
+// descending insertions leave nearly full nodes behind; the new edge node
+// starts far below half full, which only pays off if the insertions really
+// continue along the edge, so it is off by default. With hash_index the
+// tree maintains a MapIndex for point lookups, and with count_operations it
+// counts its structural events for Stats.
+struct MapPolicy {
+  double load_fill = 0.75;
+  double split_ratio = 0.5;
+  double sequential_split_ratio = 0.9;
+  bool detect_sequential = false;
+  bool hash_index = false;
+  bool count_operations = false;
+};
+
+struct MapMemoryUsage {
+  size_t node_headers = 0;
+  size_t key_arrays = 0;
+  size_t value_arrays = 0;
+  size_t child_arrays = 0;
+  size_t slack = 0;
+  size_t key_heap = 0;
+  size_t value_heap = 0;
+  size_t hash_index = 0;
+  size_t total = 0;
+};
+
+struct MapStatistics {
+  size_t size = 0;
+  size_t height = 0;
+  size_t inner_nodes = 0;
+  size_t outer_nodes = 0;
+  std::vector<size_t> level_nodes;
+  double inner_fill = 0.0;
+  double outer_fill = 0.0;
+  MapCounters counters;
+};
+
 class Node;
 
 template <class K, class V> class InnerNode;
 
 template <class K, class V> class OuterNode;
 
-template <class K, class V> class Map;
+template <class K, class V, class Compare = KeyCompare<K>> class Map;
 
-template <class K, class V> class MapIterator;
+template <class K, class V, class Compare = KeyCompare<K>> class MapIterator;
 
 template <class K, class V> class Multimap;
 
 template <class K, class V> class MultimapIterator;
 
+template <class K, class V, class Compare = KeyCompare<K>> class FrozenMap;
+
+template <class K, class V, class Compare = KeyCompare<K>>
+class FrozenMapIterator;
+
+template <class K, class V> class MapIndex;
+
+
+template <class K, class V> class ValueLogMap;
+
+template <class K, class V> class ValueLogMapIterator;
+
 class Node {
 public:
   Node();
@@ -315,13 +1147,13 @@ Node::~Node() {}
 
 template <class K, class V> class InnerNode : public Node {
   template <class, class> friend class ::OuterNode;
-  template <class, class> friend class ::Map;
-  template <class, class> friend class ::MapIterator;
+  template <class, class, class> friend class ::Map;
+  template <class, class, class> friend class ::MapIterator;
   template <class, class> friend class ::Multimap;
   template <class, class> friend class ::MultimapIterator;
 
 public:
-  InnerNode();
+  InnerNode(std::pmr::memory_resource *resource);
   ~InnerNode();
   Node *GetParent();
   void SetParent(Node *node);
@@ -335,23 +1167,40 @@ public:
   Node *Child(size_t index);
   const Node *GetChild(size_t index) const;
   size_t ChildIndex(const Node *child);
-  size_t KeyIndex(const K &key);
+  template <class C> size_t KeyIndex(const K &key, const C &compare);
+  template <class Q, class C> size_t Descend(const Q &key, const C &compare);
   void Insert(Node *left, K &separator, Node *right);
-  void Erase(const K &key, Node *child);
-  std::tuple<InnerNode<K, V> *, K> Split();
+  template <class C> void Erase(const K &key, Node *child, const C &compare);
+  K Split(InnerNode<K, V> *sibling, size_t keys_left);
   size_t SeparatorIndex(InnerNode<K, V> *sibling);
   bool Redistribute(Node *node);
   bool Coalesce(Node *node);
 
 protected:
   Node *parent_;
-  std::vector<K> keys_;
-  std::vector<Node *> children_;
+  std::pmr::vector<K> keys_;
+  std::pmr::vector<Node *> children_;
+#ifdef MAP_SUBTREE_COUNTS
+  std::pmr::vector<size_t> counts_;
+#endif
+  std::pmr::vector<typename MapAggregate<K, V>::Type> aggregates_;
 };
 
-template <class K, class V> InnerNode<K, V>::InnerNode() {
+template <class K, class V>
+InnerNode<K, V>::InnerNode(std::pmr::memory_resource *resource)
+    : parent_(nullptr), keys_(resource), children_(resource),
+#ifdef MAP_SUBTREE_COUNTS
+      counts_(resource),
+#endif
+      aggregates_(resource) {
   keys_.reserve(INNER_NODE_DEGREE + 1);
   children_.reserve(INNER_NODE_DEGREE + 2);
+#ifdef MAP_SUBTREE_COUNTS
+  counts_.reserve(INNER_NODE_DEGREE + 2);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    aggregates_.reserve(INNER_NODE_DEGREE + 2);
+  }
 }
 
 template <class K, class V> InnerNode<K, V>::~InnerNode() {}
@@ -418,48 +1267,79 @@ size_t InnerNode<K, V>::ChildIndex(const Node *child) {
   return std::string::npos;
 }
 
-template <class K, class V> size_t InnerNode<K, V>::KeyIndex(const K &key) {
+template <class K, class V>
+template <class C>
+size_t InnerNode<K, V>::KeyIndex(const K &key, const C &compare) {
 #ifdef INNER_NODE_BINARY_SEARCH
-  typename std::vector<K>::iterator it =
-      lower_bound(keys_.begin(), keys_.end(), key);
-  if (it != keys_.end() && !(key < *it)) {
+  typename std::pmr::vector<K>::iterator it =
+      lower_bound(keys_.begin(), keys_.end(), key, KeyLess<C>(compare));
+  if (it != keys_.end() && !compare.Less(key, *it)) {
     return it - keys_.begin();
   }
   return std::string::npos;
 #else
-  if (keys_.empty()) {
-    return std::string::npos;
-  }
   const size_t size = keys_.size();
-  size_t position = 0;
-  while (position < size && keys_[position] != key) {
-    position++;
-  }
-  if (position < size) {
-    return position;
+  for (size_t position = 0; position < size; position++) {
+    const int order = compare.Compare(keys_[position], key);
+    if (order >= 0) {
+      return order == 0 ? position : std::string::npos;
+    }
   }
   return std::string::npos;
 #endif
 }
 
+// Returns the index of the child whose subtree holds key, that is the number
+// of separators not greater than key, at one comparison per separator.
 template <class K, class V>
-void InnerNode<K, V>::Insert(Node *left, K &separator, Node *right) {
-  left->SetParent(this);
-  right->SetParent(this);
+template <class Q, class C>
+size_t InnerNode<K, V>::Descend(const Q &key, const C &compare) {
+#ifdef INNER_NODE_BINARY_SEARCH
+  return std::upper_bound(keys_.begin(), keys_.end(), key,
+                          KeyLess<C>(compare)) -
+         keys_.begin();
+#else
+  const size_t size = keys_.size();
+  size_t child = 0;
+  while (child < size && !compare.Less(key, keys_[child])) {
+    child++;
+  }
+  return child;
+#endif
+}
+
+template <class K, class V>
+void InnerNode<K, V>::Insert(Node *left, K &separator, Node *right) {
+  left->SetParent(this);
+  right->SetParent(this);
   if (keys_.empty()) {
     children_.push_back(left);
     children_.push_back(right);
-    keys_.push_back(separator);
+    keys_.push_back(std::move(separator));
+#ifdef MAP_SUBTREE_COUNTS
+    counts_.assign(2, 0);
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      aggregates_.assign(2, MapAggregate<K, V>::Identity());
+    }
     return;
   }
   const size_t position = ChildIndex(left);
-  keys_.insert(keys_.begin() + position, separator);
+  keys_.insert(keys_.begin() + position, std::move(separator));
   children_.insert(children_.begin() + position + 1, right);
+#ifdef MAP_SUBTREE_COUNTS
+  counts_.insert(counts_.begin() + position + 1, 0);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    aggregates_.insert(aggregates_.begin() + position + 1,
+                       MapAggregate<K, V>::Identity());
+  }
 }
 
 template <class K, class V>
-void InnerNode<K, V>::Erase(const K &key, Node *child) {
-  const size_t key_position = KeyIndex(key);
+template <class C>
+void InnerNode<K, V>::Erase(const K &key, Node *child, const C &compare) {
+  const size_t key_position = KeyIndex(key, compare);
   if (key_position == std::string::npos) {
     return;
   }
@@ -469,29 +1349,42 @@ void InnerNode<K, V>::Erase(const K &key, Node *child) {
   }
   keys_.erase(keys_.begin() + key_position);
   children_.erase(children_.begin() + child_position);
+#ifdef MAP_SUBTREE_COUNTS
+  counts_.erase(counts_.begin() + child_position);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    aggregates_.erase(aggregates_.begin() + child_position);
+  }
 }
 
 template <class K, class V>
-std::tuple<InnerNode<K, V> *, K> InnerNode<K, V>::Split() {
+K InnerNode<K, V>::Split(InnerNode<K, V> *sibling, size_t keys_left) {
   const size_t size = keys_.size();
-  const size_t keys_left = size / 2;
   const size_t keys_right = size - keys_left - 1;
   const size_t children_left = keys_left + 1;
   const size_t children_right = keys_right + 1;
-  InnerNode<K, V> *sibling = new InnerNode<K, V>();
-  const K up_key = keys_[keys_left];
+  K up_key = std::move(keys_[keys_left]);
   move(keys_.begin() + keys_left + 1, keys_.end(),
        back_inserter(sibling->keys_));
   move(children_.begin() + children_left, children_.end(),
        back_inserter(sibling->children_));
   keys_.erase(keys_.begin() + keys_left, keys_.end());
   children_.erase(children_.begin() + children_left, children_.end());
+#ifdef MAP_SUBTREE_COUNTS
+  sibling->counts_.assign(counts_.begin() + children_left, counts_.end());
+  counts_.erase(counts_.begin() + children_left, counts_.end());
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    sibling->aggregates_.assign(aggregates_.begin() + children_left,
+                                aggregates_.end());
+    aggregates_.erase(aggregates_.begin() + children_left, aggregates_.end());
+  }
   for (auto it = sibling->children_.begin(); it != sibling->children_.end();
        ++it) {
     (*it)->SetParent(sibling);
   }
   sibling->SetParent(parent_);
-  return std::make_tuple(sibling, up_key);
+  return up_key;
 }
 
 template <class K, class V>
@@ -506,12 +1399,21 @@ size_t InnerNode<K, V>::SeparatorIndex(InnerNode<K, V> *sibling) {
 template <class K, class V> bool InnerNode<K, V>::Redistribute(Node *node) {
   InnerNode<K, V> *sibling = static_cast<InnerNode<K, V> *>(node);
   const size_t separator_index = SeparatorIndex(sibling);
-  K up_key = static_cast<InnerNode<K, V> *>(parent_)->keys_[separator_index];
+  K up_key =
+      CopyKey(static_cast<InnerNode<K, V> *>(parent_)->keys_, separator_index);
   if (sibling->keys_.size() >= keys_.size() + 2) {
     keys_.push_back(up_key);
     children_.push_back(sibling->children_.front());
     sibling->children_.erase(sibling->children_.begin());
     children_.back()->SetParent(this);
+#ifdef MAP_SUBTREE_COUNTS
+    counts_.push_back(sibling->counts_.front());
+    sibling->counts_.erase(sibling->counts_.begin());
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      aggregates_.push_back(sibling->aggregates_.front());
+      sibling->aggregates_.erase(sibling->aggregates_.begin());
+    }
     static_cast<InnerNode<K, V> *>(parent_)->keys_[separator_index] =
         sibling->keys_[0];
     sibling->keys_.erase(sibling->keys_.begin());
@@ -522,6 +1424,15 @@ template <class K, class V> bool InnerNode<K, V>::Redistribute(Node *node) {
     sibling->children_.insert(sibling->children_.begin(), children_.back());
     children_.pop_back();
     sibling->children_.front()->SetParent(sibling);
+#ifdef MAP_SUBTREE_COUNTS
+    sibling->counts_.insert(sibling->counts_.begin(), counts_.back());
+    counts_.pop_back();
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      sibling->aggregates_.insert(sibling->aggregates_.begin(),
+                                  aggregates_.back());
+      aggregates_.pop_back();
+    }
     static_cast<InnerNode<K, V> *>(parent_)->keys_[separator_index] =
         keys_.back();
     keys_.pop_back();
@@ -532,12 +1443,12 @@ template <class K, class V> bool InnerNode<K, V>::Redistribute(Node *node) {
 
 template <class K, class V> bool InnerNode<K, V>::Coalesce(Node *node) {
   InnerNode<K, V> *sibling = static_cast<InnerNode<K, V> *>(node);
-  if (keys_.size() + sibling->keys_.size() > INNER_NODE_DEGREE) {
+  if (keys_.size() + sibling->keys_.size() + 1 > INNER_NODE_DEGREE) {
     return false;
   }
   const size_t separator_index = SeparatorIndex(sibling);
   const K up_key =
-      static_cast<InnerNode<K, V> *>(parent_)->keys_[separator_index];
+      CopyKey(static_cast<InnerNode<K, V> *>(parent_)->keys_, separator_index);
   keys_.push_back(up_key);
   move(sibling->keys_.begin(), sibling->keys_.end(), back_inserter(keys_));
   sibling->keys_.clear();
@@ -548,18 +1459,29 @@ template <class K, class V> bool InnerNode<K, V>::Coalesce(Node *node) {
   move(sibling->children_.begin(), sibling->children_.end(),
        back_inserter(children_));
   sibling->children_.clear();
+#ifdef MAP_SUBTREE_COUNTS
+  counts_.insert(counts_.end(), sibling->counts_.begin(),
+                 sibling->counts_.end());
+  sibling->counts_.clear();
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    aggregates_.insert(aggregates_.end(), sibling->aggregates_.begin(),
+                       sibling->aggregates_.end());
+    sibling->aggregates_.clear();
+  }
   return true;
 }
 
 template <class K, class V> class OuterNode : public Node {
   template <class, class> friend class ::InnerNode;
-  template <class, class> friend class ::Map;
-  template <class, class> friend class ::MapIterator;
+  template <class, class, class> friend class ::Map;
+  template <class, class, class> friend class ::MapIterator;
   template <class, class> friend class ::Multimap;
   template <class, class> friend class ::MultimapIterator;
+  template <class, class, class> friend class ::FrozenMap;
 
 public:
-  OuterNode();
+  OuterNode(std::pmr::memory_resource *resource);
   ~OuterNode();
   Node *GetParent();
   void SetParent(Node *node);
@@ -573,25 +1495,33 @@ public:
   V &Value(size_t index);
   const V &GetValue(size_t index) const;
   size_t ValueIndex(const V &value);
-  size_t KeyIndex(const K &key);
-  void Insert(const K &key, const V &value);
-  void Erase(const K &key);
-  std::tuple<OuterNode<K, V> *, K> Split();
+  template <class Q, class C> size_t KeyIndex(const Q &key, const C &compare);
+  template <class C> size_t Position(const K &key, const C &compare);
+  template <class KK, class VV, class C>
+  void Insert(KK &&key, VV &&value, const C &compare);
+  template <class KK, class... Args>
+  void Emplace(size_t position, KK &&key, Args &&... args);
+  template <class C> void Erase(const K &key, const C &compare);
+  K Split(OuterNode<K, V> *sibling, size_t keys_left);
   bool Redistribute(Node *node);
   bool Coalesce(Node *node);
   OuterNode<K, V> *GetNext();
   OuterNode<K, V> *GetPrevious();
+  void Prefetch();
+  size_t PrefetchAhead(size_t distance, size_t slot);
 
 protected:
-  std::vector<K> keys_;
-  std::vector<V> values_;
+  std::pmr::vector<K> keys_;
+  std::pmr::vector<V> values_;
   Node *parent_;
   OuterNode<K, V> *next_;
   OuterNode<K, V> *previous_;
 };
 
 template <class K, class V>
-OuterNode<K, V>::OuterNode() : next_(nullptr), previous_(nullptr) {
+OuterNode<K, V>::OuterNode(std::pmr::memory_resource *resource)
+    : keys_(resource), values_(resource), parent_(nullptr), next_(nullptr),
+      previous_(nullptr) {
   keys_.reserve(OUTER_NODE_DEGREE + 1);
   values_.reserve(OUTER_NODE_DEGREE + 1);
 }
@@ -659,48 +1589,70 @@ template <class K, class V> size_t OuterNode<K, V>::ValueIndex(const V &value) {
   return std::string::npos;
 }
 
-template <class K, class V> size_t OuterNode<K, V>::KeyIndex(const K &key) {
-#ifdef OUTER_NODE_BINARY_SEARCH
-  typename std::vector<K>::iterator it =
-      lower_bound(keys_.begin(), keys_.end(), key);
-  if (it != keys_.end() && !(key < *it)) {
+template <class K, class V>
+template <class Q, class C>
+size_t OuterNode<K, V>::KeyIndex(const Q &key, const C &compare) {
+#if defined(OUTER_NODE_INTERPOLATION_SEARCH)
+  const size_t position = KeySearch<K, C>::LowerBound(keys_, key, compare);
+  if (position < keys_.size() && !compare.Less(key, keys_[position])) {
+    return position;
+  }
+  return std::string::npos;
+#elif defined(OUTER_NODE_BINARY_SEARCH)
+  typename std::pmr::vector<K>::iterator it =
+      lower_bound(keys_.begin(), keys_.end(), key, KeyLess<C>(compare));
+  if (it != keys_.end() && !compare.Less(key, *it)) {
     return it - keys_.begin();
   }
   return std::string::npos;
 #else
-  if (keys_.empty()) {
-    return std::string::npos;
-  }
   const size_t size = keys_.size();
-  size_t position = 0;
-  while (position < size && keys_[position] != key) {
-    position++;
-  }
-  if (position < size) {
-    return position;
+  for (size_t position = 0; position < size; position++) {
+    const int order = compare.Compare(keys_[position], key);
+    if (order >= 0) {
+      return order == 0 ? position : std::string::npos;
+    }
   }
   return std::string::npos;
 #endif
 }
 
 template <class K, class V>
-void OuterNode<K, V>::Insert(const K &key, const V &value) {
-  if (keys_.empty()) {
-    keys_.push_back(key);
-    values_.push_back(value);
-    return;
-  }
+template <class C>
+size_t OuterNode<K, V>::Position(const K &key, const C &compare) {
+#if defined(OUTER_NODE_INTERPOLATION_SEARCH)
+  return KeySearch<K, C>::LowerBound(keys_, key, compare);
+#elif defined(OUTER_NODE_BINARY_SEARCH)
+  return lower_bound(keys_.begin(), keys_.end(), key, KeyLess<C>(compare)) -
+         keys_.begin();
+#else
   const size_t size = keys_.size();
   size_t position = 0;
-  while (position < size && keys_[position] < key) {
+  while (position < size && compare.Less(keys_[position], key)) {
     position++;
   }
-  keys_.insert(keys_.begin() + position, key);
-  values_.insert(values_.begin() + position, value);
+  return position;
+#endif
+}
+
+template <class K, class V>
+template <class KK, class VV, class C>
+void OuterNode<K, V>::Insert(KK &&key, VV &&value, const C &compare) {
+  const size_t position = Position(key, compare);
+  Emplace(position, std::forward<KK>(key), std::forward<VV>(value));
 }
 
-template <class K, class V> void OuterNode<K, V>::Erase(const K &key) {
-  const size_t key_position = KeyIndex(key);
+template <class K, class V>
+template <class KK, class... Args>
+void OuterNode<K, V>::Emplace(size_t position, KK &&key, Args &&... args) {
+  keys_.emplace(keys_.begin() + position, std::forward<KK>(key));
+  values_.emplace(values_.begin() + position, std::forward<Args>(args)...);
+}
+
+template <class K, class V>
+template <class C>
+void OuterNode<K, V>::Erase(const K &key, const C &compare) {
+  const size_t key_position = KeyIndex(key, compare);
   if (key_position == std::string::npos) {
     return;
   }
@@ -710,17 +1662,13 @@ template <class K, class V> void OuterNode<K, V>::Erase(const K &key) {
 }
 
 template <class K, class V>
-std::tuple<OuterNode<K, V> *, K> OuterNode<K, V>::Split() {
-  const size_t size = keys_.size();
-  const size_t keys_left = (size % 2 == 0) ? size / 2 : size / 2 + 1;
-  const size_t keys_right = size - keys_left;
-  OuterNode<K, V> *sibling = new OuterNode<K, V>();
+K OuterNode<K, V>::Split(OuterNode<K, V> *sibling, size_t keys_left) {
   move(keys_.begin() + keys_left, keys_.end(), back_inserter(sibling->keys_));
   move(values_.begin() + keys_left, values_.end(),
        back_inserter(sibling->values_));
   keys_.erase(keys_.begin() + keys_left, keys_.end());
   values_.erase(values_.begin() + keys_left, values_.end());
-  const K up_key = sibling->keys_.front();
+  const K up_key = CopyKey(sibling->keys_, 0);
   sibling->next_ = next_;
   sibling->previous_ = this;
   if (next_ != nullptr) {
@@ -728,28 +1676,29 @@ std::tuple<OuterNode<K, V> *, K> OuterNode<K, V>::Split() {
   }
   next_ = sibling;
   sibling->parent_ = parent_;
-  return std::make_tuple(sibling, up_key);
+  return up_key;
 }
 
 template <class K, class V> bool OuterNode<K, V>::Redistribute(Node *node) {
   OuterNode<K, V> *sibling = static_cast<OuterNode<K, V> *>(node);
   if (sibling->keys_.size() >= keys_.size() + 2) {
-    keys_.push_back(sibling->keys_.front());
-    values_.push_back(sibling->values_.front());
+    keys_.push_back(std::move(sibling->keys_.front()));
+    values_.push_back(std::move(sibling->values_.front()));
     sibling->keys_.erase(sibling->keys_.begin());
     sibling->values_.erase(sibling->values_.begin());
   } else if (keys_.size() >= sibling->keys_.size() + 2) {
-    sibling->keys_.insert(sibling->keys_.begin(), keys_.back());
-    sibling->values_.insert(sibling->values_.begin(), values_.back());
+    sibling->keys_.insert(sibling->keys_.begin(), std::move(keys_.back()));
+    sibling->values_.insert(sibling->values_.begin(),
+                            std::move(values_.back()));
     keys_.pop_back();
     values_.pop_back();
   } else {
     return false;
   }
-  const K up_key = sibling->keys_.front();
   const size_t up_key_index =
       static_cast<InnerNode<K, V> *>(parent_)->ChildIndex(this);
-  static_cast<InnerNode<K, V> *>(parent_)->keys_[up_key_index] = up_key;
+  static_cast<InnerNode<K, V> *>(parent_)->keys_[up_key_index] =
+      sibling->keys_.front();
   return true;
 }
 
@@ -779,52 +1728,513 @@ inline OuterNode<K, V> *OuterNode<K, V>::GetPrevious() {
   return previous_;
 }
 
-template <class K, class V> class Map {
+// Prefetches the key and value arrays of this leaf at once.
+template <class K, class V> inline void OuterNode<K, V>::Prefetch() {
+  PrefetchArray(keys_.data(), keys_.size());
+  PrefetchArray(values_.data(), values_.size());
+}
+
+// Prefetches the header of the leaf distance places ahead and the arrays of
+// the next leaf, whose header was prefetched by an earlier call when a scan
+// calls this on every leaf it enters. Within the parent the leaf addresses
+// come from its child array, so the misses overlap instead of following the
+// next_ chain one after the other. Past the last child the next_ chain is
+// followed from there; those leaves were prefetched by the earlier calls, so
+// the walk mostly hits the cache. slot is the guessed position of this leaf
+// among the children of its parent, which is only searched for when the
+// guess is wrong. Returns the position.
+template <class K, class V>
+size_t OuterNode<K, V>::PrefetchAhead(size_t distance, size_t slot) {
+  if (parent_ == nullptr || distance == 0) {
+    return std::string::npos;
+  }
+  InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(parent_);
+  const size_t size = parent->children_.size();
+  if (slot >= size || parent->children_[slot] != this) {
+    slot = parent->ChildIndex(this);
+  }
+  OuterNode<K, V> *ahead;
+  if (slot + distance < size) {
+    ahead = static_cast<OuterNode<K, V> *>(parent->children_[slot + distance]);
+  } else {
+    ahead = static_cast<OuterNode<K, V> *>(parent->children_.back());
+    for (size_t i = size - 1; i < slot + distance && ahead != nullptr; i++) {
+      ahead = ahead->next_;
+    }
+  }
+  if (ahead != nullptr) {
+    PrefetchArray(ahead, 1);
+  }
+  if (next_ != nullptr) {
+    next_->Prefetch();
+  }
+  return slot;
+}
+
+// Open addressing table from the hash of every key to the leaf holding it
+// and the slot it was last seen at. Entries are matched by their full hash
+// and verified in the leaf, so only keys that change leaves are updated; a
+// stale slot after a shift inside the leaf costs one search of that leaf.
+template <class K, class V> class MapIndex {
+public:
+  MapIndex(std::pmr::memory_resource *resource);
+  void Clear();
+  size_t Size() const;
+  size_t MemoryUsage() const;
+  template <class Q, class C>
+  std::tuple<size_t, OuterNode<K, V> *> Find(const Q &key, const C &compare);
+  template <class Q, class C>
+  std::tuple<size_t, OuterNode<K, V> *> Find(const Q &key,
+                                             const C &compare) const;
+  void Insert(const K &key, OuterNode<K, V> *leaf, size_t slot);
+  bool Move(const K &key, OuterNode<K, V> *from, OuterNode<K, V> *to,
+            size_t slot);
+  void Move(OuterNode<K, V> *from, OuterNode<K, V> *to, size_t begin,
+            size_t end);
+  bool Erase(const K &key, OuterNode<K, V> *leaf);
+  bool Contains(const K &key, OuterNode<K, V> *leaf) const;
+
+protected:
+  struct Entry {
+    uint64_t hash;
+    OuterNode<K, V> *leaf;
+    size_t slot;
+  };
+  std::pmr::vector<Entry> entries_;
+  size_t size_;
+  size_t mask_;
+  template <class Q> static uint64_t Hash(const Q &key);
+  template <class Q, class C>
+  size_t Search(const Q &key, const C &compare, size_t &slot) const;
+  size_t Probe(uint64_t hash, OuterNode<K, V> *leaf) const;
+  void Grow();
+};
+
+template <class K, class V>
+MapIndex<K, V>::MapIndex(std::pmr::memory_resource *resource)
+    : entries_(resource), size_(0), mask_(0) {}
+
+template <class K, class V> void MapIndex<K, V>::Clear() {
+  std::pmr::vector<Entry>(entries_.get_allocator()).swap(entries_);
+  size_ = 0;
+  mask_ = 0;
+}
+
+template <class K, class V> inline size_t MapIndex<K, V>::Size() const {
+  return size_;
+}
+
+template <class K, class V> size_t MapIndex<K, V>::MemoryUsage() const {
+  return entries_.capacity() * sizeof(Entry);
+}
+
+template <class K, class V>
+template <class Q>
+inline uint64_t MapIndex<K, V>::Hash(const Q &key) {
+  uint64_t hash = KeyHash<K>().Hash(key);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Entries whose key compares equal under compare are hits, so keys that are
+// equal in the order of the tree must hash alike. Returns the entry of key and
+// its slot in the leaf, or npos.
+template <class K, class V>
+template <class Q, class C>
+size_t MapIndex<K, V>::Search(const Q &key, const C &compare,
+                              size_t &slot) const {
+  if (size_ == 0) {
+    return std::string::npos;
+  }
+  const uint64_t hash = Hash(key);
+  for (size_t i = hash & mask_; entries_[i].leaf != nullptr;
+       i = (i + 1) & mask_) {
+    const Entry &entry = entries_[i];
+    if (entry.hash != hash) {
+      continue;
+    }
+    if (entry.slot < entry.leaf->CountKeys() &&
+        compare.Compare(entry.leaf->Key(entry.slot), key) == 0) {
+      slot = entry.slot;
+      return i;
+    }
+    slot = entry.leaf->KeyIndex(key, compare);
+    if (slot != std::string::npos) {
+      return i;
+    }
+  }
+  return std::string::npos;
+}
+
+// Stores the slot found by the leaf search so that the next lookup of the key
+// hits it directly.
+template <class K, class V>
+template <class Q, class C>
+std::tuple<size_t, OuterNode<K, V> *> MapIndex<K, V>::Find(const Q &key,
+                                                           const C &compare) {
+  size_t slot = std::string::npos;
+  const size_t i = Search(key, compare, slot);
+  if (i == std::string::npos) {
+    return std::make_tuple(std::string::npos, nullptr);
+  }
+  entries_[i].slot = slot;
+  return std::make_tuple(slot, entries_[i].leaf);
+}
+
+// Leaves stale slots as they are.
+template <class K, class V>
+template <class Q, class C>
+std::tuple<size_t, OuterNode<K, V> *>
+MapIndex<K, V>::Find(const Q &key, const C &compare) const {
+  size_t slot = std::string::npos;
+  const size_t i = Search(key, compare, slot);
+  if (i == std::string::npos) {
+    return std::make_tuple(std::string::npos, nullptr);
+  }
+  return std::make_tuple(slot, entries_[i].leaf);
+}
+
+template <class K, class V>
+size_t MapIndex<K, V>::Probe(uint64_t hash, OuterNode<K, V> *leaf) const {
+  if (size_ == 0) {
+    return std::string::npos;
+  }
+  for (size_t i = hash & mask_; entries_[i].leaf != nullptr;
+       i = (i + 1) & mask_) {
+    if (entries_[i].hash == hash && entries_[i].leaf == leaf) {
+      return i;
+    }
+  }
+  return std::string::npos;
+}
+
+template <class K, class V> void MapIndex<K, V>::Grow() {
+  std::pmr::vector<Entry> entries(std::max<size_t>(16, 2 * entries_.size()),
+                                  Entry{0, nullptr, 0},
+                                  entries_.get_allocator());
+  entries_.swap(entries);
+  mask_ = entries_.size() - 1;
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    if (it->leaf == nullptr) {
+      continue;
+    }
+    size_t i = it->hash & mask_;
+    while (entries_[i].leaf != nullptr) {
+      i = (i + 1) & mask_;
+    }
+    entries_[i] = *it;
+  }
+}
+
+template <class K, class V>
+void MapIndex<K, V>::Insert(const K &key, OuterNode<K, V> *leaf,
+                            size_t slot) {
+  if (4 * (size_ + 1) > 3 * entries_.size()) {
+    Grow();
+  }
+  const uint64_t hash = Hash(key);
+  size_t i = hash & mask_;
+  while (entries_[i].leaf != nullptr) {
+    i = (i + 1) & mask_;
+  }
+  entries_[i] = Entry{hash, leaf, slot};
+  size_++;
+}
+
+template <class K, class V>
+bool MapIndex<K, V>::Move(const K &key, OuterNode<K, V> *from,
+                          OuterNode<K, V> *to, size_t slot) {
+  const size_t i = Probe(Hash(key), from);
+  if (i == std::string::npos) {
+    return false;
+  }
+  entries_[i].leaf = to;
+  entries_[i].slot = slot;
+  return true;
+}
+
+// Repoints the keys in [begin, end) of to, which were moved there from from.
+template <class K, class V>
+void MapIndex<K, V>::Move(OuterNode<K, V> *from, OuterNode<K, V> *to,
+                          size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    Move(to->Key(i), from, to, i);
+  }
+}
+
+// Removes the entry and shifts the following entries of the probe run back
+// into the gap, so lookups never have to skip tombstones.
+template <class K, class V>
+bool MapIndex<K, V>::Erase(const K &key, OuterNode<K, V> *leaf) {
+  size_t i = Probe(Hash(key), leaf);
+  if (i == std::string::npos) {
+    return false;
+  }
+  for (size_t next = (i + 1) & mask_; entries_[next].leaf != nullptr;
+       next = (next + 1) & mask_) {
+    const size_t home = entries_[next].hash & mask_;
+    if (((next - home) & mask_) >= ((next - i) & mask_)) {
+      entries_[i] = entries_[next];
+      i = next;
+    }
+  }
+  entries_[i].leaf = nullptr;
+  size_--;
+  return true;
+}
+
+// Tells whether key has an entry that points to leaf.
+template <class K, class V>
+bool MapIndex<K, V>::Contains(const K &key, OuterNode<K, V> *leaf) const {
+  return Probe(Hash(key), leaf) != std::string::npos;
+}
+
+template <class K, class V, class Compare> class Map {
   template <class, class> friend class ::InnerNode;
   template <class, class> friend class ::OuterNode;
-  template <class, class> friend class ::MapIterator;
+  template <class, class, class> friend class ::MapIterator;
   template <class, class> friend class ::Multimap;
   template <class, class> friend class ::MultimapIterator;
+  template <class, class, class> friend class ::FrozenMap;
+  template <class, class> friend class ::ValueLogMap;
 
 public:
   Map();
+  Map(const MapPolicy &policy);
+  Map(std::pmr::memory_resource *resource);
+  Map(const MapPolicy &policy, std::pmr::memory_resource *resource);
+  Map(const MapPolicy &policy, std::pmr::memory_resource *resource,
+      std::pmr::memory_resource *inner_resource,
+      const Compare &compare = Compare());
   ~Map();
   void Clear();
-  void Put(const K &key, const V &value);
-  void Put(MapIterator<K, V> &iter, const V &value);
+  size_t Size() const;
+  const MapPolicy &Policy() const;
+  void SetPolicy(const MapPolicy &policy);
+  std::pmr::memory_resource *Resource() const;
+  std::pmr::memory_resource *InnerResource() const;
+  std::tuple<MapIterator<K, V, Compare>, bool> Put(const K &key,
+                                                   const V &value);
+  std::tuple<MapIterator<K, V, Compare>, bool> Put(const K &key, V &&value);
+  std::tuple<MapIterator<K, V, Compare>, bool> Put(K &&key, const V &value);
+  std::tuple<MapIterator<K, V, Compare>, bool> Put(K &&key, V &&value);
+  void Put(MapIterator<K, V, Compare> &iter, const V &value);
+  void Put(MapIterator<K, V, Compare> &iter, V &&value);
+  std::tuple<MapIterator<K, V, Compare>, bool>
+  Put(MapIterator<K, V, Compare> hint, const K &key, const V &value);
+  std::tuple<MapIterator<K, V, Compare>, bool>
+  Put(MapIterator<K, V, Compare> hint, K &&key, V &&value);
+  template <class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> Emplace(const K &key,
+                                                       Args &&... args);
+  template <class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> Emplace(K &&key,
+                                                       Args &&... args);
+  template <class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> TryEmplace(const K &key,
+                                                          Args &&... args);
+  template <class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> TryEmplace(K &&key,
+                                                          Args &&... args);
+  template <class F>
+  std::tuple<MapIterator<K, V, Compare>, bool> Upsert(const K &key, F function);
+  template <class F> bool Modify(const K &key, F function);
   const V &Get(K const &key) const;
+  template <class Q, class = TransparentKey<Compare, Q>>
+  const V &Get(const Q &key) const;
   bool Erase(const K &key);
-  bool Erase(MapIterator<K, V> iter);
+  template <class Q, class = TransparentKey<Compare, Q>>
+  bool Erase(const Q &key);
+  bool Erase(MapIterator<K, V, Compare> iter);
+  bool PopFront();
+  bool PopFront(K &key, V &value);
+  bool PopBack();
+  bool PopBack(K &key, V &value);
+  size_t PopFrontN(size_t count, std::vector<std::pair<K, V>> &out);
   bool Contains(const K &key);
-  MapIterator<K, V> Find(const K &key);
-  MapIterator<K, V> Begin();
-  const MapIterator<K, V> Begin() const;
-  MapIterator<K, V> End();
-  const MapIterator<K, V> End() const;
+  template <class Q, class = TransparentKey<Compare, Q>>
+  bool Contains(const Q &key);
+  MapIterator<K, V, Compare> Find(const K &key);
+  template <class Q, class = TransparentKey<Compare, Q>>
+  MapIterator<K, V, Compare> Find(const Q &key);
+  MapIterator<K, V, Compare> LowerBound(const K &key);
+  MapIterator<K, V, Compare> Begin();
+  const MapIterator<K, V, Compare> Begin() const;
+  MapIterator<K, V, Compare> End();
+  const MapIterator<K, V, Compare> End() const;
+  template <class F> void ForEach(F function);
+  template <class F> void ForEach(const K &low, const K &high, F function);
+  template <class F> void ForEachBlock(F function);
+  template <class F>
+  void ForEachBlock(const K &low, const K &high, F function);
+  template <class F> void ParallelForEach(F function, size_t threads = 0);
+  template <class F>
+  void ParallelForEach(const K &low, const K &high, F function,
+                       size_t threads = 0);
+  template <class T, class F, class C>
+  T ParallelReduce(T identity, F function, C combine, size_t threads = 0);
+  template <class T, class F, class C>
+  T ParallelReduce(const K &low, const K &high, T identity, F function,
+                   C combine, size_t threads = 0);
+  size_t Count(const K &low, const K &high);
+  size_t Rank(const K &key);
+  MapIterator<K, V, Compare> Select(size_t index);
+  typename MapAggregate<K, V>::Type Aggregate(const K &low, const K &high);
+  V Sum(const K &low, const K &high);
+  bool Min(const K &low, const K &high, V &minimum);
+  bool Max(const K &low, const K &high, V &maximum);
   void Save(const std::string &filepath);
   void Load(const std::string &filepath);
+  void Compact(double target_fill = 1.0);
+  bool CompactStep(double target_fill, size_t leaves);
+  void SplitAt(const K &key, Map<K, V, Compare> &upper);
+  bool Join(Map<K, V, Compare> &other);
+  template <class F> void Merge(Map<K, V, Compare> &other, F function);
+  FrozenMap<K, V, Compare> Freeze();
+  MapStatistics Stats() const;
+  void ResetCounters();
+  MapLatencies Latencies() const;
+  void ResetLatencies();
+  MapMemoryUsage MemoryUsage() const;
+  bool Verify() const;
 
 protected:
   Node *root_;
+  OuterNode<K, V> *first_leaf_;
+  OuterNode<K, V> *last_leaf_;
+  size_t size_;
+  size_t inner_nodes_;
+  size_t outer_nodes_;
+  bool compacting_;
+  K compact_key_;
+  MapPolicy policy_;
+  Compare compare_;
+  std::pmr::memory_resource *resource_;
+  std::pmr::memory_resource *inner_resource_;
+  MapIndex<K, V> index_;
+  MapCounters counters_;
+#ifdef MAP_LATENCY_HISTOGRAMS
+  mutable MapLatencies latencies_;
+#endif
   size_t FindDegree(size_t cache_size, size_t preferred_size,
                     size_t maximum_size);
-  bool Erase(OuterNode<K, V> *outer, const K &key);
+  size_t PreferredDegree(double fill, size_t maximum_size);
+  const K &MinimumKey(Node *node);
+  template <class F> void Assemble(F read);
+  void BuildLevels(std::vector<Node *> &level, size_t preferred_inner_degree);
+  void ReleaseInnerNodes();
+  void ShiftLeft(OuterNode<K, V> *left, OuterNode<K, V> *right, size_t count);
+  void ShiftRight(OuterNode<K, V> *left, OuterNode<K, V> *right,
+                  size_t count);
+  OuterNode<K, V> *NewOuterNode();
+  InnerNode<K, V> *NewInnerNode();
+  void DeleteNode(Node *node);
+  bool SameResources(const Map<K, V, Compare> &other) const;
+  template <class F>
+  void Update(OuterNode<K, V> *outer, size_t position, F function);
+  bool Erase(OuterNode<K, V> *outer, size_t position);
+  void Rebalance(Node *node);
+  void ReleaseLeaf(OuterNode<K, V> *outer);
+  void IndexLeaf(OuterNode<K, V> *outer);
+  size_t SubtreeSize(Node *node);
+  typename MapAggregate<K, V>::Type Summarize(Node *node);
+  typename MapAggregate<K, V>::Type
+  Summarize(OuterNode<K, V> *outer, size_t begin, size_t end);
+  typename MapAggregate<K, V>::Type AggregateRange(Node *node, const K &low,
+                                                   const K &high,
+                                                   bool from_first,
+                                                   bool to_last);
+  void Refresh(Node *node);
+  void UpdatePath(Node *node, ptrdiff_t delta);
+  void IndexRedistribution(Node *left, Node *right);
+  void IndexCoalesce(Node *left, Node *right);
   Node *LeftNode(Node *node);
   Node *RightNode(Node *node);
   size_t SeparatorIndex(Node *node, Node *sibling);
   K SeparatorKey(Node *node, Node *sibling);
-  void PropagateUpwards(Node *origin, K &up_key, Node *sibling);
-  std::tuple<size_t, OuterNode<K, V> *> Locate(const K &key);
-  MapIterator<K, V> BeginIterator();
+  void PropagateUpwards(Node *origin, K &up_key, Node *sibling,
+                        double split_ratio);
+  size_t Height(Node *node) const;
+  void TransferSubtree(Node *node, Map<K, V, Compare> &target);
+  Node *Balance(Node *left, Node *right);
+  void RepairEdge(bool right_edge);
+  void RefreshPath(Node *node);
+  template <class F> void MergeLeaves(Map<K, V, Compare> &other, F function);
+  template <class KK, class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> Insert(bool replace, KK &&key,
+                                                      Args &&... args);
+  template <class KK, class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool>
+  Insert(MapIterator<K, V, Compare> hint, bool replace, KK &&key,
+         Args &&... args);
+  template <class KK, class... Args>
+  std::tuple<MapIterator<K, V, Compare>, bool> Insert(OuterNode<K, V> *outer,
+                                                      size_t position,
+                                                      bool replace, KK &&key,
+                                                      Args &&... args);
+  std::tuple<OuterNode<K, V> *, size_t> LocatePosition(const K &key);
+  MapIterator<K, V, Compare> Overflow(OuterNode<K, V> *outer, size_t position);
+  template <class Q> OuterNode<K, V> *LocateLeaf(const Q &key) const;
+  template <class Q> const V &Lookup(const Q &key) const;
+  template <class Q>
+  std::tuple<size_t, OuterNode<K, V> *> Locate(const Q &key);
+  MapIterator<K, V, Compare> BeginIterator();
   OuterNode<K, V> *FirstLeaf();
   OuterNode<K, V> *LastLeaf();
+  OuterNode<K, V> *LeftmostLeaf();
+  OuterNode<K, V> *RightmostLeaf();
+  std::vector<Node *> Partition(const K *low, const K *high, size_t parts);
+  template <class F>
+  void VisitSubtree(Node *node, const K *low, const K *high, F function);
+  template <class T, class F, class C>
+  T ParallelRange(const K *low, const K *high, T identity, F function,
+                  C combine, size_t threads);
+  bool VerifyNode(Node *node, const K *low, const K *high, size_t depth,
+                  size_t &count, std::vector<OuterNode<K, V> *> &leaves) const;
 };
 
-template <class K, class V> Map<K, V>::Map() : root_(nullptr) {}
-
-template <class K, class V> Map<K, V>::~Map() { Clear(); }
-
-template <class K, class V> void Map<K, V>::Clear() {
+template <class K, class V, class Compare>
+Map<K, V, Compare>::Map()
+    : Map(MapPolicy(), std::pmr::get_default_resource()) {}
+
+template <class K, class V, class Compare>
+Map<K, V, Compare>::Map(const MapPolicy &policy)
+    : Map(policy, std::pmr::get_default_resource()) {}
+
+template <class K, class V, class Compare>
+Map<K, V, Compare>::Map(std::pmr::memory_resource *resource)
+    : Map(MapPolicy(), resource) {}
+
+// Nodes, their arrays and the hash index are allocated from resource, which
+// must outlive the tree. Keys and values that are allocator-aware, such as
+// std::pmr::string, are constructed with it as well.
+template <class K, class V, class Compare>
+Map<K, V, Compare>::Map(const MapPolicy &policy,
+                        std::pmr::memory_resource *resource)
+    : Map(policy, resource, resource) {}
+
+// Like above, but inner nodes and their arrays come from inner_resource, so
+// that the upper levels of the tree can be kept together in memory of their
+// own instead of being scattered between the leaves. A comparator with state
+// is passed as compare and copied into the tree.
+template <class K, class V, class Compare>
+Map<K, V, Compare>::Map(const MapPolicy &policy,
+                        std::pmr::memory_resource *resource,
+                        std::pmr::memory_resource *inner_resource,
+                        const Compare &compare)
+    : root_(nullptr), first_leaf_(nullptr), last_leaf_(nullptr), size_(0),
+      inner_nodes_(0), outer_nodes_(0), compacting_(false), policy_(policy),
+      compare_(compare), resource_(resource), inner_resource_(inner_resource),
+      index_(resource) {}
+
+template <class K, class V, class Compare>
+Map<K, V, Compare>::~Map() { Clear(); }
+
+template <class K, class V, class Compare> void Map<K, V, Compare>::Clear() {
   if (root_ != nullptr) {
     std::stack<Node *> todo;
     todo.push(root_);
@@ -840,13 +2250,99 @@ template <class K, class V> void Map<K, V>::Clear() {
           todo.push(*it);
         }
       }
-      delete current;
+      DeleteNode(current);
     }
   }
   root_ = nullptr;
+  first_leaf_ = nullptr;
+  last_leaf_ = nullptr;
+  size_ = 0;
+  compacting_ = false;
+  index_.Clear();
+}
+
+template <class K, class V, class Compare>
+inline size_t Map<K, V, Compare>::Size() const {
+  return size_;
+}
+
+template <class K, class V, class Compare>
+inline const MapPolicy &Map<K, V, Compare>::Policy() const {
+  return policy_;
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::SetPolicy(const MapPolicy &policy) {
+  const bool build_index = policy.hash_index && !policy_.hash_index;
+  policy_ = policy;
+  if (!policy_.hash_index) {
+    index_.Clear();
+  } else if (build_index) {
+    for (OuterNode<K, V> *outer_node = FirstLeaf(); outer_node != nullptr;
+         outer_node = outer_node->next_) {
+      IndexLeaf(outer_node);
+    }
+  }
+}
+
+template <class K, class V, class Compare>
+inline std::pmr::memory_resource *Map<K, V, Compare>::Resource() const {
+  return resource_;
+}
+
+template <class K, class V, class Compare>
+inline std::pmr::memory_resource *Map<K, V, Compare>::InnerResource() const {
+  return inner_resource_;
+}
+
+template <class K, class V, class Compare>
+inline bool
+Map<K, V, Compare>::SameResources(const Map<K, V, Compare> &other) const {
+  return *resource_ == *other.resource_ &&
+         *inner_resource_ == *other.inner_resource_;
 }
 
-template <class K, class V> Node *Map<K, V>::LeftNode(Node *node) {
+template <class K, class V, class Compare>
+OuterNode<K, V> *Map<K, V, Compare>::NewOuterNode() {
+  outer_nodes_++;
+  void *memory = resource_->allocate(sizeof(OuterNode<K, V>),
+                                     alignof(OuterNode<K, V>));
+  return new (memory) OuterNode<K, V>(resource_);
+}
+
+template <class K, class V, class Compare>
+InnerNode<K, V> *Map<K, V, Compare>::NewInnerNode() {
+  inner_nodes_++;
+  void *memory = inner_resource_->allocate(sizeof(InnerNode<K, V>),
+                                           alignof(InnerNode<K, V>));
+  return new (memory) InnerNode<K, V>(inner_resource_);
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::DeleteNode(Node *node) {
+  if (node->IsOuter()) {
+    outer_nodes_--;
+    static_cast<OuterNode<K, V> *>(node)->~OuterNode();
+    resource_->deallocate(node, sizeof(OuterNode<K, V>),
+                          alignof(OuterNode<K, V>));
+  } else {
+    inner_nodes_--;
+    static_cast<InnerNode<K, V> *>(node)->~InnerNode();
+    inner_resource_->deallocate(node, sizeof(InnerNode<K, V>),
+                                alignof(InnerNode<K, V>));
+  }
+}
+
+template <class K, class V, class Compare>
+template <class F>
+inline void Map<K, V, Compare>::Update(OuterNode<K, V> *outer_node,
+                                       size_t position, F function) {
+  function(outer_node->values_[position]);
+  UpdatePath(outer_node, 0);
+}
+
+template <class K, class V, class Compare>
+Node *Map<K, V, Compare>::LeftNode(Node *node) {
   if (node == root_) {
     return nullptr;
   }
@@ -860,7 +2356,8 @@ template <class K, class V> Node *Map<K, V>::LeftNode(Node *node) {
   return nullptr;
 }
 
-template <class K, class V> Node *Map<K, V>::RightNode(Node *node) {
+template <class K, class V, class Compare>
+Node *Map<K, V, Compare>::RightNode(Node *node) {
   if (node == root_) {
     return nullptr;
   }
@@ -876,71 +2373,89 @@ template <class K, class V> Node *Map<K, V>::RightNode(Node *node) {
   return nullptr;
 }
 
-template <class K, class V>
-size_t Map<K, V>::SeparatorIndex(Node *node, Node *sibling) {
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::SeparatorIndex(Node *node, Node *sibling) {
   InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(node->GetParent());
   const size_t node_position = parent->ChildIndex(node);
   const size_t sibling_position = parent->ChildIndex(sibling);
   return std::min(node_position, sibling_position);
 }
 
-template <class K, class V>
-K Map<K, V>::SeparatorKey(Node *node, Node *sibling) {
+template <class K, class V, class Compare>
+K Map<K, V, Compare>::SeparatorKey(Node *node, Node *sibling) {
   const size_t index = SeparatorIndex(node, sibling);
   InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(node->GetParent());
-  return parent->keys_[index];
+  return CopyKey(parent->keys_, index);
 }
 
-template <class K, class V>
-void Map<K, V>::PropagateUpwards(Node *origin, K &up_key, Node *sibling) {
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::PropagateUpwards(Node *origin, K &up_key,
+                                          Node *sibling, double split_ratio) {
   if (origin == root_) {
-    InnerNode<K, V> *inner_node = new InnerNode<K, V>();
+    InnerNode<K, V> *inner_node = NewInnerNode();
     inner_node->Insert(origin, up_key, sibling);
     root_ = inner_node;
+    Refresh(origin);
+    Refresh(sibling);
+    MAP_COUNT(root_splits);
     return;
   }
   InnerNode<K, V> *next_origin =
       static_cast<InnerNode<K, V> *>(origin->GetParent());
   next_origin->Insert(origin, up_key, sibling);
+  Refresh(origin);
+  Refresh(sibling);
   if (next_origin->IsFull()) {
-    Node *next_sibling;
-    K next_key;
-    std::tie(next_sibling, next_key) = next_origin->Split();
-    PropagateUpwards(next_origin, next_key, next_sibling);
+    const bool right_edge = next_origin->children_.back() == sibling;
+    const bool left_edge = next_origin->children_.front() == origin;
+    if ((split_ratio > 0.5 && !right_edge) ||
+        (split_ratio < 0.5 && !left_edge)) {
+      split_ratio = policy_.split_ratio;
+    }
+    const size_t size = next_origin->keys_.size();
+    const size_t keys_left =
+        std::max<size_t>(1, std::min<size_t>(size - 2, split_ratio * size));
+    InnerNode<K, V> *next_sibling = NewInnerNode();
+    K next_key = next_origin->Split(next_sibling, keys_left);
+    MAP_COUNT(inner_splits);
+    PropagateUpwards(next_origin, next_key, next_sibling, split_ratio);
   }
 }
 
-template <class K, class V>
-std::tuple<size_t, OuterNode<K, V> *> Map<K, V>::Locate(const K &key) {
+template <class K, class V, class Compare>
+template <class Q>
+OuterNode<K, V> *Map<K, V, Compare>::LocateLeaf(const Q &key) const {
   Node *current = root_;
   if (current == nullptr) {
-    return std::make_tuple(std::string::npos,
-                           static_cast<OuterNode<K, V> *>(nullptr));
+    return nullptr;
   }
   while (!current->IsOuter()) {
     InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
-    if (key < inner_node->keys_.front()) {
-      current = inner_node->children_.front();
-      continue;
-    }
-    if (key >= inner_node->keys_.back()) {
-      current = inner_node->children_.back();
-      continue;
-    }
-    const size_t max_index = inner_node->keys_.size() - 1;
-    for (size_t i = 0; i < max_index; i++) {
-      if (inner_node->keys_[i] <= key && key < inner_node->keys_[i + 1]) {
-        current = inner_node->children_[i + 1];
-        break;
-      }
-    }
+    PrefetchArray(inner_node->keys_.data(), inner_node->keys_.size());
+    PrefetchArray(inner_node->children_.data(), inner_node->children_.size());
+    current = inner_node->children_[inner_node->Descend(key, compare_)];
   }
   OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(current);
-  const size_t key_position = outer_node->KeyIndex(key);
+  PrefetchArray(outer_node->keys_.data(), outer_node->keys_.size());
+  return outer_node;
+}
+
+template <class K, class V, class Compare>
+template <class Q>
+std::tuple<size_t, OuterNode<K, V> *> Map<K, V, Compare>::Locate(const Q &key) {
+  if (policy_.hash_index) {
+    return index_.Find(key, compare_);
+  }
+  OuterNode<K, V> *outer_node = LocateLeaf(key);
+  if (outer_node == nullptr) {
+    return std::make_tuple(std::string::npos, outer_node);
+  }
+  const size_t key_position = outer_node->KeyIndex(key, compare_);
   return std::make_tuple(key_position, outer_node);
 }
 
-template <class K, class V> OuterNode<K, V> *Map<K, V>::FirstLeaf() {
+template <class K, class V, class Compare>
+OuterNode<K, V> *Map<K, V, Compare>::FirstLeaf() {
   if (root_ == nullptr) {
     return nullptr;
   }
@@ -951,7 +2466,8 @@ template <class K, class V> OuterNode<K, V> *Map<K, V>::FirstLeaf() {
   return static_cast<OuterNode<K, V> *>(current);
 }
 
-template <class K, class V> OuterNode<K, V> *Map<K, V>::LastLeaf() {
+template <class K, class V, class Compare>
+OuterNode<K, V> *Map<K, V, Compare>::LastLeaf() {
   if (root_ == nullptr) {
     return nullptr;
   }
@@ -963,116 +2479,707 @@ template <class K, class V> OuterNode<K, V> *Map<K, V>::LastLeaf() {
   return static_cast<OuterNode<K, V> *>(current);
 }
 
-template <class K, class V> const V &Map<K, V>::Get(const K &key) const {
-  size_t position;
-  OuterNode<K, V> *outer_node;
-  std::tie(position, outer_node) = Locate(key);
+// Splits keep the left half in place and coalesces keep the left node, so the
+// cached first leaf only goes stale when it is released or the tree is rebuilt.
+template <class K, class V, class Compare>
+OuterNode<K, V> *Map<K, V, Compare>::LeftmostLeaf() {
+  if (first_leaf_ == nullptr) {
+    first_leaf_ = FirstLeaf();
+  }
+  return first_leaf_;
+}
+
+template <class K, class V, class Compare>
+OuterNode<K, V> *Map<K, V, Compare>::RightmostLeaf() {
+  if (last_leaf_ == nullptr) {
+    last_leaf_ = LastLeaf();
+  }
+  return last_leaf_;
+}
+
+// Unlike Find, neither refreshes the cached slots of the hash index nor
+// records latencies, so concurrent readers of a const tree do not write to it.
+// A missing key throws std::out_of_range like std::map::at.
+template <class K, class V, class Compare>
+template <class Q>
+const V &Map<K, V, Compare>::Lookup(const Q &key) const {
+  size_t position = std::string::npos;
+  OuterNode<K, V> *outer_node = nullptr;
+  if (policy_.hash_index) {
+    std::tie(position, outer_node) = index_.Find(key, compare_);
+  } else {
+    outer_node = LocateLeaf(key);
+    if (outer_node != nullptr) {
+      position = outer_node->KeyIndex(key, compare_);
+    }
+  }
+  if (position == std::string::npos) {
+    throw std::out_of_range("Map::Get: key not found");
+  }
   return outer_node->values_[position];
 }
 
-template <class K, class V>
-void Map<K, V>::Put(MapIterator<K, V> &iter, const V &value) {
+template <class K, class V, class Compare>
+const V &Map<K, V, Compare>::Get(const K &key) const {
+  return Lookup(key);
+}
+
+template <class K, class V, class Compare>
+template <class Q, class>
+const V &Map<K, V, Compare>::Get(const Q &key) const {
+  return Lookup(key);
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Put(MapIterator<K, V, Compare> &iter, const V &value) {
   if (iter == End()) {
     return;
   }
-  iter.GetNode()->values_[iter.GetIndex()] = value;
+  Update(iter.GetNode(), iter.GetIndex(),
+         [&value](V &target) { target = value; });
 }
 
-template <class K, class V> void Map<K, V>::Put(const K &key, const V &value) {
-  if (root_ == nullptr) {
-    OuterNode<K, V> *outer_node = new OuterNode<K, V>();
-    outer_node->Insert(key, value);
-    root_ = outer_node;
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Put(MapIterator<K, V, Compare> &iter, V &&value) {
+  if (iter == End()) {
     return;
   }
-  size_t position;
+  Update(iter.GetNode(), iter.GetIndex(),
+         [&value](V &target) { target = std::move(value); });
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(const K &key, const V &value) {
+  return Insert(true, key, value);
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(const K &key, V &&value) {
+  return Insert(true, key, std::move(value));
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(K &&key, const V &value) {
+  return Insert(true, std::move(key), value);
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(K &&key, V &&value) {
+  return Insert(true, std::move(key), std::move(value));
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(MapIterator<K, V, Compare> hint, const K &key,
+                        const V &value) {
+  return Insert(hint, true, key, value);
+}
+
+template <class K, class V, class Compare>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Put(MapIterator<K, V, Compare> hint, K &&key, V &&value) {
+  return Insert(hint, true, std::move(key), std::move(value));
+}
+
+template <class K, class V, class Compare>
+template <class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Emplace(const K &key, Args &&... args) {
+  return Insert(true, key, std::forward<Args>(args)...);
+}
+
+template <class K, class V, class Compare>
+template <class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Emplace(K &&key, Args &&... args) {
+  return Insert(true, std::move(key), std::forward<Args>(args)...);
+}
+
+template <class K, class V, class Compare>
+template <class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::TryEmplace(const K &key, Args &&... args) {
+  return Insert(false, key, std::forward<Args>(args)...);
+}
+
+template <class K, class V, class Compare>
+template <class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::TryEmplace(K &&key, Args &&... args) {
+  return Insert(false, std::move(key), std::forward<Args>(args)...);
+}
+
+template <class K, class V, class Compare>
+std::tuple<OuterNode<K, V> *, size_t>
+Map<K, V, Compare>::LocatePosition(const K &key) {
+  if (root_ == nullptr) {
+    root_ = NewOuterNode();
+  }
+  OuterNode<K, V> *outer_node = RightmostLeaf();
+  const size_t size = outer_node->keys_.size();
+  if (size > 0 && compare_.Less(outer_node->keys_.back(), key)) {
+    return std::make_tuple(outer_node, size);
+  }
+  if (policy_.hash_index) {
+    size_t position;
+    std::tie(position, outer_node) = index_.Find(key, compare_);
+    if (outer_node != nullptr) {
+      return std::make_tuple(outer_node, position);
+    }
+  }
+  outer_node = LocateLeaf(key);
+  return std::make_tuple(outer_node, outer_node->Position(key, compare_));
+}
+
+template <class K, class V, class Compare>
+template <class KK, class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Insert(bool replace, KK &&key, Args &&... args) {
+  MAP_TIME(put);
   OuterNode<K, V> *outer_node;
-  std::tie(position, outer_node) = Locate(key);
-  if (position != std::string::npos) {
-    outer_node->values_[position] = value;
-    return;
+  size_t position;
+  std::tie(outer_node, position) = LocatePosition(key);
+  return Insert(outer_node, position, replace, std::forward<KK>(key),
+                std::forward<Args>(args)...);
+}
+
+template <class K, class V, class Compare>
+template <class KK, class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Insert(MapIterator<K, V, Compare> hint, bool replace,
+                           KK &&key, Args &&... args) {
+  MAP_TIME(put);
+  OuterNode<K, V> *outer_node = hint.GetNode();
+  size_t position = hint.GetIndex();
+  const int order =
+      outer_node == nullptr
+          ? -1
+          : compare_.Compare(key, outer_node->keys_[position]);
+  bool fits = order >= 0;
+  if (order > 0) {
+    position++;
+    if (position < outer_node->keys_.size()) {
+      fits = !compare_.Less(outer_node->keys_[position], key);
+    } else {
+      fits = outer_node->next_ == nullptr;
+    }
   }
-  outer_node->Insert(key, value);
-  if (outer_node->IsFull()) {
-    OuterNode<K, V> *sibling;
-    K up_key;
-    std::tie(sibling, up_key) = outer_node->Split();
-    PropagateUpwards(outer_node, up_key, sibling);
+  if (!fits) {
+    std::tie(outer_node, position) = LocatePosition(key);
   }
-  return;
+  return Insert(outer_node, position, replace, std::forward<KK>(key),
+                std::forward<Args>(args)...);
 }
 
-template <class K, class V>
-bool Map<K, V>::Erase(OuterNode<K, V> *outer_node, const K &key) {
-  outer_node->Erase(key);
-  Node *current = outer_node;
-  if (current == root_) {
-    if (root_->IsOuter()) {
-      if (static_cast<OuterNode<K, V> *>(root_)->CountKeys() == 0) {
-        delete root_;
-        root_ = nullptr;
-      }
+template <class K, class V, class Compare>
+template <class KK, class... Args>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Insert(OuterNode<K, V> *outer_node, size_t position,
+                           bool replace, KK &&key, Args &&... args) {
+  if (position < outer_node->keys_.size() &&
+      !compare_.Less(key, outer_node->keys_[position])) {
+    if (replace) {
+      Update(outer_node, position, [&](V &target) {
+        AssignValue(target, std::forward<Args>(args)...);
+      });
     }
-    return true;
+    MapIterator<K, V, Compare> iter;
+    iter.node_ = outer_node;
+    iter.index_ = position;
+    return std::make_tuple(iter, false);
   }
-  while (current != root_) {
+  outer_node->Emplace(position, std::forward<KK>(key),
+                      std::forward<Args>(args)...);
+  size_++;
+  if (policy_.hash_index) {
+    index_.Insert(outer_node->keys_[position], outer_node, position);
+  }
+  UpdatePath(outer_node, 1);
+  return std::make_tuple(Overflow(outer_node, position), true);
+}
+
+template <class K, class V, class Compare>
+template <class F>
+std::tuple<MapIterator<K, V, Compare>, bool>
+Map<K, V, Compare>::Upsert(const K &key, F function) {
+  MAP_TIME(put);
+  OuterNode<K, V> *outer_node;
+  size_t position;
+  std::tie(outer_node, position) = LocatePosition(key);
+  if (position < outer_node->keys_.size() &&
+      !compare_.Less(key, outer_node->keys_[position])) {
+    Update(outer_node, position, function);
+    MapIterator<K, V, Compare> iter;
+    iter.node_ = outer_node;
+    iter.index_ = position;
+    return std::make_tuple(iter, false);
+  }
+  outer_node->Emplace(position, key);
+  function(outer_node->values_[position]);
+  size_++;
+  if (policy_.hash_index) {
+    index_.Insert(outer_node->keys_[position], outer_node, position);
+  }
+  UpdatePath(outer_node, 1);
+  return std::make_tuple(Overflow(outer_node, position), true);
+}
+
+template <class K, class V, class Compare>
+template <class F>
+bool Map<K, V, Compare>::Modify(const K &key, F function) {
+  MAP_TIME(put);
+  size_t position;
+  OuterNode<K, V> *outer_node;
+  std::tie(position, outer_node) = Locate(key);
+  if (position == std::string::npos) {
+    return false;
+  }
+  Update(outer_node, position, function);
+  return true;
+}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare>
+Map<K, V, Compare>::Overflow(OuterNode<K, V> *outer_node, size_t position) {
+  MapIterator<K, V, Compare> iter;
+  iter.node_ = outer_node;
+  iter.index_ = position;
+  if (outer_node->IsFull()) {
+    MAP_TIME(split);
+    const size_t size = outer_node->keys_.size();
+    double split_ratio = policy_.split_ratio;
+    if (policy_.detect_sequential) {
+      if (outer_node->next_ == nullptr && position + 1 == size) {
+        split_ratio = policy_.sequential_split_ratio;
+      } else if (outer_node->previous_ == nullptr && position == 0) {
+        split_ratio = 1.0 - policy_.sequential_split_ratio;
+      }
+    }
+    const size_t keys_left = std::max<size_t>(
+        1, std::min<size_t>(size - 1, std::ceil(split_ratio * size)));
+    OuterNode<K, V> *sibling = NewOuterNode();
+    K up_key = outer_node->Split(sibling, keys_left);
+    MAP_COUNT(outer_splits);
+    if (policy_.hash_index) {
+      index_.Move(outer_node, sibling, 0, sibling->keys_.size());
+    }
+    if (outer_node == last_leaf_) {
+      last_leaf_ = sibling;
+    }
+    if (position >= outer_node->keys_.size()) {
+      iter.node_ = sibling;
+      iter.index_ = position - outer_node->keys_.size();
+    }
+    PropagateUpwards(outer_node, up_key, sibling, split_ratio);
+  }
+  return iter;
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Erase(OuterNode<K, V> *outer_node, size_t position) {
+  size_--;
+  if (policy_.hash_index) {
+    index_.Erase(outer_node->keys_[position], outer_node);
+  }
+  outer_node->keys_.erase(outer_node->keys_.begin() + position);
+  outer_node->values_.erase(outer_node->values_.begin() + position);
+  UpdatePath(outer_node, -1);
+  Rebalance(outer_node);
+  return true;
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Rebalance(Node *current) {
+  if (current == root_) {
+    if (root_->IsOuter()) {
+      if (static_cast<OuterNode<K, V> *>(root_)->CountKeys() == 0) {
+        DeleteNode(root_);
+        root_ = nullptr;
+        first_leaf_ = nullptr;
+        last_leaf_ = nullptr;
+      }
+      return;
+    }
+  }
+  if (current != root_ && !current->IsSparse()) {
+    return;
+  }
+  MAP_TIME(rebalance);
+  while (current != root_) {
     if (!current->IsSparse()) {
-      return true;
+      return;
     }
     Node *left = LeftNode(current);
     if (left != nullptr && left->Redistribute(current)) {
-      return true;
+      MAP_COUNT(redistributions);
+      IndexRedistribution(left, current);
+      Refresh(left);
+      Refresh(current);
+      return;
     }
     Node *right = RightNode(current);
     if (right != nullptr && current->Redistribute(right)) {
-      return true;
+      MAP_COUNT(redistributions);
+      IndexRedistribution(current, right);
+      Refresh(current);
+      Refresh(right);
+      return;
     }
     if (left != nullptr && left->Coalesce(current)) {
+      MAP_COUNT(coalesces);
+      IndexCoalesce(left, current);
       InnerNode<K, V> *parent =
           static_cast<InnerNode<K, V> *>(current->GetParent());
       const K separator_key = SeparatorKey(left, current);
-      parent->Erase(separator_key, current);
+      parent->Erase(separator_key, current, compare_);
+      Refresh(left);
       Node *backup = current;
       current = current->GetParent();
-      delete backup;
+      if (backup == last_leaf_) {
+        last_leaf_ = nullptr;
+      }
+      DeleteNode(backup);
       continue;
     }
     if (right != nullptr && current->Coalesce(right)) {
+      MAP_COUNT(coalesces);
+      IndexCoalesce(current, right);
       InnerNode<K, V> *parent =
           static_cast<InnerNode<K, V> *>(current->GetParent());
       const K separator_key = SeparatorKey(current, right);
-      parent->Erase(separator_key, right);
+      parent->Erase(separator_key, right, compare_);
+      Refresh(current);
       Node *backup = right;
       current = current->GetParent();
-      delete backup;
+      if (backup == last_leaf_) {
+        last_leaf_ = nullptr;
+      }
+      DeleteNode(backup);
       continue;
     }
+    if (left == nullptr && right == nullptr) {
+      current = current->GetParent();
+    }
   }
   InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
   if (inner_node->keys_.size() == 0) {
     Node *backup = root_;
     root_ = inner_node->children_.front();
     root_->SetParent(nullptr);
-    delete backup;
+    DeleteNode(backup);
+    MAP_COUNT(root_collapses);
+  }
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ReleaseLeaf(OuterNode<K, V> *outer_node) {
+  MAP_COUNT(leaf_releases);
+  if (outer_node == first_leaf_) {
+    first_leaf_ = nullptr;
+  }
+  if (outer_node == last_leaf_) {
+    last_leaf_ = nullptr;
+  }
+  if (outer_node == root_) {
+    DeleteNode(root_);
+    root_ = nullptr;
+    return;
+  }
+  if (outer_node->previous_ != nullptr) {
+    outer_node->previous_->next_ = outer_node->next_;
+  }
+  if (outer_node->next_ != nullptr) {
+    outer_node->next_->previous_ = outer_node->previous_;
+  }
+  InnerNode<K, V> *parent =
+      static_cast<InnerNode<K, V> *>(outer_node->GetParent());
+  const size_t position = parent->ChildIndex(outer_node);
+  parent->keys_.erase(parent->keys_.begin() +
+                      (position == 0 ? 0 : position - 1));
+  parent->children_.erase(parent->children_.begin() + position);
+#ifdef MAP_SUBTREE_COUNTS
+  parent->counts_.erase(parent->counts_.begin() + position);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    parent->aggregates_.erase(parent->aggregates_.begin() + position);
+  }
+  DeleteNode(outer_node);
+  Rebalance(parent);
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::IndexLeaf(OuterNode<K, V> *outer_node) {
+  for (size_t i = 0; i < outer_node->keys_.size(); i++) {
+    index_.Insert(outer_node->keys_[i], outer_node, i);
   }
-  return true;
 }
 
-template <class K, class V> bool Map<K, V>::Erase(const K &key) {
+// A redistribution between leaves moved either the last key of left from
+// right or the first key of right from left.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::IndexRedistribution(Node *left, Node *right) {
+  if (!policy_.hash_index || !left->IsOuter()) {
+    return;
+  }
+  OuterNode<K, V> *left_leaf = static_cast<OuterNode<K, V> *>(left);
+  OuterNode<K, V> *right_leaf = static_cast<OuterNode<K, V> *>(right);
+  const size_t last = left_leaf->keys_.size() - 1;
+  if (!index_.Move(left_leaf->keys_[last], right_leaf, left_leaf, last)) {
+    index_.Move(right_leaf->keys_.front(), left_leaf, right_leaf, 0);
+  }
+}
+
+// The keys of right were appended to left; walks back from the end of left
+// until the first key that has not come from right.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::IndexCoalesce(Node *left, Node *right) {
+  if (!policy_.hash_index || !left->IsOuter()) {
+    return;
+  }
+  OuterNode<K, V> *left_leaf = static_cast<OuterNode<K, V> *>(left);
+  OuterNode<K, V> *right_leaf = static_cast<OuterNode<K, V> *>(right);
+  for (size_t i = left_leaf->keys_.size(); i > 0; i--) {
+    if (!index_.Move(left_leaf->keys_[i - 1], right_leaf, left_leaf, i - 1)) {
+      break;
+    }
+  }
+}
+
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::SubtreeSize(Node *node) {
+  if (node->IsOuter()) {
+    return static_cast<OuterNode<K, V> *>(node)->keys_.size();
+  }
+  size_t size = 0;
+#ifdef MAP_SUBTREE_COUNTS
+  InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(node);
+  for (auto it = inner_node->counts_.begin(); it != inner_node->counts_.end();
+       ++it) {
+    size += *it;
+  }
+#endif
+  return size;
+}
+
+template <class K, class V, class Compare>
+typename MapAggregate<K, V>::Type
+Map<K, V, Compare>::Summarize(OuterNode<K, V> *outer_node, size_t begin,
+                              size_t end) {
+  typename MapAggregate<K, V>::Type summary = MapAggregate<K, V>::Identity();
+  for (size_t i = begin; i < end; i++) {
+    summary = MapAggregate<K, V>::Combine(
+        summary, MapAggregate<K, V>::Lift(outer_node->keys_[i],
+                                          outer_node->values_[i]));
+  }
+  return summary;
+}
+
+template <class K, class V, class Compare>
+typename MapAggregate<K, V>::Type Map<K, V, Compare>::Summarize(Node *node) {
+  if (node->IsOuter()) {
+    OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(node);
+    return Summarize(outer_node, 0, outer_node->keys_.size());
+  }
+  InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(node);
+  typename MapAggregate<K, V>::Type summary = MapAggregate<K, V>::Identity();
+  for (auto it = inner_node->aggregates_.begin();
+       it != inner_node->aggregates_.end(); ++it) {
+    summary = MapAggregate<K, V>::Combine(summary, *it);
+  }
+  return summary;
+}
+
+// Stores the size and the aggregate of node in its parent. The entries of
+// the ancestors above do not change as long as elements only moved below
+// the parent.
+template <class K, class V, class Compare>
+inline void Map<K, V, Compare>::Refresh(Node *node) {
+#ifndef MAP_SUBTREE_COUNTS
+  if (!MapAggregate<K, V>::enabled) {
+    return;
+  }
+#endif
+  InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(node->GetParent());
+  if (parent == nullptr) {
+    return;
+  }
+  const size_t position = parent->ChildIndex(node);
+#ifdef MAP_SUBTREE_COUNTS
+  parent->counts_[position] = SubtreeSize(node);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    parent->aggregates_[position] = Summarize(node);
+  }
+}
+
+// Adds delta to the subtree counts on the path from node to the root and
+// recomputes the aggregates along it after the elements of node changed.
+template <class K, class V, class Compare>
+inline void Map<K, V, Compare>::UpdatePath(Node *node,
+                                           [[maybe_unused]] ptrdiff_t delta) {
+#ifndef MAP_SUBTREE_COUNTS
+  if (!MapAggregate<K, V>::enabled) {
+    return;
+  }
+#endif
+  InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(node->GetParent());
+  while (parent != nullptr) {
+    const size_t position = parent->ChildIndex(node);
+#ifdef MAP_SUBTREE_COUNTS
+    parent->counts_[position] += delta;
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      parent->aggregates_[position] = Summarize(node);
+    }
+    node = parent;
+    parent = static_cast<InnerNode<K, V> *>(node->GetParent());
+  }
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Erase(const K &key) {
+  MAP_TIME(erase);
+  size_t position;
+  OuterNode<K, V> *outer_node;
+  std::tie(position, outer_node) = Locate(key);
+  if (position == std::string::npos) {
+    return false;
+  }
+  return Erase(outer_node, position);
+}
+
+template <class K, class V, class Compare>
+template <class Q, class>
+bool Map<K, V, Compare>::Erase(const Q &key) {
+  MAP_TIME(erase);
   size_t position;
   OuterNode<K, V> *outer_node;
   std::tie(position, outer_node) = Locate(key);
   if (position == std::string::npos) {
     return false;
   }
-  return Erase(outer_node, key);
+  return Erase(outer_node, position);
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Erase(MapIterator<K, V, Compare> iter) {
+  MAP_TIME(erase);
+  return Erase(iter.GetNode(), iter.GetIndex());
+}
+
+template <class K, class V, class Compare> bool Map<K, V, Compare>::PopFront() {
+  OuterNode<K, V> *outer_node = LeftmostLeaf();
+  if (outer_node == nullptr) {
+    return false;
+  }
+  size_--;
+  if (policy_.hash_index) {
+    index_.Erase(outer_node->keys_.front(), outer_node);
+  }
+  outer_node->keys_.erase(outer_node->keys_.begin());
+  outer_node->values_.erase(outer_node->values_.begin());
+  UpdatePath(outer_node, -1);
+  Rebalance(outer_node);
+  return true;
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::PopFront(K &key, V &value) {
+  OuterNode<K, V> *outer_node = LeftmostLeaf();
+  if (outer_node == nullptr) {
+    return false;
+  }
+  size_--;
+  if (policy_.hash_index) {
+    index_.Erase(outer_node->keys_.front(), outer_node);
+  }
+  key = std::move(outer_node->keys_.front());
+  value = std::move(outer_node->values_.front());
+  outer_node->keys_.erase(outer_node->keys_.begin());
+  outer_node->values_.erase(outer_node->values_.begin());
+  UpdatePath(outer_node, -1);
+  Rebalance(outer_node);
+  return true;
+}
+
+template <class K, class V, class Compare> bool Map<K, V, Compare>::PopBack() {
+  OuterNode<K, V> *outer_node = RightmostLeaf();
+  if (outer_node == nullptr) {
+    return false;
+  }
+  size_--;
+  if (policy_.hash_index) {
+    index_.Erase(outer_node->keys_.back(), outer_node);
+  }
+  outer_node->keys_.pop_back();
+  outer_node->values_.pop_back();
+  UpdatePath(outer_node, -1);
+  Rebalance(outer_node);
+  return true;
 }
 
-template <class K, class V> bool Map<K, V>::Erase(MapIterator<K, V> iter) {
-  return Erase(iter.GetNode(), iter.GetKey());
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::PopBack(K &key, V &value) {
+  OuterNode<K, V> *outer_node = RightmostLeaf();
+  if (outer_node == nullptr) {
+    return false;
+  }
+  size_--;
+  if (policy_.hash_index) {
+    index_.Erase(outer_node->keys_.back(), outer_node);
+  }
+  key = std::move(outer_node->keys_.back());
+  value = std::move(outer_node->values_.back());
+  outer_node->keys_.pop_back();
+  outer_node->values_.pop_back();
+  UpdatePath(outer_node, -1);
+  Rebalance(outer_node);
+  return true;
+}
+
+// Moves whole leaves out at once and releases them without rebalancing in
+// between; only a partly consumed last leaf is balanced with its neighbour.
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::PopFrontN(size_t count,
+                                     std::vector<std::pair<K, V>> &out) {
+  size_t popped = 0;
+  while (popped < count) {
+    OuterNode<K, V> *outer_node = LeftmostLeaf();
+    if (outer_node == nullptr) {
+      break;
+    }
+    const size_t size = outer_node->keys_.size();
+    const size_t take = std::min(count - popped, size);
+    for (size_t i = 0; i < take; i++) {
+      if (policy_.hash_index) {
+        index_.Erase(outer_node->keys_[i], outer_node);
+      }
+      out.emplace_back(std::move(outer_node->keys_[i]),
+                       std::move(outer_node->values_[i]));
+    }
+    popped += take;
+    size_ -= take;
+    outer_node->keys_.erase(outer_node->keys_.begin(),
+                            outer_node->keys_.begin() + take);
+    outer_node->values_.erase(outer_node->values_.begin(),
+                              outer_node->values_.begin() + take);
+    UpdatePath(outer_node, -static_cast<ptrdiff_t>(take));
+    if (take == size) {
+      ReleaseLeaf(outer_node);
+    } else if (outer_node != root_) {
+      Balance(outer_node, RightNode(outer_node));
+    }
+  }
+  return popped;
 }
 
-template <class K, class V> bool Map<K, V>::Contains(const K &key) {
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Contains(const K &key) {
+  MAP_TIME(find);
   size_t position;
   OuterNode<K, V> *outer_node;
   std::tie(position, outer_node) = Locate(key);
@@ -1082,8 +3189,17 @@ template <class K, class V> bool Map<K, V>::Contains(const K &key) {
   return true;
 }
 
-template <class K, class V> MapIterator<K, V> Map<K, V>::Find(const K &key) {
-  MapIterator<K, V> iter;
+template <class K, class V, class Compare>
+template <class Q, class>
+bool Map<K, V, Compare>::Contains(const Q &key) {
+  MAP_TIME(find);
+  return std::get<0>(Locate(key)) != std::string::npos;
+}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::Find(const K &key) {
+  MAP_TIME(find);
+  MapIterator<K, V, Compare> iter;
   size_t index = std::string::npos;
   OuterNode<K, V> *outer_node = nullptr;
   std::tie(index, outer_node) = Locate(key);
@@ -1094,584 +3210,2708 @@ template <class K, class V> MapIterator<K, V> Map<K, V>::Find(const K &key) {
   return iter;
 }
 
-template <class K, class V> MapIterator<K, V> Map<K, V>::BeginIterator() {
-  if (root_ == nullptr) {
-    return End();
+template <class K, class V, class Compare>
+template <class Q, class>
+MapIterator<K, V, Compare> Map<K, V, Compare>::Find(const Q &key) {
+  MAP_TIME(find);
+  MapIterator<K, V, Compare> iter;
+  size_t index = std::string::npos;
+  OuterNode<K, V> *outer_node = nullptr;
+  std::tie(index, outer_node) = Locate(key);
+  if (index != std::string::npos) {
+    iter.index_ = index;
+    iter.node_ = outer_node;
   }
-  MapIterator<K, V> iter;
-  iter.node_ = FirstLeaf();
-  iter.index_ = 0;
   return iter;
 }
 
-template <class K, class V> MapIterator<K, V> Map<K, V>::Begin() {
-  return BeginIterator();
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::LowerBound(const K &key) {
+  MapIterator<K, V, Compare> iter;
+  OuterNode<K, V> *outer_node = LocateLeaf(key);
+  if (outer_node == nullptr) {
+    return iter;
+  }
+  size_t position = outer_node->Position(key, compare_);
+  if (position == outer_node->keys_.size()) {
+    outer_node = outer_node->next_;
+    position = 0;
+  }
+  if (outer_node != nullptr) {
+    iter.node_ = outer_node;
+    iter.index_ = position;
+  }
+  return iter;
 }
 
-template <class K, class V> const MapIterator<K, V> Map<K, V>::Begin() const {
-  return BeginIterator();
+// Calls function(key, value) for every element in key order.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ForEach(F function) {
+  ForEachBlock([&function](const K *keys, const V *values, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      function(keys[i], values[i]);
+    }
+  });
 }
 
-template <class K, class V> MapIterator<K, V> Map<K, V>::End() {
-  return MapIterator<K, V>();
+// Calls function(key, value) for every element with low <= key < high.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ForEach(const K &low, const K &high, F function) {
+  ForEachBlock(low, high,
+               [&function](const K *keys, const V *values, size_t count) {
+                 for (size_t i = 0; i < count; i++) {
+                   function(keys[i], values[i]);
+                 }
+               });
 }
 
-template <class K, class V> const MapIterator<K, V> Map<K, V>::End() const {
-  return MapIterator<K, V>();
+// Calls function(keys, values, count) once per leaf with the leaf's arrays,
+// so the callback runs over contiguous memory without iterator overhead.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ForEachBlock(F function) {
+  size_t slot = std::string::npos;
+  for (OuterNode<K, V> *outer_node = FirstLeaf(); outer_node != nullptr;
+       outer_node = outer_node->next_) {
+    slot = outer_node->PrefetchAhead(MAP_PREFETCH_DISTANCE, slot + 1);
+    if (!outer_node->keys_.empty()) {
+      function(outer_node->keys_.data(), outer_node->values_.data(),
+               outer_node->keys_.size());
+    }
+  }
 }
 
-template <class K, class V> void Map<K, V>::Save(const std::string &filepath) {
-  if (root_ == nullptr) {
-    return;
-  }
-  OuterNode<K, V> *cursor = FirstLeaf();
-  std::fstream file;
-  file.open(filepath,
-            std::fstream::trunc | std::fstream::out | std::fstream::binary);
-  if (!file.is_open()) {
+// Like ForEachBlock but restricted to low <= key < high; the first and the
+// last leaf are handed over partially.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ForEachBlock(const K &low, const K &high, F function) {
+  if (root_ == nullptr || !compare_.Less(low, high)) {
     return;
   }
-  for (;;) {
-    for (size_t i = 0; i < cursor->keys_.size(); i++) {
-      SerializerInstance<K>().Serialize(cursor->keys_[i], file);
-      SerializerInstance<V>().Serialize(cursor->values_[i], file);
+  OuterNode<K, V> *outer_node = LocateLeaf(low);
+  size_t begin = outer_node->Position(low, compare_);
+  size_t slot = std::string::npos;
+  while (outer_node != nullptr) {
+    slot = outer_node->PrefetchAhead(MAP_PREFETCH_DISTANCE, slot + 1);
+    const size_t size = outer_node->keys_.size();
+    size_t end = size;
+    if (size > 0 && !compare_.Less(outer_node->keys_.back(), high)) {
+      end = outer_node->Position(high, compare_);
     }
-    if (cursor->next_) {
-      cursor = cursor->next_;
-      continue;
+    if (begin < end) {
+      function(outer_node->keys_.data() + begin,
+               outer_node->values_.data() + begin, end - begin);
     }
-    break;
+    if (end < size) {
+      return;
+    }
+    outer_node = outer_node->next_;
+    begin = 0;
   }
-  file.close();
 }
 
-template <class K, class V>
-size_t Map<K, V>::FindDegree(size_t cache_size, size_t preferred_size,
-                             size_t maximum_size) {
-  if (cache_size >= 2 * preferred_size) {
-    return preferred_size;
-  } else {
-    if (cache_size > maximum_size) {
-      return cache_size / 2;
-    } else {
-      return cache_size;
+// Calls function(key, value) for every element from several threads at once,
+// in key order within each thread but in no particular order overall. The
+// function must be safe to call concurrently and the tree must not change
+// during the traversal. threads = 0 uses all hardware threads.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ParallelForEach(F function, size_t threads) {
+  ParallelRange(nullptr, nullptr, char(),
+                [&function](char &, const K &key, const V &value) {
+                  function(key, value);
+                },
+                [](char, char) { return char(); }, threads);
+}
+
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::ParallelForEach(const K &low, const K &high,
+                                         F function, size_t threads) {
+  ParallelRange(&low, &high, char(),
+                [&function](char &, const K &key, const V &value) {
+                  function(key, value);
+                },
+                [](char, char) { return char(); }, threads);
+}
+
+// Folds every element into a partial result per subrange with
+// function(partial, key, value), starting from identity, and combines the
+// partial results in key order with combine(left, right).
+template <class K, class V, class Compare>
+template <class T, class F, class C>
+T Map<K, V, Compare>::ParallelReduce(T identity, F function, C combine,
+                                     size_t threads) {
+  return ParallelRange(nullptr, nullptr, identity, function, combine,
+                       threads);
+}
+
+template <class K, class V, class Compare>
+template <class T, class F, class C>
+T Map<K, V, Compare>::ParallelReduce(const K &low, const K &high, T identity,
+                                     F function, C combine, size_t threads) {
+  return ParallelRange(&low, &high, identity, function, combine, threads);
+}
+
+// Splits the subtrees overlapping [low, high) level by level until there
+// are at least parts of them or the leaves are reached. A null bound is
+// open. Neighbouring subtrees hold about the same number of elements, so
+// the pieces are balanced up to the two partial ones at the ends.
+template <class K, class V, class Compare>
+std::vector<Node *> Map<K, V, Compare>::Partition(const K *low, const K *high,
+                                                  size_t parts) {
+  std::vector<Node *> nodes;
+  if (root_ == nullptr) {
+    return nodes;
+  }
+  nodes.push_back(root_);
+  while (nodes.size() < parts && !nodes.front()->IsOuter()) {
+    std::vector<Node *> children;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+      InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(*it);
+      size_t first = 0;
+      size_t last = inner_node->keys_.size();
+      if (low != nullptr) {
+        first = inner_node->Descend(*low, compare_);
+      }
+      if (high != nullptr) {
+        last = std::lower_bound(inner_node->keys_.begin(),
+                                inner_node->keys_.end(), *high,
+                                KeyLess<Compare>(compare_)) -
+               inner_node->keys_.begin();
+      }
+      children.insert(children.end(), inner_node->children_.begin() + first,
+                      inner_node->children_.begin() + last + 1);
     }
+    nodes.swap(children);
   }
+  return nodes;
 }
 
-template <class K, class V> void Map<K, V>::Load(const std::string &filepath) {
-  struct stat info;
-  if (stat(filepath.c_str(), &info) != 0 || info.st_mode & S_IFREG != S_IFREG) {
-    return;
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::VisitSubtree(Node *node, const K *low, const K *high,
+                                      F function) {
+  Node *last = node;
+  while (!node->IsOuter()) {
+    node = static_cast<InnerNode<K, V> *>(node)->children_.front();
   }
-  const off_t filesize = info.st_size;
-  std::fstream file;
-  file.open(filepath, std::fstream::in | std::fstream::binary);
-  if (!file.is_open()) {
-    return;
+  while (!last->IsOuter()) {
+    last = static_cast<InnerNode<K, V> *>(last)->children_.back();
   }
-  const size_t preferred_outer_degree = 3 * OUTER_NODE_DEGREE / 4;
-  const size_t preferred_inner_degree = 3 * INNER_NODE_DEGREE / 4;
-  std::vector<Node *> level_cache;
-  OuterNode<K, V> *outer_cursor = nullptr;
-  OuterNode<K, V> *outer_previous = nullptr;
-  std::deque<std::pair<K, V>> read_ahead_cache;
-  std::pair<K, V> key_value_pair;
-  size_t outer_degree;
-  size_t bytes = 0;
-  while (bytes < filesize || read_ahead_cache.size() > 0) {
-    while (bytes < filesize &&
-           read_ahead_cache.size() < 2 * preferred_outer_degree) {
-      bytes += SerializerInstance<K>().Deserialize(key_value_pair.first, file);
-      bytes += SerializerInstance<V>().Deserialize(key_value_pair.second, file);
-      read_ahead_cache.push_back(key_value_pair);
-    }
-    outer_degree = FindDegree(read_ahead_cache.size(), preferred_outer_degree,
-                              OUTER_NODE_DEGREE);
-    outer_cursor = new OuterNode<K, V>();
-    outer_cursor->keys_.resize(outer_degree);
-    outer_cursor->values_.resize(outer_degree);
-    for (size_t i = 0; i < outer_degree; i++) {
-      outer_cursor->keys_[i] = read_ahead_cache.front().first;
-      outer_cursor->values_[i] = read_ahead_cache.front().second;
-      read_ahead_cache.pop_front();
+  OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(node);
+  while (true) {
+    const size_t size = outer_node->keys_.size();
+    size_t begin = 0;
+    size_t end = size;
+    if (low != nullptr && size > 0 &&
+        compare_.Less(outer_node->keys_.front(), *low)) {
+      begin = outer_node->Position(*low, compare_);
     }
-    if (outer_previous) {
-      outer_previous->next_ = outer_cursor;
-      outer_cursor->previous_ = outer_previous;
-      outer_cursor->next_ = nullptr;
-    } else {
-      outer_cursor->previous_ = nullptr;
+    if (high != nullptr && size > 0 &&
+        !compare_.Less(outer_node->keys_.back(), *high)) {
+      end = outer_node->Position(*high, compare_);
     }
-    outer_previous = outer_cursor;
-    level_cache.push_back(outer_cursor);
-  }
-  file.close();
-  InnerNode<K, V> *inner_cursor = nullptr;
-  size_t current_inner_degree;
-  for (;;) {
-    size_t nodes_left = level_cache.size();
-    if (nodes_left == 1) {
-      root_ = level_cache[0];
-      break;
+    for (size_t i = begin; i < end; i++) {
+      function(outer_node->keys_[i], outer_node->values_[i]);
     }
-    size_t cache_index = 0;
-    std::vector<Node *> next_level_cache;
-    while (nodes_left > 0) {
-      current_inner_degree = FindDegree(nodes_left, preferred_inner_degree + 1,
-                                        INNER_NODE_DEGREE + 1);
-      nodes_left -= current_inner_degree;
-      inner_cursor = new InnerNode<K, V>();
-      inner_cursor->keys_.resize(current_inner_degree - 1);
-      inner_cursor->children_.resize(current_inner_degree);
-      inner_cursor->children_[0] = level_cache[cache_index++];
-      for (size_t i = 0; i < current_inner_degree - 1; i++) {
-        if (level_cache[cache_index]->IsOuter()) {
-          inner_cursor->keys_[i] =
-              static_cast<OuterNode<K, V> *>(level_cache[cache_index])
-                  ->keys_.front();
-        } else {
-          inner_cursor->keys_[i] =
-              static_cast<InnerNode<K, V> *>(level_cache[cache_index])
-                  ->keys_.front();
-        }
-        inner_cursor->children_[i + 1] = level_cache[cache_index++];
-      }
-      next_level_cache.push_back(inner_cursor);
+    if (outer_node == last || end < size) {
+      return;
     }
-    level_cache = next_level_cache;
+    outer_node = outer_node->next_;
   }
 }
 
-template <class K, class V> class MapIterator {
-  template <class, class> friend class ::InnerNode;
-  template <class, class> friend class ::OuterNode;
-  template <class, class> friend class ::Map;
-  template <class, class> friend class ::Multimap;
+// Every task folds into a local partial result and stores it only at the
+// end into a slot padded to a cache line, so the threads do not share cache
+// lines while scanning or storing.
+template <class K, class V, class Compare>
+template <class T, class F, class C>
+T Map<K, V, Compare>::ParallelRange(const K *low, const K *high, T identity,
+                                    F function, C combine, size_t threads) {
+  if (root_ == nullptr ||
+      (low != nullptr && !compare_.Less(*low, *high))) {
+    return identity;
+  }
+  WorkStealingPool pool(threads);
+  const std::vector<Node *> nodes = Partition(low, high, 8 * pool.Threads());
+  std::vector<PaddedPartial<T>> partials(nodes.size(),
+                                        PaddedPartial<T>{identity});
+  pool.Run(nodes.size(), [&](size_t task) {
+    T partial = identity;
+    VisitSubtree(nodes[task], low, high,
+                 [&](const K &key, const V &value) {
+                   function(partial, key, value);
+                 });
+    partials[task].value = std::move(partial);
+  });
+  T result = identity;
+  for (size_t i = 0; i < partials.size(); i++) {
+    result = combine(result, partials[i].value);
+  }
+  return result;
+}
+
+// Counts the elements with low <= key < high, from two ranks with
+// MAP_SUBTREE_COUNTS and by walking the leaves of the range otherwise.
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::Count(const K &low, const K &high) {
+#ifdef MAP_SUBTREE_COUNTS
+  return compare_.Less(low, high) ? Rank(high) - Rank(low) : 0;
+#else
+  size_t count = 0;
+  ForEachBlock(low, high, [&count](const K *, const V *, size_t block_count) {
+    count += block_count;
+  });
+  return count;
+#endif
+}
+
+// Returns the number of elements less than key. With MAP_SUBTREE_COUNTS the
+// descent adds up the counts of the children left of the path, otherwise
+// the leaves left of the key are walked.
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::Rank(const K &key) {
+  if (root_ == nullptr) {
+    return 0;
+  }
+  size_t rank = 0;
+#ifdef MAP_SUBTREE_COUNTS
+  Node *current = root_;
+  while (!current->IsOuter()) {
+    InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
+    const size_t child = inner_node->Descend(key, compare_);
+    for (size_t i = 0; i < child; i++) {
+      rank += inner_node->counts_[i];
+    }
+    current = inner_node->children_[child];
+  }
+  OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(current);
+#else
+  OuterNode<K, V> *outer_node = LocateLeaf(key);
+  for (OuterNode<K, V> *cursor = outer_node->previous_; cursor != nullptr;
+       cursor = cursor->previous_) {
+    rank += cursor->keys_.size();
+  }
+#endif
+  return rank + outer_node->Position(key, compare_);
+}
+
+// Returns an iterator to the element with the given zero-based rank or End()
+// if there are not that many elements.
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::Select(size_t index) {
+  MapIterator<K, V, Compare> iter;
+  if (index >= size_) {
+    return iter;
+  }
+#ifdef MAP_SUBTREE_COUNTS
+  Node *current = root_;
+  while (!current->IsOuter()) {
+    InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
+    size_t child = 0;
+    while (index >= inner_node->counts_[child]) {
+      index -= inner_node->counts_[child];
+      child++;
+    }
+    current = inner_node->children_[child];
+  }
+  OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(current);
+#else
+  OuterNode<K, V> *outer_node = FirstLeaf();
+  while (index >= outer_node->keys_.size()) {
+    index -= outer_node->keys_.size();
+    outer_node = outer_node->next_;
+  }
+#endif
+  iter.node_ = outer_node;
+  iter.index_ = index;
+  return iter;
+}
+
+// Combines the elements with low <= key < high. Subtrees that lie inside
+// the range contribute the aggregate cached in their parent, so only the
+// two boundary paths are descended.
+template <class K, class V, class Compare>
+typename MapAggregate<K, V>::Type Map<K, V, Compare>::Aggregate(const K &low,
+                                                                const K &high) {
+  static_assert(MapAggregate<K, V>::enabled,
+                "Aggregate needs a specialization of MapAggregate");
+  if (root_ == nullptr || !compare_.Less(low, high)) {
+    return MapAggregate<K, V>::Identity();
+  }
+  return AggregateRange(root_, low, high, false, false);
+}
+
+// from_first and to_last tell that the keys of node are known to lie above
+// low or below high respectively.
+template <class K, class V, class Compare>
+typename MapAggregate<K, V>::Type
+Map<K, V, Compare>::AggregateRange(Node *node, const K &low, const K &high,
+                                   bool from_first, bool to_last) {
+  if (from_first && to_last) {
+    return Summarize(node);
+  }
+  if (node->IsOuter()) {
+    OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(node);
+    const size_t begin = from_first ? 0 : outer_node->Position(low, compare_);
+    const size_t end = to_last ? outer_node->keys_.size()
+                               : outer_node->Position(high, compare_);
+    if (begin >= end) {
+      return MapAggregate<K, V>::Identity();
+    }
+    return Summarize(outer_node, begin, end);
+  }
+  InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(node);
+  const size_t first = from_first ? 0 : inner_node->Descend(low, compare_);
+  const size_t last =
+      to_last ? inner_node->keys_.size() : inner_node->Descend(high, compare_);
+  if (first == last) {
+    return AggregateRange(inner_node->children_[first], low, high, from_first,
+                          to_last);
+  }
+  typename MapAggregate<K, V>::Type summary = AggregateRange(
+      inner_node->children_[first], low, high, from_first, true);
+  for (size_t i = first + 1; i < last; i++) {
+    summary = MapAggregate<K, V>::Combine(summary, inner_node->aggregates_[i]);
+  }
+  return MapAggregate<K, V>::Combine(
+      summary, AggregateRange(inner_node->children_[last], low, high, true,
+                              to_last));
+}
+
+template <class K, class V, class Compare>
+V Map<K, V, Compare>::Sum(const K &low, const K &high) {
+  static_assert(std::is_arithmetic<V>::value, "Sum needs arithmetic values");
+  V sum = V();
+  ForEachBlock(low, high,
+               [&sum](const K *, const V *values, size_t count) {
+                 sum += SumBlock(values, count);
+               });
+  return sum;
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Min(const K &low, const K &high, V &minimum) {
+  static_assert(std::is_arithmetic<V>::value, "Min needs arithmetic values");
+  bool found = false;
+  ForEachBlock(low, high, [&](const K *, const V *values, size_t count) {
+    const V block_minimum = MinBlock(values, count);
+    if (!found || block_minimum < minimum) {
+      minimum = block_minimum;
+    }
+    found = true;
+  });
+  return found;
+}
+
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Max(const K &low, const K &high, V &maximum) {
+  static_assert(std::is_arithmetic<V>::value, "Max needs arithmetic values");
+  bool found = false;
+  ForEachBlock(low, high, [&](const K *, const V *values, size_t count) {
+    const V block_maximum = MaxBlock(values, count);
+    if (!found || maximum < block_maximum) {
+      maximum = block_maximum;
+    }
+    found = true;
+  });
+  return found;
+}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::BeginIterator() {
+  if (root_ == nullptr) {
+    return End();
+  }
+  MapIterator<K, V, Compare> iter;
+  iter.node_ = FirstLeaf();
+  iter.index_ = 0;
+  return iter;
+}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::Begin() {
+  return BeginIterator();
+}
+
+template <class K, class V, class Compare>
+const MapIterator<K, V, Compare> Map<K, V, Compare>::Begin() const {
+  return BeginIterator();
+}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare> Map<K, V, Compare>::End() {
+  return MapIterator<K, V, Compare>();
+}
+
+template <class K, class V, class Compare>
+const MapIterator<K, V, Compare> Map<K, V, Compare>::End() const {
+  return MapIterator<K, V, Compare>();
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Save(const std::string &filepath) {
+  MAP_TIME(save);
+  if (root_ == nullptr) {
+    return;
+  }
+  OuterNode<K, V> *cursor = FirstLeaf();
+  std::fstream file;
+  file.open(filepath,
+            std::fstream::trunc | std::fstream::out | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  for (;;) {
+    for (size_t i = 0; i < cursor->keys_.size(); i++) {
+      SerializerInstance<K>().Serialize(cursor->keys_[i], file);
+      SerializerInstance<V>().Serialize(cursor->values_[i], file);
+    }
+    if (cursor->next_) {
+      cursor = cursor->next_;
+      continue;
+    }
+    break;
+  }
+  file.close();
+}
+
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::FindDegree(size_t cache_size, size_t preferred_size,
+                                      size_t maximum_size) {
+  if (cache_size >= 2 * preferred_size) {
+    return preferred_size;
+  } else {
+    if (cache_size > maximum_size) {
+      return cache_size / 2;
+    } else {
+      return cache_size;
+    }
+  }
+}
+
+// Replaces the contents of the tree with the elements of a file written by
+// Save.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Load(const std::string &filepath) {
+  MAP_TIME(load);
+  Clear();
+  struct stat info;
+  if (stat(filepath.c_str(), &info) != 0 ||
+      (info.st_mode & S_IFREG) != S_IFREG) {
+    return;
+  }
+  const size_t filesize = info.st_size;
+  std::fstream file;
+  file.open(filepath, std::fstream::in | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  size_t bytes = 0;
+  Assemble([&](K &key, V &value) {
+    if (bytes >= filesize) {
+      return false;
+    }
+    bytes += SerializerInstance<K>().Deserialize(key, file);
+    bytes += SerializerInstance<V>().Deserialize(value, file);
+    return true;
+  });
+  file.close();
+}
+
+// Builds the tree bottom-up from the ascending elements that read(key, value)
+// yields until it returns false. The leaves are packed to the load fill and
+// linked, then the inner levels are stacked on top. The tree must be empty.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::Assemble(F read) {
+  const size_t preferred_outer_degree =
+      PreferredDegree(policy_.load_fill, OUTER_NODE_DEGREE);
+  const size_t preferred_inner_degree =
+      PreferredDegree(policy_.load_fill, INNER_NODE_DEGREE);
+  std::vector<Node *> level_cache;
+  OuterNode<K, V> *outer_cursor = nullptr;
+  OuterNode<K, V> *outer_previous = nullptr;
+  std::deque<std::pair<K, V>> read_ahead_cache;
+  std::pair<K, V> key_value_pair;
+  size_t outer_degree;
+  bool more = true;
+  while (more || read_ahead_cache.size() > 0) {
+    while (more && read_ahead_cache.size() < 2 * preferred_outer_degree) {
+      more = read(key_value_pair.first, key_value_pair.second);
+      if (more) {
+        read_ahead_cache.push_back(std::move(key_value_pair));
+      }
+    }
+    if (read_ahead_cache.empty()) {
+      break;
+    }
+    outer_degree = FindDegree(read_ahead_cache.size(), preferred_outer_degree,
+                              OUTER_NODE_DEGREE);
+    outer_cursor = NewOuterNode();
+    outer_cursor->keys_.resize(outer_degree);
+    outer_cursor->values_.resize(outer_degree);
+    for (size_t i = 0; i < outer_degree; i++) {
+      outer_cursor->keys_[i] = std::move(read_ahead_cache.front().first);
+      outer_cursor->values_[i] = std::move(read_ahead_cache.front().second);
+      read_ahead_cache.pop_front();
+    }
+    size_ += outer_degree;
+    if (outer_previous) {
+      outer_previous->next_ = outer_cursor;
+      outer_cursor->previous_ = outer_previous;
+      outer_cursor->next_ = nullptr;
+    } else {
+      outer_cursor->previous_ = nullptr;
+    }
+    outer_previous = outer_cursor;
+    level_cache.push_back(outer_cursor);
+    if (policy_.hash_index) {
+      IndexLeaf(outer_cursor);
+    }
+  }
+  if (!level_cache.empty()) {
+    first_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.front());
+    last_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.back());
+  }
+  BuildLevels(level_cache, preferred_inner_degree);
+}
+
+template <class K, class V, class Compare>
+inline size_t Map<K, V, Compare>::PreferredDegree(double fill,
+                                                  size_t maximum_size) {
+  const size_t degree = static_cast<size_t>(fill * maximum_size + 0.5);
+  return std::max(maximum_size / 2, std::min(maximum_size, degree));
+}
+
+template <class K, class V, class Compare>
+const K &Map<K, V, Compare>::MinimumKey(Node *node) {
+  while (!node->IsOuter()) {
+    node = static_cast<InnerNode<K, V> *>(node)->children_.front();
+  }
+  return static_cast<OuterNode<K, V> *>(node)->keys_.front();
+}
+
+// Stacks inner levels bottom-up on top of a level of linked leaves until a
+// single root remains.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::BuildLevels(std::vector<Node *> &level,
+                                     size_t preferred_inner_degree) {
+  if (level.empty()) {
+    root_ = nullptr;
+    return;
+  }
+  InnerNode<K, V> *inner_cursor = nullptr;
+  size_t current_inner_degree;
+  std::vector<Node *> next_level;
+  while (level.size() > 1) {
+    size_t nodes_left = level.size();
+    size_t cache_index = 0;
+    next_level.clear();
+    while (nodes_left > 0) {
+      current_inner_degree = FindDegree(nodes_left, preferred_inner_degree + 1,
+                                        INNER_NODE_DEGREE + 1);
+      nodes_left -= current_inner_degree;
+      inner_cursor = NewInnerNode();
+      inner_cursor->keys_.resize(current_inner_degree - 1);
+      inner_cursor->children_.resize(current_inner_degree);
+      inner_cursor->children_[0] = level[cache_index++];
+      inner_cursor->children_[0]->SetParent(inner_cursor);
+      for (size_t i = 0; i < current_inner_degree - 1; i++) {
+        inner_cursor->keys_[i] = MinimumKey(level[cache_index]);
+        inner_cursor->children_[i + 1] = level[cache_index++];
+        inner_cursor->children_[i + 1]->SetParent(inner_cursor);
+      }
+#ifdef MAP_SUBTREE_COUNTS
+      inner_cursor->counts_.resize(current_inner_degree);
+      for (size_t i = 0; i < current_inner_degree; i++) {
+        inner_cursor->counts_[i] = SubtreeSize(inner_cursor->children_[i]);
+      }
+#endif
+      if (MapAggregate<K, V>::enabled) {
+        inner_cursor->aggregates_.resize(current_inner_degree);
+        for (size_t i = 0; i < current_inner_degree; i++) {
+          inner_cursor->aggregates_[i] = Summarize(inner_cursor->children_[i]);
+        }
+      }
+      next_level.push_back(inner_cursor);
+    }
+    level.swap(next_level);
+  }
+  root_ = level.front();
+  root_->SetParent(nullptr);
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ReleaseInnerNodes() {
+  if (root_ == nullptr || root_->IsOuter()) {
+    return;
+  }
+  std::stack<InnerNode<K, V> *> todo;
+  todo.push(static_cast<InnerNode<K, V> *>(root_));
+  while (!todo.empty()) {
+    InnerNode<K, V> *inner_node = todo.top();
+    todo.pop();
+    for (auto it = inner_node->children_.begin();
+         it != inner_node->children_.end(); ++it) {
+      if (!(*it)->IsOuter()) {
+        todo.push(static_cast<InnerNode<K, V> *>(*it));
+      }
+    }
+    DeleteNode(inner_node);
+  }
+  root_ = nullptr;
+}
+
+// Moves the first count elements of right to the back of left.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ShiftLeft(OuterNode<K, V> *left,
+                                   OuterNode<K, V> *right, size_t count) {
+  std::move(right->keys_.begin(), right->keys_.begin() + count,
+            std::back_inserter(left->keys_));
+  if (policy_.hash_index) {
+    index_.Move(right, left, left->keys_.size() - count, left->keys_.size());
+  }
+  std::move(right->values_.begin(), right->values_.begin() + count,
+            std::back_inserter(left->values_));
+  right->keys_.erase(right->keys_.begin(), right->keys_.begin() + count);
+  right->values_.erase(right->values_.begin(),
+                       right->values_.begin() + count);
+}
+
+// Moves the last count elements of left to the front of right.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ShiftRight(OuterNode<K, V> *left,
+                                    OuterNode<K, V> *right, size_t count) {
+  right->keys_.insert(right->keys_.begin(),
+                      std::make_move_iterator(left->keys_.end() - count),
+                      std::make_move_iterator(left->keys_.end()));
+  right->values_.insert(right->values_.begin(),
+                        std::make_move_iterator(left->values_.end() - count),
+                        std::make_move_iterator(left->values_.end()));
+  left->keys_.erase(left->keys_.end() - count, left->keys_.end());
+  left->values_.erase(left->values_.end() - count, left->values_.end());
+  if (policy_.hash_index) {
+    index_.Move(left, right, 0, count);
+  }
+}
+
+// Repacks the leaf chain in place to target_fill of OUTER_NODE_DEGREE and
+// rebuilds the inner levels on top of it. Elements only move between
+// neighbouring leaves, so no second copy of the tree is ever held.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::Compact(double target_fill) {
+  compacting_ = false;
+  if (root_ == nullptr) {
+    return;
+  }
+  const size_t preferred_outer_degree =
+      PreferredDegree(target_fill, OUTER_NODE_DEGREE);
+  const size_t preferred_inner_degree =
+      PreferredDegree(target_fill, INNER_NODE_DEGREE);
+  OuterNode<K, V> *outer_cursor = FirstLeaf();
+  ReleaseInnerNodes();
+  std::vector<Node *> level_cache;
+  size_t elements_left = size_;
+  while (elements_left > 0) {
+    const size_t outer_degree = FindDegree(
+        elements_left, preferred_outer_degree, OUTER_NODE_DEGREE);
+    while (outer_cursor->keys_.size() < outer_degree) {
+      OuterNode<K, V> *next = outer_cursor->next_;
+      ShiftLeft(outer_cursor, next,
+                std::min(outer_degree - outer_cursor->keys_.size(),
+                         next->keys_.size()));
+      if (next->keys_.empty()) {
+        outer_cursor->next_ = next->next_;
+        if (next->next_ != nullptr) {
+          next->next_->previous_ = outer_cursor;
+        }
+        DeleteNode(next);
+      }
+    }
+    if (outer_cursor->keys_.size() > outer_degree) {
+      const size_t excess = outer_cursor->keys_.size() - outer_degree;
+      OuterNode<K, V> *next = outer_cursor->next_;
+      if (next == nullptr || next->keys_.size() + excess > OUTER_NODE_DEGREE) {
+        next = NewOuterNode();
+        next->next_ = outer_cursor->next_;
+        next->previous_ = outer_cursor;
+        if (outer_cursor->next_ != nullptr) {
+          outer_cursor->next_->previous_ = next;
+        }
+        outer_cursor->next_ = next;
+      }
+      ShiftRight(outer_cursor, next, excess);
+    }
+    level_cache.push_back(outer_cursor);
+    elements_left -= outer_degree;
+    outer_cursor = outer_cursor->next_;
+  }
+  first_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.front());
+  last_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.back());
+  BuildLevels(level_cache, preferred_inner_degree);
+}
+
+// Tops up at most leaves sparse leaves from their right sibling and resumes
+// where the previous call stopped. Returns true once a pass over the whole
+// leaf chain is complete. A remainder in the sibling that would fall below
+// half full is moved over as well if it fits, and otherwise the pair is
+// split evenly. Leaves of different parents are left alone, so a pass
+// approaches but does not always reach the packing of Compact.
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::CompactStep(double target_fill, size_t leaves) {
+  if (root_ == nullptr) {
+    compacting_ = false;
+    return true;
+  }
+  const size_t preferred_outer_degree =
+      PreferredDegree(target_fill, OUTER_NODE_DEGREE);
+  OuterNode<K, V> *outer_cursor =
+      compacting_ ? LocateLeaf(compact_key_) : FirstLeaf();
+  for (size_t i = 0; i < leaves; i++) {
+    OuterNode<K, V> *next = outer_cursor->next_;
+    if (next == nullptr) {
+      compacting_ = false;
+      return true;
+    }
+    if (outer_cursor->keys_.size() < preferred_outer_degree &&
+        next->parent_ == outer_cursor->parent_) {
+      ShiftLeft(outer_cursor, next,
+                std::min(preferred_outer_degree - outer_cursor->keys_.size(),
+                         next->keys_.size()));
+      if (next->IsSparse()) {
+        const size_t total = outer_cursor->keys_.size() + next->keys_.size();
+        if (total <= OUTER_NODE_DEGREE) {
+          ShiftLeft(outer_cursor, next, next->keys_.size());
+        } else {
+          ShiftRight(outer_cursor, next, total / 2 - next->keys_.size());
+        }
+      }
+      Refresh(outer_cursor);
+      Refresh(next);
+      if (next->keys_.empty()) {
+        ReleaseLeaf(next);
+        continue;
+      }
+      InnerNode<K, V> *parent =
+          static_cast<InnerNode<K, V> *>(outer_cursor->parent_);
+      parent->keys_[parent->ChildIndex(outer_cursor)] = next->keys_.front();
+    }
+    outer_cursor = next;
+  }
+  compacting_ = true;
+  compact_key_ = outer_cursor->keys_.front();
+  return false;
+}
+
+// Moves the elements with keys not less than key into upper, which is
+// cleared first. The tree is cut along the root-to-leaf path of key and the
+// two new edges are repaired top-down, so the structural work is
+// proportional to the height. Only the bookkeeping of the moved part (size,
+// heap usage and hash index entries) walks its leaves. Nodes cannot change
+// their memory resource, so if upper uses another one the part is cut off
+// into a temporary tree first and copied over leaf by leaf.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::SplitAt(const K &key, Map<K, V, Compare> &upper) {
+  if (&upper == this) {
+    return;
+  }
+  upper.Clear();
+  if (root_ == nullptr ||
+      compare_.Less(LastLeaf()->keys_.back(), key)) {
+    return;
+  }
+  if (!SameResources(upper)) {
+    Map<K, V, Compare> part(upper.policy_, resource_, inner_resource_,
+                            compare_);
+    SplitAt(key, part);
+    upper.Join(part);
+    return;
+  }
+  if (!compare_.Less(FirstLeaf()->keys_.front(), key)) {
+    upper.Join(*this);
+    return;
+  }
+  std::vector<InnerNode<K, V> *> path;
+  std::vector<size_t> slots;
+  Node *current = root_;
+  while (!current->IsOuter()) {
+    InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
+    const size_t slot = inner_node->Descend(key, compare_);
+    path.push_back(inner_node);
+    slots.push_back(slot);
+    current = inner_node->children_[slot];
+  }
+  OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(current);
+  const size_t position = outer_node->Position(key, compare_);
+  OuterNode<K, V> *right_leaf = upper.NewOuterNode();
+  size_ -= outer_node->keys_.size() - position;
+  for (size_t i = position; i < outer_node->keys_.size(); i++) {
+    if (policy_.hash_index) {
+      index_.Erase(outer_node->keys_[i], outer_node);
+    }
+  }
+  std::move(outer_node->keys_.begin() + position, outer_node->keys_.end(),
+            std::back_inserter(right_leaf->keys_));
+  std::move(outer_node->values_.begin() + position, outer_node->values_.end(),
+            std::back_inserter(right_leaf->values_));
+  outer_node->keys_.erase(outer_node->keys_.begin() + position,
+                          outer_node->keys_.end());
+  outer_node->values_.erase(outer_node->values_.begin() + position,
+                            outer_node->values_.end());
+  right_leaf->next_ = outer_node->next_;
+  if (right_leaf->next_ != nullptr) {
+    right_leaf->next_->previous_ = right_leaf;
+  }
+  outer_node->next_ = nullptr;
+  upper.size_ += right_leaf->keys_.size();
+  if (upper.policy_.hash_index) {
+    upper.IndexLeaf(right_leaf);
+  }
+  Node *right_child = right_leaf;
+  for (size_t level = path.size(); level > 0; level--) {
+    InnerNode<K, V> *inner_node = path[level - 1];
+    const size_t slot = slots[level - 1];
+    InnerNode<K, V> *right_inner = upper.NewInnerNode();
+    right_inner->children_.push_back(right_child);
+    right_child->SetParent(right_inner);
+    for (size_t i = slot + 1; i < inner_node->children_.size(); i++) {
+      Node *child = inner_node->children_[i];
+      TransferSubtree(child, upper);
+      right_inner->children_.push_back(child);
+      child->SetParent(right_inner);
+    }
+    std::move(inner_node->keys_.begin() + slot, inner_node->keys_.end(),
+              std::back_inserter(right_inner->keys_));
+    inner_node->keys_.erase(inner_node->keys_.begin() + slot,
+                            inner_node->keys_.end());
+    inner_node->children_.erase(inner_node->children_.begin() + slot + 1,
+                                inner_node->children_.end());
+#ifdef MAP_SUBTREE_COUNTS
+    right_inner->counts_.push_back(0);
+    right_inner->counts_.insert(right_inner->counts_.end(),
+                                inner_node->counts_.begin() + slot + 1,
+                                inner_node->counts_.end());
+    inner_node->counts_.erase(inner_node->counts_.begin() + slot + 1,
+                              inner_node->counts_.end());
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      right_inner->aggregates_.push_back(MapAggregate<K, V>::Identity());
+      right_inner->aggregates_.insert(right_inner->aggregates_.end(),
+                                      inner_node->aggregates_.begin() + slot +
+                                          1,
+                                      inner_node->aggregates_.end());
+      inner_node->aggregates_.erase(inner_node->aggregates_.begin() + slot + 1,
+                                    inner_node->aggregates_.end());
+    }
+    right_child = right_inner;
+  }
+  upper.root_ = right_child;
+  first_leaf_ = nullptr;
+  last_leaf_ = nullptr;
+  compacting_ = false;
+  RepairEdge(true);
+  upper.RepairEdge(false);
+}
+
+// Appends the elements of other if all of them are greater than the elements
+// of this tree, or prepends them if all are smaller, and leaves other empty.
+// The lower root is hung into the edge of the higher tree at its own level,
+// splitting upwards if needed, or copied leaf by leaf if the trees use
+// different memory resources. Returns false and changes nothing if the key
+// ranges overlap.
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Join(Map<K, V, Compare> &other) {
+  if (&other == this) {
+    return root_ == nullptr;
+  }
+  if (other.root_ == nullptr) {
+    return true;
+  }
+  OuterNode<K, V> *left_leaf = nullptr;
+  OuterNode<K, V> *right_leaf = nullptr;
+  Node *left_root = nullptr;
+  Node *right_root = nullptr;
+  if (root_ == nullptr) {
+    right_root = other.root_;
+  } else if (compare_.Less(LastLeaf()->keys_.back(),
+                           other.FirstLeaf()->keys_.front())) {
+    left_leaf = LastLeaf();
+    right_leaf = other.FirstLeaf();
+    left_root = root_;
+    right_root = other.root_;
+  } else if (compare_.Less(other.LastLeaf()->keys_.back(),
+                           FirstLeaf()->keys_.front())) {
+    left_leaf = other.LastLeaf();
+    right_leaf = FirstLeaf();
+    left_root = other.root_;
+    right_root = root_;
+  } else {
+    return false;
+  }
+  if (!SameResources(other)) {
+    MergeLeaves(other, [](V &, V &) {});
+    return true;
+  }
+  if (policy_.hash_index) {
+    for (OuterNode<K, V> *outer_node = other.FirstLeaf(); outer_node != nullptr;
+         outer_node = outer_node->next_) {
+      IndexLeaf(outer_node);
+    }
+  }
+  size_ += other.size_;
+  inner_nodes_ += other.inner_nodes_;
+  outer_nodes_ += other.outer_nodes_;
+  other.root_ = nullptr;
+  other.first_leaf_ = nullptr;
+  other.last_leaf_ = nullptr;
+  other.size_ = 0;
+  other.inner_nodes_ = 0;
+  other.outer_nodes_ = 0;
+  other.compacting_ = false;
+  other.index_.Clear();
+  first_leaf_ = nullptr;
+  last_leaf_ = nullptr;
+  compacting_ = false;
+  if (left_root == nullptr) {
+    root_ = right_root;
+    return true;
+  }
+  left_leaf->next_ = right_leaf;
+  right_leaf->previous_ = left_leaf;
+  K separator = CopyKey(right_leaf->keys_, 0);
+  const size_t left_height = Height(left_root);
+  const size_t right_height = Height(right_root);
+  if (left_height >= right_height) {
+    root_ = left_root;
+    Node *origin = root_;
+    for (size_t i = right_height; i < left_height; i++) {
+      origin = static_cast<InnerNode<K, V> *>(origin)->children_.back();
+    }
+    PropagateUpwards(origin, separator, right_root, policy_.split_ratio);
+    Balance(LeftNode(right_root), right_root);
+  } else {
+    root_ = right_root;
+    Node *origin = root_;
+    for (size_t i = left_height; i < right_height; i++) {
+      origin = static_cast<InnerNode<K, V> *>(origin)->children_.front();
+    }
+    // The left root is inserted behind origin, which stays the first child
+    // through any split, and then swapped in front of it.
+    PropagateUpwards(origin, separator, left_root, policy_.split_ratio);
+    InnerNode<K, V> *parent =
+        static_cast<InnerNode<K, V> *>(origin->GetParent());
+    std::swap(parent->children_[0], parent->children_[1]);
+#ifdef MAP_SUBTREE_COUNTS
+    std::swap(parent->counts_[0], parent->counts_[1]);
+#endif
+    if (MapAggregate<K, V>::enabled) {
+      std::swap(parent->aggregates_[0], parent->aggregates_[1]);
+    }
+    Balance(left_root, RightNode(left_root));
+  }
+  RefreshPath(LocateLeaf(separator));
+  return true;
+}
+
+// Unions other into this tree and leaves other empty. Trees with disjoint
+// key ranges are joined, overlapping ones are merged. For keys in both trees
+// function(value, other_value) decides the value that is kept.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::Merge(Map<K, V, Compare> &other, F function) {
+  if (&other == this || Join(other)) {
+    return;
+  }
+  MergeLeaves(other, function);
+}
+
+// Merges both leaf chains in a single pass into freshly packed leaves at the
+// load fill, on top of which the inner levels are rebuilt bottom-up. The new
+// leaves come from this tree's resource and the old ones are released to
+// their own, so this also moves elements between trees that do not share a
+// memory resource.
+template <class K, class V, class Compare>
+template <class F>
+void Map<K, V, Compare>::MergeLeaves(Map<K, V, Compare> &other, F function) {
+  const size_t preferred_outer_degree =
+      PreferredDegree(policy_.load_fill, OUTER_NODE_DEGREE);
+  const size_t preferred_inner_degree =
+      PreferredDegree(policy_.load_fill, INNER_NODE_DEGREE);
+  OuterNode<K, V> *left = FirstLeaf();
+  OuterNode<K, V> *right = other.FirstLeaf();
+  ReleaseInnerNodes();
+  other.ReleaseInnerNodes();
+  index_.Clear();
+  other.index_.Clear();
+  size_ += other.size_;
+  other.root_ = nullptr;
+  other.size_ = 0;
+  other.first_leaf_ = nullptr;
+  other.last_leaf_ = nullptr;
+  other.compacting_ = false;
+  first_leaf_ = nullptr;
+  last_leaf_ = nullptr;
+  compacting_ = false;
+  std::vector<Node *> level_cache;
+  OuterNode<K, V> *outer_cursor = nullptr;
+  size_t left_index = 0;
+  size_t right_index = 0;
+  while (left != nullptr || right != nullptr) {
+    if (outer_cursor == nullptr ||
+        outer_cursor->keys_.size() == preferred_outer_degree) {
+      OuterNode<K, V> *next = NewOuterNode();
+      next->previous_ = outer_cursor;
+      if (outer_cursor != nullptr) {
+        outer_cursor->next_ = next;
+      }
+      outer_cursor = next;
+      level_cache.push_back(outer_cursor);
+    }
+    int order = right == nullptr ? -1 : 1;
+    if (left != nullptr && right != nullptr) {
+      order = compare_.Compare(left->keys_[left_index],
+                               right->keys_[right_index]);
+    }
+    if (order < 0) {
+      outer_cursor->keys_.push_back(std::move(left->keys_[left_index]));
+      outer_cursor->values_.push_back(std::move(left->values_[left_index]));
+      left_index++;
+    } else if (order > 0) {
+      outer_cursor->keys_.push_back(std::move(right->keys_[right_index]));
+      outer_cursor->values_.push_back(std::move(right->values_[right_index]));
+      right_index++;
+    } else {
+      V &value = left->values_[left_index];
+      function(value, right->values_[right_index]);
+      size_--;
+      outer_cursor->keys_.push_back(std::move(left->keys_[left_index]));
+      outer_cursor->values_.push_back(std::move(value));
+      left_index++;
+      right_index++;
+    }
+    if (left != nullptr && left_index == left->keys_.size()) {
+      OuterNode<K, V> *next = left->next_;
+      DeleteNode(left);
+      left = next;
+      left_index = 0;
+    }
+    if (right != nullptr && right_index == right->keys_.size()) {
+      OuterNode<K, V> *next = right->next_;
+      other.DeleteNode(right);
+      right = next;
+      right_index = 0;
+    }
+  }
+  // The last leaf holds the remainder. The last two leaves are split like
+  // the tail of Load, so neither is left sparse.
+  const size_t last = level_cache.size() - 1;
+  if (last > 0 && level_cache[last]->IsSparse()) {
+    OuterNode<K, V> *previous =
+        static_cast<OuterNode<K, V> *>(level_cache[last - 1]);
+    OuterNode<K, V> *outer_node =
+        static_cast<OuterNode<K, V> *>(level_cache[last]);
+    const size_t total = previous->keys_.size() + outer_node->keys_.size();
+    const size_t degree =
+        FindDegree(total, preferred_outer_degree, OUTER_NODE_DEGREE);
+    if (degree > previous->keys_.size()) {
+      ShiftLeft(previous, outer_node, degree - previous->keys_.size());
+    } else {
+      ShiftRight(previous, outer_node, previous->keys_.size() - degree);
+    }
+    if (outer_node->keys_.empty()) {
+      previous->next_ = nullptr;
+      DeleteNode(outer_node);
+      level_cache.pop_back();
+    }
+  }
+  if (policy_.hash_index) {
+    for (size_t i = 0; i < level_cache.size(); i++) {
+      IndexLeaf(static_cast<OuterNode<K, V> *>(level_cache[i]));
+    }
+  }
+  first_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.front());
+  last_leaf_ = static_cast<OuterNode<K, V> *>(level_cache.back());
+  BuildLevels(level_cache, preferred_inner_degree);
+}
+
+template <class K, class V, class Compare>
+size_t Map<K, V, Compare>::Height(Node *node) const {
+  size_t height = 0;
+  while (!node->IsOuter()) {
+    node = static_cast<InnerNode<K, V> *>(node)->children_.front();
+    height++;
+  }
+  return height;
+}
+
+// Hands the nodes and elements of a subtree that was cut out of this tree
+// over to the bookkeeping of target.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::TransferSubtree(Node *node,
+                                         Map<K, V, Compare> &target) {
+  std::stack<Node *> todo;
+  todo.push(node);
+  while (!todo.empty()) {
+    Node *current = todo.top();
+    todo.pop();
+    if (!current->IsOuter()) {
+      InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
+      for (auto it = inner_node->children_.begin();
+           it != inner_node->children_.end(); ++it) {
+        todo.push(*it);
+      }
+      inner_nodes_--;
+      target.inner_nodes_++;
+      continue;
+    }
+    OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(current);
+    size_ -= outer_node->keys_.size();
+    target.size_ += outer_node->keys_.size();
+    for (size_t i = 0; i < outer_node->keys_.size(); i++) {
+      if (policy_.hash_index) {
+        index_.Erase(outer_node->keys_[i], outer_node);
+      }
+    }
+    if (target.policy_.hash_index) {
+      target.IndexLeaf(outer_node);
+    }
+    outer_nodes_--;
+    target.outer_nodes_++;
+  }
+}
+
+// Evens out two neighbouring children of the same parent by coalescing them
+// if they fit into one node and by moving elements into the sparser one
+// otherwise. Returns the survivor of a coalesce or nullptr.
+template <class K, class V, class Compare>
+Node *Map<K, V, Compare>::Balance(Node *left, Node *right) {
+  if (!left->IsSparse() && !right->IsSparse()) {
+    return nullptr;
+  }
+  InnerNode<K, V> *parent = static_cast<InnerNode<K, V> *>(left->GetParent());
+  if (left->Coalesce(right)) {
+    MAP_COUNT(coalesces);
+    IndexCoalesce(left, right);
+    const K separator_key = SeparatorKey(left, right);
+    parent->Erase(separator_key, right, compare_);
+    Refresh(left);
+    if (right == last_leaf_) {
+      last_leaf_ = nullptr;
+    }
+    DeleteNode(right);
+    Rebalance(parent);
+    return left;
+  }
+  while ((left->IsSparse() || right->IsSparse()) && left->Redistribute(right)) {
+    MAP_COUNT(redistributions);
+    IndexRedistribution(left, right);
+  }
+  Refresh(left);
+  Refresh(right);
+  return nullptr;
+}
+
+// After a cut the nodes along the right or left edge of the tree may be
+// sparse, empty or, for inner nodes, left with a single child. Walks the edge
+// top-down, balances every sparse node with its neighbour and collapses
+// roots with a single child.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::RepairEdge(bool right_edge) {
+  Node *current = root_;
+  while (current != nullptr && !current->IsOuter()) {
+    InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(current);
+    if (inner_node->keys_.empty()) {
+      root_ = inner_node->children_.front();
+      root_->SetParent(nullptr);
+      DeleteNode(inner_node);
+      MAP_COUNT(root_collapses);
+      current = root_;
+      continue;
+    }
+    const size_t size = inner_node->children_.size();
+    Node *child = right_edge ? inner_node->children_[size - 1]
+                             : inner_node->children_[0];
+    Node *sibling = right_edge ? inner_node->children_[size - 2]
+                               : inner_node->children_[1];
+    Node *survivor =
+        right_edge ? Balance(sibling, child) : Balance(child, sibling);
+    current = survivor != nullptr ? survivor : child;
+  }
+  if (root_ != nullptr && root_->IsOuter() &&
+      static_cast<OuterNode<K, V> *>(root_)->keys_.empty()) {
+    DeleteNode(root_);
+    root_ = nullptr;
+  }
+  if (root_ != nullptr) {
+    RefreshPath(right_edge ? LastLeaf() : FirstLeaf());
+  }
+}
+
+// Recomputes the subtree counts and aggregates from node up to the root.
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::RefreshPath(Node *node) {
+  while (node != root_) {
+    Refresh(node);
+    node = node->GetParent();
+  }
+}
+
+template <class K, class V, class Compare>
+MapStatistics Map<K, V, Compare>::Stats() const {
+  MapStatistics statistics;
+  statistics.counters = counters_;
+  if (root_ == nullptr) {
+    return statistics;
+  }
+  size_t inner_keys = 0;
+  std::vector<Node *> level{root_};
+  std::vector<Node *> next_level;
+  while (!level.empty()) {
+    statistics.level_nodes.push_back(level.size());
+    next_level.clear();
+    for (auto it = level.begin(); it != level.end(); ++it) {
+      if ((*it)->IsOuter()) {
+        statistics.outer_nodes++;
+        statistics.size += static_cast<OuterNode<K, V> *>(*it)->CountKeys();
+        continue;
+      }
+      InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(*it);
+      statistics.inner_nodes++;
+      inner_keys += inner_node->CountKeys();
+      next_level.insert(next_level.end(), inner_node->children_.begin(),
+                        inner_node->children_.end());
+    }
+    level.swap(next_level);
+  }
+  statistics.height = statistics.level_nodes.size();
+  if (statistics.inner_nodes > 0) {
+    statistics.inner_fill = static_cast<double>(inner_keys) /
+                            (statistics.inner_nodes * INNER_NODE_DEGREE);
+  }
+  statistics.outer_fill = static_cast<double>(statistics.size) /
+                          (statistics.outer_nodes * OUTER_NODE_DEGREE);
+  return statistics;
+}
+
+template <class K, class V, class Compare>
+MapMemoryUsage Map<K, V, Compare>::MemoryUsage() const {
+  MapMemoryUsage usage;
+  const size_t nodes = inner_nodes_ + outer_nodes_;
+  const size_t inner_keys = outer_nodes_ > 0 ? outer_nodes_ - 1 : 0;
+  const size_t inner_children = nodes > 0 ? nodes - 1 : 0;
+  usage.node_headers = inner_nodes_ * sizeof(InnerNode<K, V>) +
+                       outer_nodes_ * sizeof(OuterNode<K, V>);
+  usage.key_arrays = (size_ + inner_keys) * sizeof(K);
+  usage.value_arrays = size_ * sizeof(V);
+  usage.child_arrays = inner_children * sizeof(Node *);
+  size_t child_capacity = (INNER_NODE_DEGREE + 2) * sizeof(Node *);
+#ifdef MAP_SUBTREE_COUNTS
+  usage.child_arrays += inner_children * sizeof(size_t);
+  child_capacity += (INNER_NODE_DEGREE + 2) * sizeof(size_t);
+#endif
+  if (MapAggregate<K, V>::enabled) {
+    typedef typename MapAggregate<K, V>::Type Summary;
+    usage.child_arrays += inner_children * sizeof(Summary);
+    child_capacity += (INNER_NODE_DEGREE + 2) * sizeof(Summary);
+  }
+  const size_t capacity =
+      inner_nodes_ * ((INNER_NODE_DEGREE + 1) * sizeof(K) + child_capacity) +
+      outer_nodes_ * (OUTER_NODE_DEGREE + 1) * (sizeof(K) + sizeof(V));
+  usage.slack =
+      capacity - usage.key_arrays - usage.value_arrays - usage.child_arrays;
+  Node *current = root_;
+  while (current != nullptr && !current->IsOuter()) {
+    current = static_cast<InnerNode<K, V> *>(current)->children_.front();
+  }
+  HeapSize<K> key_size;
+  HeapSize<V> value_size;
+  for (const OuterNode<K, V> *outer_node =
+           static_cast<const OuterNode<K, V> *>(current);
+       outer_node != nullptr; outer_node = outer_node->next_) {
+    for (size_t i = 0; i < outer_node->keys_.size(); i++) {
+      usage.key_heap += key_size.Measure(outer_node->keys_[i]);
+      usage.value_heap += value_size.Measure(outer_node->values_[i]);
+    }
+  }
+  usage.hash_index = index_.MemoryUsage();
+  usage.total = usage.node_headers + capacity + usage.key_heap +
+                usage.value_heap + usage.hash_index;
+  return usage;
+}
+
+// Checks the invariants the operations of the tree rely on: keys ascend
+// within and across the leaves and lie between the separators above them,
+// parent and sibling links agree, all leaves are at the same depth, every
+// node but the root is at least half full unless the policy splits unevenly,
+// and the element and node counts, the subtree counts and the hash index
+// match the leaves. Walks the whole tree and is meant for tests.
+template <class K, class V, class Compare>
+bool Map<K, V, Compare>::Verify() const {
+  if (root_ == nullptr) {
+    return size_ == 0 && inner_nodes_ == 0 && outer_nodes_ == 0 &&
+           first_leaf_ == nullptr && last_leaf_ == nullptr &&
+           index_.Size() == 0;
+  }
+  size_t count = 0;
+  std::vector<OuterNode<K, V> *> leaves;
+  if (root_->GetParent() != nullptr ||
+      !VerifyNode(root_, nullptr, nullptr, 0, count, leaves) ||
+      count != size_ || leaves.size() != outer_nodes_) {
+    return false;
+  }
+  for (size_t i = 0; i < leaves.size(); i++) {
+    OuterNode<K, V> *previous = i > 0 ? leaves[i - 1] : nullptr;
+    OuterNode<K, V> *next = i + 1 < leaves.size() ? leaves[i + 1] : nullptr;
+    if (leaves[i]->previous_ != previous || leaves[i]->next_ != next) {
+      return false;
+    }
+  }
+  if ((first_leaf_ != nullptr && first_leaf_ != leaves.front()) ||
+      (last_leaf_ != nullptr && last_leaf_ != leaves.back())) {
+    return false;
+  }
+  if (index_.Size() != (policy_.hash_index ? size_ : 0)) {
+    return false;
+  }
+  for (size_t i = 0; policy_.hash_index && i < leaves.size(); i++) {
+    for (size_t j = 0; j < leaves[i]->keys_.size(); j++) {
+      if (!index_.Contains(leaves[i]->keys_[j], leaves[i])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Verifies the subtree of node, whose keys must lie in [low, high) where
+// the bounds are given, adds its elements to count and appends its leaves.
+template <class K, class V, class Compare>
+bool
+Map<K, V, Compare>::VerifyNode(Node *node, const K *low, const K *high,
+                               size_t depth, size_t &count,
+                               std::vector<OuterNode<K, V> *> &leaves) const {
+  if (node != root_ && node->IsSparse() && policy_.split_ratio == 0.5 &&
+      !policy_.detect_sequential) {
+    return false;
+  }
+  if (node->IsOuter()) {
+    OuterNode<K, V> *outer_node = static_cast<OuterNode<K, V> *>(node);
+    const std::pmr::vector<K> &keys = outer_node->keys_;
+    if (keys.empty() || keys.size() > OUTER_NODE_DEGREE ||
+        keys.size() != outer_node->values_.size() ||
+        depth != Height(root_) ||
+        (low != nullptr && compare_.Less(keys.front(), *low)) ||
+        (high != nullptr && !compare_.Less(keys.back(), *high))) {
+      return false;
+    }
+    for (size_t i = 1; i < keys.size(); i++) {
+      if (!compare_.Less(keys[i - 1], keys[i])) {
+        return false;
+      }
+    }
+    count += keys.size();
+    leaves.push_back(outer_node);
+    return true;
+  }
+  InnerNode<K, V> *inner_node = static_cast<InnerNode<K, V> *>(node);
+  const std::pmr::vector<K> &keys = inner_node->keys_;
+  if (keys.empty() || keys.size() > INNER_NODE_DEGREE ||
+      inner_node->children_.size() != keys.size() + 1) {
+    return false;
+  }
+  for (size_t i = 0; i < inner_node->children_.size(); i++) {
+    Node *child = inner_node->children_[i];
+    const K *child_low = i > 0 ? &keys[i - 1] : low;
+    const K *child_high = i < keys.size() ? &keys[i] : high;
+    if (child->GetParent() != node ||
+        (child_low != nullptr && child_high != nullptr &&
+         !compare_.Less(*child_low, *child_high))) {
+      return false;
+    }
+    size_t child_count = 0;
+    if (!VerifyNode(child, child_low, child_high, depth + 1, child_count,
+                    leaves)) {
+      return false;
+    }
+#ifdef MAP_SUBTREE_COUNTS
+    if (inner_node->counts_.size() != inner_node->children_.size() ||
+        inner_node->counts_[i] != child_count) {
+      return false;
+    }
+#endif
+    count += child_count;
+  }
+  return !MapAggregate<K, V>::enabled ||
+         inner_node->aggregates_.size() == inner_node->children_.size();
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ResetCounters() {
+  counters_ = MapCounters();
+}
+
+template <class K, class V, class Compare>
+MapLatencies Map<K, V, Compare>::Latencies() const {
+#ifdef MAP_LATENCY_HISTOGRAMS
+  return latencies_;
+#else
+  return MapLatencies();
+#endif
+}
+
+template <class K, class V, class Compare>
+void Map<K, V, Compare>::ResetLatencies() {
+#ifdef MAP_LATENCY_HISTOGRAMS
+  latencies_ = MapLatencies();
+#endif
+}
+
+template <class K, class V, class Compare> class MapIterator {
+  template <class, class> friend class ::InnerNode;
+  template <class, class> friend class ::OuterNode;
+  template <class, class, class> friend class ::Map;
+  template <class, class> friend class ::Multimap;
+  template <class, class> friend class ::MultimapIterator;
+
+public:
+  MapIterator();
+  ~MapIterator();
+  const K &GetKey() const;
+  const V &GetValue() const;
+  MapIterator<K, V, Compare> operator++();
+  MapIterator<K, V, Compare> operator++(int);
+  MapIterator<K, V, Compare> operator--();
+  MapIterator<K, V, Compare> operator--(int);
+  bool operator==(const MapIterator<K, V, Compare> &rhs);
+  bool operator!=(const MapIterator<K, V, Compare> &rhs);
+
+protected:
+  size_t GetIndex();
+  OuterNode<K, V> *GetNode();
+  K &Key();
+  V &Value();
+  OuterNode<K, V> *node_;
+  size_t index_;
+  size_t slot_;
+  void Increment();
+  void Decrement();
+};
+
+// slot_ caches the position of node_ among the children of its parent for the
+// prefetches of Increment, so that entering a leaf does not search the child
+// array for it. It is only a guess and checked before use.
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare>::MapIterator()
+    : node_(nullptr), index_(std::string::npos), slot_(std::string::npos) {}
+
+template <class K, class V, class Compare>
+MapIterator<K, V, Compare>::~MapIterator() {}
+
+template <class K, class V, class Compare>
+inline K &MapIterator<K, V, Compare>::Key() {
+  return node_->Key(index_);
+}
+
+template <class K, class V, class Compare>
+inline const K &MapIterator<K, V, Compare>::GetKey() const {
+  return node_->GetKey(index_);
+}
+
+template <class K, class V, class Compare>
+inline V &MapIterator<K, V, Compare>::Value() {
+  return node_->Value(index_);
+}
+
+template <class K, class V, class Compare>
+inline const V &MapIterator<K, V, Compare>::GetValue() const {
+  return node_->GetValue(index_);
+}
+
+template <class K, class V, class Compare>
+inline size_t MapIterator<K, V, Compare>::GetIndex() {
+  return index_;
+}
+
+template <class K, class V, class Compare>
+inline OuterNode<K, V> *MapIterator<K, V, Compare>::GetNode() {
+  return node_;
+}
+
+template <class K, class V, class Compare>
+inline MapIterator<K, V, Compare> MapIterator<K, V, Compare>::operator++() {
+  Increment();
+  return *this;
+}
+
+template <class K, class V, class Compare>
+inline MapIterator<K, V, Compare> MapIterator<K, V, Compare>::operator++(int) {
+  MapIterator<K, V, Compare> temp = *this;
+  Increment();
+  return temp;
+}
+
+template <class K, class V, class Compare>
+inline MapIterator<K, V, Compare> MapIterator<K, V, Compare>::operator--() {
+  Decrement();
+  return *this;
+}
+
+template <class K, class V, class Compare>
+inline MapIterator<K, V, Compare> MapIterator<K, V, Compare>::operator--(int) {
+  MapIterator<K, V, Compare> temp = *this;
+  Decrement();
+  return temp;
+}
+
+template <class K, class V, class Compare>
+inline bool
+MapIterator<K, V, Compare>::operator==(const MapIterator<K, V, Compare> &rhs) {
+  return node_ == rhs.node_ && index_ == rhs.index_;
+}
+
+template <class K, class V, class Compare>
+inline bool
+MapIterator<K, V, Compare>::operator!=(const MapIterator<K, V, Compare> &rhs) {
+  return !(*this == rhs);
+}
+
+template <class K, class V, class Compare>
+void MapIterator<K, V, Compare>::Increment() {
+  if (index_ == node_->CountKeys() - 1) {
+    OuterNode<K, V> *next = node_->next_;
+    if (next != nullptr) {
+      // The next leaf follows in the same parent or starts the next one.
+      slot_ = next->parent_ == node_->parent_ ? slot_ + 1 : 0;
+      node_ = next;
+      index_ = 0;
+      if (MAP_PREFETCH_DISTANCE > 0) {
+        slot_ = node_->PrefetchAhead(MAP_PREFETCH_DISTANCE, slot_);
+      }
+    } else {
+      node_ = nullptr;
+      index_ = std::string::npos;
+    }
+  } else {
+    index_++;
+  }
+}
+
+template <class K, class V, class Compare>
+void MapIterator<K, V, Compare>::Decrement() {
+  if (index_ == 0) {
+    OuterNode<K, V> *previous = node_->previous_;
+    if (previous != nullptr) {
+      slot_ = previous->parent_ == node_->parent_ ? slot_ - 1
+                                                  : std::string::npos;
+      node_ = previous;
+      index_ = node_->CountKeys() - 1;
+    } else {
+      node_ = nullptr;
+      index_ = std::string::npos;
+    }
+  } else {
+    index_--;
+  }
+}
+
+template <class K, class V> class Multimap {
+  template <class, class> friend class ::InnerNode;
+  template <class, class> friend class ::OuterNode;
+  template <class, class, class> friend class ::Map;
+  template <class, class, class> friend class ::MapIterator;
   template <class, class> friend class ::MultimapIterator;
 
 public:
-  MapIterator();
-  ~MapIterator();
+  Multimap();
+  Multimap(std::pmr::memory_resource *resource);
+  ~Multimap();
+  MultimapIterator<K, V> Put(const K &key, const V &value);
+  MultimapIterator<K, V> Put(const K &key, V &&value);
+  void Put(MultimapIterator<K, V> &iter, const V &value);
+  const std::pmr::vector<V> &Get(const K &key) const;
+  void Clear();
+  bool Erase(const K &key);
+  bool Erase(const K &key, const V &value);
+  bool Erase(MultimapIterator<K, V> iter);
+  bool Contains(const K &key);
+  MultimapIterator<K, V> Find(const K &key);
+  MultimapIterator<K, V> Begin();
+  const MultimapIterator<K, V> Begin() const;
+  MultimapIterator<K, V> End();
+  const MultimapIterator<K, V> End() const;
+  void Save(const std::string &filepath);
+  void Load(const std::string &filepath);
+  void SetPolicy(const MapPolicy &policy);
+  MapLatencies Latencies() const;
+  void ResetLatencies();
+  MapMemoryUsage MemoryUsage() const;
+
+protected:
+  Map<K, std::pmr::vector<V>> tree_;
+  MultimapIterator<K, V> BeginIterator();
+};
+
+template <class K, class V> Multimap<K, V>::Multimap() {}
+
+// The tree and the value vectors of all keys are allocated from resource.
+template <class K, class V>
+Multimap<K, V>::Multimap(std::pmr::memory_resource *resource)
+    : tree_(resource) {}
+
+template <class K, class V> Multimap<K, V>::~Multimap() {}
+
+template <class K, class V>
+MultimapIterator<K, V> Multimap<K, V>::Put(const K &key, const V &value) {
+  return Put(key, V(value));
+}
+
+template <class K, class V>
+MultimapIterator<K, V> Multimap<K, V>::Put(const K &key, V &&value) {
+  MapIterator<K, std::pmr::vector<V>> iter;
+  bool inserted;
+  std::tie(iter, inserted) = tree_.TryEmplace(key);
+  tree_.Update(iter.GetNode(), iter.GetIndex(),
+               [&value](std::pmr::vector<V> &multi_value) {
+    multi_value.push_back(std::move(value));
+  });
+  MultimapIterator<K, V> multi_iter;
+  multi_iter.node_ = iter.GetNode();
+  multi_iter.index_ = iter.GetIndex();
+  multi_iter.multi_index_ = iter.GetValue().size() - 1;
+  return multi_iter;
+}
+
+template <class K, class V>
+void Multimap<K, V>::Put(MultimapIterator<K, V> &iter, const V &value) {
+  MapIterator<K, std::pmr::vector<V>> single_iter;
+  single_iter.node_ = iter.node_;
+  single_iter.index_ = iter.index_;
+  tree_.Update(single_iter.GetNode(), single_iter.GetIndex(),
+               [&](std::pmr::vector<V> &multi_value) {
+    multi_value[iter.multi_index_] = value;
+  });
+}
+
+template <class K, class V>
+inline const std::pmr::vector<V> &Multimap<K, V>::Get(const K &key) const {
+  return tree_.Get(key);
+}
+
+template <class K, class V> inline void Multimap<K, V>::Clear() {
+  tree_.Clear();
+}
+
+template <class K, class V> inline bool Multimap<K, V>::Erase(const K &key) {
+  return tree_.Erase(key);
+}
+
+template <class K, class V>
+bool Multimap<K, V>::Erase(const K &key, const V &value) {
+  MapIterator<K, std::pmr::vector<V>> iter = tree_.Find(key);
+  if (iter != tree_.End()) {
+    std::pmr::vector<V> &multi_value = iter.Value();
+    if (multi_value.size() == 1) {
+      tree_.Erase(key);
+      return true;
+    }
+    for (size_t i = 0; i < multi_value.size(); i++) {
+      if (multi_value.at(i) == value) {
+        tree_.Update(iter.GetNode(), iter.GetIndex(),
+                     [i](std::pmr::vector<V> &target) {
+          target.erase(target.begin() + i);
+        });
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+template <class K, class V>
+inline bool Multimap<K, V>::Erase(MultimapIterator<K, V> iter) {
+  return Erase(iter.GetKey(), iter.GetValue());
+}
+
+template <class K, class V> inline bool Multimap<K, V>::Contains(const K &key) {
+  return tree_.Contains(key);
+}
+
+template <class K, class V>
+MultimapIterator<K, V> Multimap<K, V>::Find(const K &key) {
+  MapIterator<K, std::pmr::vector<V>> iter = tree_.Find(key);
+  MultimapIterator<K, V> multi_iter;
+  if (iter != tree_.End()) {
+    multi_iter.index_ = iter.GetIndex();
+    multi_iter.multi_index_ = 0;
+    multi_iter.node_ = iter.GetNode();
+  }
+  return multi_iter;
+}
+
+template <class K, class V>
+MultimapIterator<K, V> Multimap<K, V>::BeginIterator() {
+  MultimapIterator<K, V> iter;
+  iter.node_ = tree_.Begin().GetNode();
+  if (iter.node_ == nullptr) {
+    iter.index_ = std::string::npos;
+    iter.multi_index_ = std::string::npos;
+  } else {
+    iter.index_ = 0;
+    iter.multi_index_ = 0;
+  }
+  return iter;
+}
+
+template <class K, class V>
+inline MultimapIterator<K, V> Multimap<K, V>::Begin() {
+  return BeginIterator();
+}
+
+template <class K, class V>
+const MultimapIterator<K, V> inline Multimap<K, V>::Begin() const {
+  return BeginIterator();
+}
+
+template <class K, class V>
+inline MultimapIterator<K, V> Multimap<K, V>::End() {
+  return MultimapIterator<K, V>();
+}
+
+template <class K, class V>
+const MultimapIterator<K, V> inline Multimap<K, V>::End() const {
+  return MultimapIterator<K, V>();
+}
+
+template <class K, class V>
+inline void Multimap<K, V>::Save(const std::string &filepath) {
+  tree_.Save(filepath);
+}
+
+template <class K, class V>
+inline void Multimap<K, V>::Load(const std::string &filepath) {
+  tree_.Load(filepath);
+}
+
+template <class K, class V>
+inline void Multimap<K, V>::SetPolicy(const MapPolicy &policy) {
+  tree_.SetPolicy(policy);
+}
+
+template <class K, class V>
+inline MapLatencies Multimap<K, V>::Latencies() const {
+  return tree_.Latencies();
+}
+
+template <class K, class V> inline void Multimap<K, V>::ResetLatencies() {
+  tree_.ResetLatencies();
+}
+
+template <class K, class V>
+inline MapMemoryUsage Multimap<K, V>::MemoryUsage() const {
+  return tree_.MemoryUsage();
+}
+
+template <class K, class V> class MultimapIterator {
+  template <class, class> friend class ::InnerNode;
+  template <class, class> friend class ::OuterNode;
+  template <class, class, class> friend class ::Map;
+  template <class, class, class> friend class ::MapIterator;
+  template <class, class> friend class ::Multimap;
+
+public:
+  MultimapIterator();
+  ~MultimapIterator();
   const K &GetKey() const;
   const V &GetValue() const;
-  MapIterator<K, V> operator++();
-  MapIterator<K, V> operator++(int);
-  MapIterator<K, V> operator--();
-  MapIterator<K, V> operator--(int);
-  bool operator==(const MapIterator<K, V> &rhs);
-  bool operator!=(const MapIterator<K, V> &rhs);
+  const std::pmr::vector<V> &GetMultiValue() const;
+  MultimapIterator<K, V> operator++();
+  MultimapIterator<K, V> operator++(int);
+  MultimapIterator<K, V> operator--();
+  MultimapIterator<K, V> operator--(int);
+  bool operator==(const MultimapIterator<K, V> &rhs);
+  bool operator!=(const MultimapIterator<K, V> &rhs);
 
 protected:
-  size_t GetIndex();
-  OuterNode<K, V> *GetNode();
   K &Key();
   V &Value();
-  OuterNode<K, V> *node_;
+  std::pmr::vector<V> &MultiValue();
+  OuterNode<K, std::pmr::vector<V>> *node_;
   size_t index_;
+  size_t multi_index_;
   void Increment();
   void Decrement();
 };
 
 template <class K, class V>
-MapIterator<K, V>::MapIterator() : node_(nullptr), index_(std::string::npos) {}
+MultimapIterator<K, V>::MultimapIterator()
+    : node_(nullptr), index_(std::string::npos),
+      multi_index_(std::string::npos) {}
 
-template <class K, class V> MapIterator<K, V>::~MapIterator() {}
+template <class K, class V> MultimapIterator<K, V>::~MultimapIterator() {}
 
-template <class K, class V> inline K &MapIterator<K, V>::Key() {
-  return node_->Key(index_);
+template <class K, class V> inline K &MultimapIterator<K, V>::Key() {
+  return node_->GetKey(index_);
 }
 
-template <class K, class V> inline const K &MapIterator<K, V>::GetKey() const {
+template <class K, class V>
+inline const K &MultimapIterator<K, V>::GetKey() const {
   return node_->GetKey(index_);
 }
 
-template <class K, class V> inline V &MapIterator<K, V>::Value() {
-  return node_->Value(index_);
+template <class K, class V> inline V &MultimapIterator<K, V>::Value() {
+  return node_->GetValue(index_)[multi_index_];
 }
 
 template <class K, class V>
-inline const V &MapIterator<K, V>::GetValue() const {
-  return node_->GetValue(index_);
+inline const V &MultimapIterator<K, V>::GetValue() const {
+  return node_->GetValue(index_)[multi_index_];
 }
 
-template <class K, class V> inline size_t MapIterator<K, V>::GetIndex() {
-  return index_;
+template <class K, class V>
+inline std::pmr::vector<V> &MultimapIterator<K, V>::MultiValue() {
+  return node_->GetValue(index_);
 }
 
 template <class K, class V>
-inline OuterNode<K, V> *MapIterator<K, V>::GetNode() {
-  return node_;
+inline const std::pmr::vector<V> &
+MultimapIterator<K, V>::GetMultiValue() const {
+  return node_->GetValue(index_);
 }
 
 template <class K, class V>
-inline MapIterator<K, V> MapIterator<K, V>::operator++() {
+inline MultimapIterator<K, V> MultimapIterator<K, V>::operator++() {
   Increment();
   return *this;
 }
 
 template <class K, class V>
-inline MapIterator<K, V> MapIterator<K, V>::operator++(int) {
-  MapIterator<K, V> temp = *this;
+inline MultimapIterator<K, V> MultimapIterator<K, V>::operator++(int) {
+  MultimapIterator<K, V> temp = *this;
   Increment();
   return temp;
 }
 
 template <class K, class V>
-inline MapIterator<K, V> MapIterator<K, V>::operator--() {
+inline MultimapIterator<K, V> MultimapIterator<K, V>::operator--() {
   Decrement();
   return *this;
 }
 
 template <class K, class V>
-inline MapIterator<K, V> MapIterator<K, V>::operator--(int) {
-  MapIterator<K, V> temp = *this;
+inline MultimapIterator<K, V> MultimapIterator<K, V>::operator--(int) {
+  MultimapIterator<K, V> temp = *this;
   Decrement();
   return temp;
 }
 
 template <class K, class V>
-inline bool MapIterator<K, V>::operator==(const MapIterator<K, V> &rhs) {
-  return node_ == rhs.node_ && index_ == rhs.index_;
+inline bool MultimapIterator<K, V>::
+operator==(const MultimapIterator<K, V> &rhs) {
+  return node_ == rhs.node_ && index_ == rhs.index_ &&
+         multi_index_ == rhs.multi_index_;
 }
 
 template <class K, class V>
-inline bool MapIterator<K, V>::operator!=(const MapIterator<K, V> &rhs) {
+inline bool MultimapIterator<K, V>::
+operator!=(const MultimapIterator<K, V> &rhs) {
   return !(*this == rhs);
 }
 
-template <class K, class V> void MapIterator<K, V>::Increment() {
+template <class K, class V> void MultimapIterator<K, V>::Increment() {
   if (index_ == node_->CountKeys() - 1) {
-    if (node_->GetNext() != nullptr) {
-      node_ = node_->GetNext();
-      index_ = 0;
+    if (multi_index_ == node_->GetValue(index_).size() - 1) {
+      if (node_->GetNext() != nullptr) {
+        node_ = node_->GetNext();
+        index_ = 0;
+        multi_index_ = 0;
+      } else {
+        node_ = nullptr;
+        index_ = std::string::npos;
+        multi_index_ = std::string::npos;
+      }
     } else {
-      node_ = nullptr;
-      index_ = std::string::npos;
+      multi_index_++;
     }
   } else {
-    index_++;
+    if (multi_index_ == node_->GetValue(index_).size() - 1) {
+      index_++;
+      multi_index_ = 0;
+    } else {
+      multi_index_++;
+    }
   }
 }
 
-template <class K, class V> void MapIterator<K, V>::Decrement() {
+template <class K, class V> void MultimapIterator<K, V>::Decrement() {
   if (index_ == 0) {
-    if (node_->GetPrevious() != nullptr) {
-      node_ = node_->GetPrevious();
-      index_ = node_->CountKeys() - 1;
+    if (multi_index_ == 0) {
+      if (node_->previous_ != nullptr) {
+        node_ = node_->GetPrevious();
+        index_ = node_->CountKeys() - 1;
+        multi_index_ = node_->GetValue(index_).size() - 1;
+      } else {
+        node_ = nullptr;
+        index_ = std::string::npos;
+        multi_index_ = std::string::npos;
+      }
     } else {
-      node_ = nullptr;
-      index_ = std::string::npos;
+      multi_index_--;
     }
   } else {
-    index_--;
+    if (multi_index_ == 0) {
+      index_--;
+      multi_index_ = node_->GetValue(index_).size() - 1;
+    } else {
+      multi_index_--;
+    }
+  }
+}
+
+// Append-only arena of values addressed by handles. The values live in
+// blocks of fixed size that are never reallocated, so appending never moves
+// the stored values and references to them stay valid until the owner
+// rewrites the log. Releasing a value destroys its contents right away but
+// keeps the slot as garbage until the owner rewrites the live values into a
+// fresh log.
+template <class V> class ValueLog {
+public:
+  ValueLog();
+  void Clear();
+  void Reserve(size_t size);
+  void Swap(ValueLog<V> &log);
+  size_t Size() const;
+  size_t Garbage() const;
+  size_t Heap() const;
+  size_t Capacity() const;
+  uint64_t Append(const V &value);
+  uint64_t Append(V &&value);
+  V &Get(uint64_t handle);
+  void Assign(uint64_t handle, V &&value);
+  void Release(uint64_t handle);
+
+protected:
+  static constexpr size_t kBlockBits = 10;
+  static constexpr size_t kBlockSize = 1 << kBlockBits;
+  std::vector<std::unique_ptr<V[]>> blocks_;
+  size_t size_;
+  size_t garbage_;
+  size_t heap_;
+};
+
+template <class V>
+ValueLog<V>::ValueLog() : size_(0), garbage_(0), heap_(0) {}
+
+template <class V> void ValueLog<V>::Clear() {
+  std::vector<std::unique_ptr<V[]>>().swap(blocks_);
+  size_ = 0;
+  garbage_ = 0;
+  heap_ = 0;
+}
+
+template <class V> void ValueLog<V>::Reserve(size_t size) {
+  while (Capacity() < size) {
+    blocks_.emplace_back(new V[kBlockSize]);
+  }
+}
+
+template <class V> void ValueLog<V>::Swap(ValueLog<V> &log) {
+  blocks_.swap(log.blocks_);
+  std::swap(size_, log.size_);
+  std::swap(garbage_, log.garbage_);
+  std::swap(heap_, log.heap_);
+}
+
+template <class V> inline size_t ValueLog<V>::Size() const { return size_; }
+
+template <class V> inline size_t ValueLog<V>::Garbage() const {
+  return garbage_;
+}
+
+template <class V> inline size_t ValueLog<V>::Heap() const { return heap_; }
+
+template <class V> inline size_t ValueLog<V>::Capacity() const {
+  return blocks_.size() * kBlockSize;
+}
+
+template <class V> uint64_t ValueLog<V>::Append(const V &value) {
+  return Append(V(value));
+}
+
+template <class V> uint64_t ValueLog<V>::Append(V &&value) {
+  Reserve(size_ + 1);
+  V &target = Get(size_);
+  target = std::move(value);
+  heap_ += HeapSize<V>().Measure(target);
+  return size_++;
+}
+
+template <class V> inline V &ValueLog<V>::Get(uint64_t handle) {
+  return blocks_[handle >> kBlockBits][handle & (kBlockSize - 1)];
+}
+
+// Replaces a live value in its slot.
+template <class V> void ValueLog<V>::Assign(uint64_t handle, V &&value) {
+  V &target = Get(handle);
+  heap_ -= HeapSize<V>().Measure(target);
+  target = std::move(value);
+  heap_ += HeapSize<V>().Measure(target);
+}
+
+template <class V> void ValueLog<V>::Release(uint64_t handle) {
+  heap_ -= HeapSize<V>().Measure(Get(handle));
+  Get(handle) = V();
+  garbage_++;
+}
+
+// Map that keeps its values out of the leaves. The tree holds an 8-byte
+// handle per key into a ValueLog, so splits, redistributions and coalesces
+// move handles instead of values, and walking the keys never pulls value
+// bytes into the cache. Overwrites replace the value in its slot; erased
+// values become garbage in the log. Once the garbage exceeds garbage_ratio
+// times the live values, Collect rewrites the live values in key order and
+// updates the handles in place.
+template <class K, class V> class ValueLogMap {
+  template <class, class> friend class ::ValueLogMapIterator;
+
+public:
+  ValueLogMap();
+  ValueLogMap(const MapPolicy &policy);
+  ~ValueLogMap();
+  void Clear();
+  size_t Size() const;
+  std::tuple<ValueLogMapIterator<K, V>, bool> Put(const K &key,
+                                                  const V &value);
+  std::tuple<ValueLogMapIterator<K, V>, bool> Put(const K &key, V &&value);
+  const V &Get(const K &key);
+  bool Erase(const K &key);
+  bool Contains(const K &key);
+  ValueLogMapIterator<K, V> Find(const K &key);
+  ValueLogMapIterator<K, V> Begin();
+  ValueLogMapIterator<K, V> End();
+  void Save(const std::string &filepath);
+  void Load(const std::string &filepath);
+  void Collect();
+  size_t Garbage() const;
+  void SetGarbageRatio(double garbage_ratio);
+  void SetPolicy(const MapPolicy &policy);
+  MapLatencies Latencies() const;
+  void ResetLatencies();
+  MapMemoryUsage MemoryUsage() const;
+
+protected:
+  Map<K, uint64_t> tree_;
+  ValueLog<V> log_;
+  double garbage_ratio_;
+  ValueLogMapIterator<K, V> Wrap(MapIterator<K, uint64_t> iter);
+  void CollectIfNeeded();
+};
+
+template <class K, class V>
+ValueLogMap<K, V>::ValueLogMap() : garbage_ratio_(1.0) {}
+
+template <class K, class V>
+ValueLogMap<K, V>::ValueLogMap(const MapPolicy &policy)
+    : tree_(policy), garbage_ratio_(1.0) {}
+
+template <class K, class V> ValueLogMap<K, V>::~ValueLogMap() {}
+
+template <class K, class V> void ValueLogMap<K, V>::Clear() {
+  tree_.Clear();
+  log_.Clear();
+}
+
+template <class K, class V> inline size_t ValueLogMap<K, V>::Size() const {
+  return tree_.Size();
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V>
+ValueLogMap<K, V>::Wrap(MapIterator<K, uint64_t> iter) {
+  ValueLogMapIterator<K, V> log_iter;
+  log_iter.iter_ = iter;
+  log_iter.log_ = &log_;
+  return log_iter;
+}
+
+template <class K, class V>
+std::tuple<ValueLogMapIterator<K, V>, bool>
+ValueLogMap<K, V>::Put(const K &key, const V &value) {
+  return Put(key, V(value));
+}
+
+// A new key takes the handle that the value is appended under next; an
+// existing key keeps its handle and the value is replaced in its slot.
+template <class K, class V>
+std::tuple<ValueLogMapIterator<K, V>, bool>
+ValueLogMap<K, V>::Put(const K &key, V &&value) {
+  log_.Reserve(log_.Size() + 1);
+  MapIterator<K, uint64_t> iter;
+  bool inserted;
+  std::tie(iter, inserted) = tree_.TryEmplace(key, log_.Size());
+  if (inserted) {
+    log_.Append(std::move(value));
+  } else {
+    log_.Assign(iter.GetValue(), std::move(value));
+  }
+  return std::make_tuple(Wrap(iter), inserted);
+}
+
+template <class K, class V> const V &ValueLogMap<K, V>::Get(const K &key) {
+  return log_.Get(tree_.Get(key));
+}
+
+template <class K, class V> bool ValueLogMap<K, V>::Erase(const K &key) {
+  MapIterator<K, uint64_t> iter = tree_.Find(key);
+  if (iter == tree_.End()) {
+    return false;
+  }
+  log_.Release(iter.GetValue());
+  tree_.Erase(iter);
+  CollectIfNeeded();
+  return true;
+}
+
+template <class K, class V>
+inline bool ValueLogMap<K, V>::Contains(const K &key) {
+  return tree_.Contains(key);
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMap<K, V>::Find(const K &key) {
+  return Wrap(tree_.Find(key));
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMap<K, V>::Begin() {
+  return Wrap(tree_.Begin());
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMap<K, V>::End() {
+  return Wrap(tree_.End());
+}
+
+// Writes the same format as Map<K, V>::Save, so files are interchangeable.
+template <class K, class V>
+void ValueLogMap<K, V>::Save(const std::string &filepath) {
+  if (tree_.Size() == 0) {
+    return;
+  }
+  std::fstream file;
+  file.open(filepath,
+            std::fstream::trunc | std::fstream::out | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  for (MapIterator<K, uint64_t> iter = tree_.Begin(); iter != tree_.End();
+       ++iter) {
+    SerializerInstance<K>().Serialize(iter.GetKey(), file);
+    SerializerInstance<V>().Serialize(log_.Get(iter.GetValue()), file);
+  }
+  file.close();
+}
+
+// Replaces the contents with the elements of a file written by Save and
+// builds the tree bottom-up like Map<K, V>::Load.
+template <class K, class V>
+void ValueLogMap<K, V>::Load(const std::string &filepath) {
+  Clear();
+  struct stat info;
+  if (stat(filepath.c_str(), &info) != 0 ||
+      (info.st_mode & S_IFREG) != S_IFREG) {
+    return;
   }
+  const size_t filesize = info.st_size;
+  std::fstream file;
+  file.open(filepath, std::fstream::in | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  V value;
+  size_t bytes = 0;
+  tree_.Assemble([&](K &key, uint64_t &handle) {
+    if (bytes >= filesize) {
+      return false;
+    }
+    bytes += SerializerInstance<K>().Deserialize(key, file);
+    bytes += SerializerInstance<V>().Deserialize(value, file);
+    handle = log_.Append(std::move(value));
+    return true;
+  });
+  file.close();
+}
+
+template <class K, class V> void ValueLogMap<K, V>::Collect() {
+  ValueLog<V> log;
+  log.Reserve(tree_.Size());
+  for (MapIterator<K, uint64_t> iter = tree_.Begin(); iter != tree_.End();
+       ++iter) {
+    tree_.Put(iter, log.Append(std::move(log_.Get(iter.GetValue()))));
+  }
+  log_.Swap(log);
+}
+
+template <class K, class V>
+inline void ValueLogMap<K, V>::CollectIfNeeded() {
+  if (garbage_ratio_ > 0.0 && log_.Garbage() >= 64 &&
+      log_.Garbage() > garbage_ratio_ * tree_.Size()) {
+    Collect();
+  }
+}
+
+template <class K, class V>
+inline size_t ValueLogMap<K, V>::Garbage() const {
+  return log_.Garbage();
+}
+
+// A ratio of zero disables automatic collection.
+template <class K, class V>
+inline void ValueLogMap<K, V>::SetGarbageRatio(double garbage_ratio) {
+  garbage_ratio_ = garbage_ratio;
+}
+
+template <class K, class V>
+inline void ValueLogMap<K, V>::SetPolicy(const MapPolicy &policy) {
+  tree_.SetPolicy(policy);
+}
+
+template <class K, class V>
+inline MapLatencies ValueLogMap<K, V>::Latencies() const {
+  return tree_.Latencies();
+}
+
+template <class K, class V> inline void ValueLogMap<K, V>::ResetLatencies() {
+  tree_.ResetLatencies();
+}
+
+// Handles are reported as value arrays of the tree; the log adds its values,
+// its unused capacity and garbage slots as slack and the value heap.
+template <class K, class V>
+MapMemoryUsage ValueLogMap<K, V>::MemoryUsage() const {
+  MapMemoryUsage usage = tree_.MemoryUsage();
+  const size_t live = log_.Size() - log_.Garbage();
+  usage.value_arrays += live * sizeof(V);
+  usage.slack += (log_.Capacity() - live) * sizeof(V);
+  usage.value_heap += log_.Heap();
+  usage.total += log_.Capacity() * sizeof(V) + log_.Heap();
+  return usage;
+}
+
+template <class K, class V> class ValueLogMapIterator {
+  template <class, class> friend class ::ValueLogMap;
+
+public:
+  ValueLogMapIterator();
+  ~ValueLogMapIterator();
+  const K &GetKey() const;
+  const V &GetValue() const;
+  ValueLogMapIterator<K, V> operator++();
+  ValueLogMapIterator<K, V> operator++(int);
+  ValueLogMapIterator<K, V> operator--();
+  ValueLogMapIterator<K, V> operator--(int);
+  bool operator==(const ValueLogMapIterator<K, V> &rhs);
+  bool operator!=(const ValueLogMapIterator<K, V> &rhs);
+
+protected:
+  MapIterator<K, uint64_t> iter_;
+  ValueLog<V> *log_;
+};
+
+template <class K, class V>
+ValueLogMapIterator<K, V>::ValueLogMapIterator() : log_(nullptr) {}
+
+template <class K, class V> ValueLogMapIterator<K, V>::~ValueLogMapIterator() {}
+
+template <class K, class V>
+inline const K &ValueLogMapIterator<K, V>::GetKey() const {
+  return iter_.GetKey();
+}
+
+template <class K, class V>
+inline const V &ValueLogMapIterator<K, V>::GetValue() const {
+  return log_->Get(iter_.GetValue());
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMapIterator<K, V>::operator++() {
+  ++iter_;
+  return *this;
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMapIterator<K, V>::operator++(int) {
+  ValueLogMapIterator<K, V> temp = *this;
+  ++iter_;
+  return temp;
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMapIterator<K, V>::operator--() {
+  --iter_;
+  return *this;
+}
+
+template <class K, class V>
+inline ValueLogMapIterator<K, V> ValueLogMapIterator<K, V>::operator--(int) {
+  ValueLogMapIterator<K, V> temp = *this;
+  --iter_;
+  return temp;
 }
 
-template <class K, class V> class Multimap {
-  template <class, class> friend class ::InnerNode;
-  template <class, class> friend class ::OuterNode;
-  template <class, class> friend class ::Map;
-  template <class, class> friend class ::MapIterator;
-  template <class, class> friend class ::MultimapIterator;
+template <class K, class V>
+inline bool
+ValueLogMapIterator<K, V>::operator==(const ValueLogMapIterator<K, V> &rhs) {
+  return iter_ == rhs.iter_;
+}
+
+template <class K, class V>
+inline bool
+ValueLogMapIterator<K, V>::operator!=(const ValueLogMapIterator<K, V> &rhs) {
+  return !(*this == rhs);
+}
+
+// Read-only map whose keys and values sit in two parallel arrays in
+// Eytzinger order: the children of slot k are the slots 2k and 2k + 1 and
+// slot 0 is unused. Lookups descend without branches or pointers, and the
+// layout keeps the top levels of the implicit tree in a few cache lines.
+template <class K, class V, class Compare> class FrozenMap {
+  template <class, class, class> friend class ::FrozenMapIterator;
 
 public:
-  Multimap();
-  ~Multimap();
-  void Put(const K &key, const V &value);
-  void Put(MultimapIterator<K, V> &iter, const V &value);
-  const std::vector<V> &Get(const K &key) const;
+  FrozenMap();
+  FrozenMap(Map<K, V, Compare> &tree);
+  ~FrozenMap();
   void Clear();
-  bool Erase(const K &key);
-  bool Erase(const K &key, const V &value);
-  bool Erase(MultimapIterator<K, V> iter);
-  bool Contains(const K &key);
-  MultimapIterator<K, V> Find(const K &key);
-  MultimapIterator<K, V> Begin();
-  const MultimapIterator<K, V> Begin() const;
-  MultimapIterator<K, V> End();
-  const MultimapIterator<K, V> End() const;
-  void Save(const std::string &filepath);
+  size_t Size() const;
+  const V &Get(const K &key) const;
+  bool Contains(const K &key) const;
+  FrozenMapIterator<K, V, Compare> Find(const K &key) const;
+  FrozenMapIterator<K, V, Compare> LowerBound(const K &key) const;
+  FrozenMapIterator<K, V, Compare> Begin() const;
+  FrozenMapIterator<K, V, Compare> End() const;
+  void Save(const std::string &filepath) const;
   void Load(const std::string &filepath);
+  size_t MemoryUsage() const;
 
 protected:
-  Map<K, std::vector<V>> tree_;
-  MultimapIterator<K, V> BeginIterator();
+  std::vector<K> keys_;
+  std::vector<V> values_;
+  size_t size_;
+  Compare compare_;
+  void Allocate(size_t size);
+  size_t LowerBoundIndex(const K &key) const;
+  size_t FirstIndex() const;
+  size_t LastIndex() const;
+  size_t NextIndex(size_t index) const;
+  size_t PreviousIndex(size_t index) const;
 };
 
-template <class K, class V> Multimap<K, V>::Multimap() {}
+// Slot 0 of both arrays is a sentinel that End() points to, so an empty map
+// keeps it as well.
+template <class K, class V, class Compare>
+FrozenMap<K, V, Compare>::FrozenMap() : keys_(1), values_(1), size_(0) {}
+
+template <class K, class V, class Compare>
+FrozenMap<K, V, Compare>::FrozenMap(Map<K, V, Compare> &tree)
+    : size_(0), compare_(tree.compare_) {
+  Allocate(tree.Size());
+  OuterNode<K, V> *cursor = tree.FirstLeaf();
+  size_t index = FirstIndex();
+  while (cursor != nullptr) {
+    for (size_t i = 0; i < cursor->keys_.size(); i++) {
+      keys_[index] = cursor->keys_[i];
+      values_[index] = cursor->values_[i];
+      index = NextIndex(index);
+    }
+    cursor = cursor->next_;
+  }
+}
 
-template <class K, class V> Multimap<K, V>::~Multimap() {}
+template <class K, class V, class Compare>
+FrozenMap<K, V, Compare>::~FrozenMap() {}
 
-template <class K, class V>
-void Multimap<K, V>::Put(const K &key, const V &value) {
-  MapIterator<K, std::vector<V>> iter = tree_.Find(key);
-  if (iter != tree_.End()) {
-    std::vector<V> &multi_value = iter.Value();
-    multi_value.push_back(value);
-    return;
-  }
-  tree_.Put(key, std::vector<V>{value});
-  return;
+template <class K, class V, class Compare>
+void FrozenMap<K, V, Compare>::Clear() {
+  std::vector<K>(1).swap(keys_);
+  std::vector<V>(1).swap(values_);
+  size_ = 0;
 }
 
-template <class K, class V>
-void Multimap<K, V>::Put(MultimapIterator<K, V> &iter, const V &value) {
-  MapIterator<K, std::vector<V>> single_iter;
-  single_iter.node_ = iter.node_;
-  single_iter.index_ = iter.index_;
-  std::vector<V> &multi_value = single_iter.Value();
-  multi_value[iter.multi_index_] = value;
+template <class K, class V, class Compare>
+void FrozenMap<K, V, Compare>::Allocate(size_t size) {
+  size_ = size;
+  keys_.clear();
+  values_.clear();
+  keys_.resize(size + 1);
+  values_.resize(size + 1);
+  keys_.shrink_to_fit();
+  values_.shrink_to_fit();
 }
 
-template <class K, class V>
-inline const std::vector<V> &Multimap<K, V>::Get(const K &key) const {
-  return tree_.Get(key);
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::Size() const {
+  return size_;
 }
 
-template <class K, class V> inline void Multimap<K, V>::Clear() {
-  tree_.Clear();
+// Descends to the leaves of the implicit tree and recovers the last node at
+// which the search went left, which holds the first key not less than key.
+// Returns 0 if all keys are less than key.
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::LowerBoundIndex(const K &key) const {
+  const K *keys = keys_.data();
+  size_t index = 1;
+  while (index <= size_) {
+    __builtin_prefetch(keys + std::min(16 * index, size_));
+    index = 2 * index + compare_.Less(keys[index], key);
+  }
+  return index >> __builtin_ffsll(~index);
 }
 
-template <class K, class V> inline bool Multimap<K, V>::Erase(const K &key) {
-  return tree_.Erase(key);
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::FirstIndex() const {
+  size_t index = size_ == 0 ? 0 : 1;
+  while (2 * index <= size_ && index != 0) {
+    index = 2 * index;
+  }
+  return index;
 }
 
-template <class K, class V>
-bool Multimap<K, V>::Erase(const K &key, const V &value) {
-  MapIterator<K, std::vector<V>> iter = tree_.Find(key);
-  if (iter != tree_.End()) {
-    std::vector<V> &multi_value = iter.Value();
-    if (multi_value.size() == 1) {
-      tree_.Erase(key);
-      return true;
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::LastIndex() const {
+  size_t index = size_ == 0 ? 0 : 1;
+  while (2 * index + 1 <= size_ && index != 0) {
+    index = 2 * index + 1;
+  }
+  return index;
+}
+
+// In-order successor within the implicit tree, 0 after the last slot.
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::NextIndex(size_t index) const {
+  if (2 * index + 1 <= size_) {
+    index = 2 * index + 1;
+    while (2 * index <= size_) {
+      index = 2 * index;
     }
-    for (size_t i = 0; i < multi_value.size(); i++) {
-      if (multi_value.at(i) == value) {
-        multi_value.erase(multi_value.begin() + i);
-        return true;
-      }
+    return index;
+  }
+  while (index & 1) {
+    index >>= 1;
+  }
+  return index >> 1;
+}
+
+// In-order predecessor within the implicit tree, 0 before the first slot.
+template <class K, class V, class Compare>
+inline size_t FrozenMap<K, V, Compare>::PreviousIndex(size_t index) const {
+  if (2 * index <= size_) {
+    index = 2 * index;
+    while (2 * index + 1 <= size_) {
+      index = 2 * index + 1;
     }
+    return index;
   }
-  return false;
+  while (index != 0 && !(index & 1)) {
+    index >>= 1;
+  }
+  return index >> 1;
 }
 
-template <class K, class V>
-inline bool Multimap<K, V>::Erase(MultimapIterator<K, V> iter) {
-  return Erase(iter.GetKey(), iter.GetValue());
+// A missing key throws std::out_of_range like Map::Get.
+template <class K, class V, class Compare>
+inline const V &FrozenMap<K, V, Compare>::Get(const K &key) const {
+  const size_t index = LowerBoundIndex(key);
+  if (index == 0 || compare_.Less(key, keys_[index])) {
+    throw std::out_of_range("FrozenMap::Get: key not found");
+  }
+  return values_[index];
 }
 
-template <class K, class V> inline bool Multimap<K, V>::Contains(const K &key) {
-  return tree_.Contains(key);
+template <class K, class V, class Compare>
+inline bool FrozenMap<K, V, Compare>::Contains(const K &key) const {
+  const size_t index = LowerBoundIndex(key);
+  return index != 0 && !compare_.Less(key, keys_[index]);
 }
 
-template <class K, class V>
-MultimapIterator<K, V> Multimap<K, V>::Find(const K &key) {
-  MapIterator<K, std::vector<V>> iter = tree_.Find(key);
-  MultimapIterator<K, V> multi_iter;
-  if (iter != tree_.End()) {
-    multi_iter.index_ = iter.GetIndex();
-    multi_iter.multi_index_ = 0;
-    multi_iter.node_ = iter.GetNode();
+template <class K, class V, class Compare>
+FrozenMapIterator<K, V, Compare>
+FrozenMap<K, V, Compare>::Find(const K &key) const {
+  const size_t index = LowerBoundIndex(key);
+  if (index == 0 || compare_.Less(key, keys_[index])) {
+    return End();
   }
-  return multi_iter;
+  return FrozenMapIterator<K, V, Compare>(this, index);
 }
 
-template <class K, class V>
-MultimapIterator<K, V> Multimap<K, V>::BeginIterator() {
-  MultimapIterator<K, V> iter;
-  iter.node_ = tree_.Begin().GetNode();
-  if (iter.node_ == nullptr) {
-    iter.index_ = std::string::npos;
-    iter.multi_index_ = std::string::npos;
-  } else {
-    iter.index_ = 0;
-    iter.multi_index_ = 0;
-  }
-  return iter;
+template <class K, class V, class Compare>
+FrozenMapIterator<K, V, Compare>
+FrozenMap<K, V, Compare>::LowerBound(const K &key) const {
+  return FrozenMapIterator<K, V, Compare>(this, LowerBoundIndex(key));
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> Multimap<K, V>::Begin() {
-  return BeginIterator();
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare>
+FrozenMap<K, V, Compare>::Begin() const {
+  return FrozenMapIterator<K, V, Compare>(this, FirstIndex());
 }
 
-template <class K, class V>
-const MultimapIterator<K, V> inline Multimap<K, V>::Begin() const {
-  return BeginIterator();
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare> FrozenMap<K, V, Compare>::End() const {
+  return FrozenMapIterator<K, V, Compare>(this, 0);
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> Multimap<K, V>::End() {
-  return MultimapIterator<K, V>();
+template <class K, class V, class Compare>
+void FrozenMap<K, V, Compare>::Save(const std::string &filepath) const {
+  std::fstream file;
+  file.open(filepath,
+            std::fstream::trunc | std::fstream::out | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  for (size_t index = FirstIndex(); index != 0; index = NextIndex(index)) {
+    SerializerInstance<K>().Serialize(keys_[index], file);
+    SerializerInstance<V>().Serialize(values_[index], file);
+  }
+  file.close();
 }
 
-template <class K, class V>
-const MultimapIterator<K, V> inline Multimap<K, V>::End() const {
-  return MultimapIterator<K, V>();
+template <class K, class V, class Compare>
+void FrozenMap<K, V, Compare>::Load(const std::string &filepath) {
+  Clear();
+  struct stat info;
+  if (stat(filepath.c_str(), &info) != 0 ||
+      (info.st_mode & S_IFREG) != S_IFREG) {
+    return;
+  }
+  const size_t filesize = info.st_size;
+  std::fstream file;
+  file.open(filepath, std::fstream::in | std::fstream::binary);
+  if (!file.is_open()) {
+    return;
+  }
+  std::vector<K> keys;
+  std::vector<V> values;
+  K key;
+  V value;
+  size_t bytes = 0;
+  while (bytes < filesize) {
+    bytes += SerializerInstance<K>().Deserialize(key, file);
+    bytes += SerializerInstance<V>().Deserialize(value, file);
+    keys.push_back(std::move(key));
+    values.push_back(std::move(value));
+  }
+  file.close();
+  Allocate(keys.size());
+  size_t index = FirstIndex();
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys_[index] = std::move(keys[i]);
+    values_[index] = std::move(values[i]);
+    index = NextIndex(index);
+  }
 }
 
-template <class K, class V>
-inline void Multimap<K, V>::Save(const std::string &filepath) {
-  tree_.Save(filepath);
+template <class K, class V, class Compare>
+size_t FrozenMap<K, V, Compare>::MemoryUsage() const {
+  size_t usage = sizeof(FrozenMap<K, V, Compare>) +
+                 keys_.capacity() * sizeof(K) + values_.capacity() * sizeof(V);
+  for (size_t i = 1; i <= size_; i++) {
+    usage += HeapSize<K>().Measure(keys_[i]) + HeapSize<V>().Measure(values_[i]);
+  }
+  return usage;
 }
 
-template <class K, class V>
-inline void Multimap<K, V>::Load(const std::string &filepath) {
-  tree_.Load(filepath);
+template <class K, class V, class Compare>
+FrozenMap<K, V, Compare> Map<K, V, Compare>::Freeze() {
+  return FrozenMap<K, V, Compare>(*this);
 }
 
-template <class K, class V> class MultimapIterator {
-  template <class, class> friend class ::InnerNode;
-  template <class, class> friend class ::OuterNode;
-  template <class, class> friend class ::Map;
-  template <class, class> friend class ::MapIterator;
-  template <class, class> friend class ::Multimap;
+template <class K, class V, class Compare> class FrozenMapIterator {
+  template <class, class, class> friend class ::FrozenMap;
 
 public:
-  MultimapIterator();
-  ~MultimapIterator();
+  FrozenMapIterator();
+  ~FrozenMapIterator();
   const K &GetKey() const;
   const V &GetValue() const;
-  const std::vector<V> &GetMultiValue() const;
-  MultimapIterator<K, V> operator++();
-  MultimapIterator<K, V> operator++(int);
-  MultimapIterator<K, V> operator--();
-  MultimapIterator<K, V> operator--(int);
-  bool operator==(const MultimapIterator<K, V> &rhs);
-  bool operator!=(const MultimapIterator<K, V> &rhs);
+  FrozenMapIterator<K, V, Compare> operator++();
+  FrozenMapIterator<K, V, Compare> operator++(int);
+  FrozenMapIterator<K, V, Compare> operator--();
+  FrozenMapIterator<K, V, Compare> operator--(int);
+  bool operator==(const FrozenMapIterator<K, V, Compare> &rhs);
+  bool operator!=(const FrozenMapIterator<K, V, Compare> &rhs);
 
 protected:
-  K &Key();
-  V &Value();
-  std::vector<V> &MultiValue();
-  OuterNode<K, std::vector<V>> *node_;
+  FrozenMapIterator(const FrozenMap<K, V, Compare> *tree, size_t index);
+  const FrozenMap<K, V, Compare> *tree_;
   size_t index_;
-  size_t multi_index_;
-  void Increment();
-  void Decrement();
 };
 
-template <class K, class V>
-MultimapIterator<K, V>::MultimapIterator()
-    : node_(nullptr), index_(std::string::npos),
-      multi_index_(std::string::npos) {}
-
-template <class K, class V> MultimapIterator<K, V>::~MultimapIterator() {}
-
-template <class K, class V> inline K &MultimapIterator<K, V>::Key() {
-  return node_->GetKey(index_);
-}
-
-template <class K, class V>
-inline const K &MultimapIterator<K, V>::GetKey() const {
-  return node_->GetKey(index_);
-}
+template <class K, class V, class Compare>
+FrozenMapIterator<K, V, Compare>::FrozenMapIterator()
+    : tree_(nullptr), index_(0) {}
 
-template <class K, class V> inline V &MultimapIterator<K, V>::Value() {
-  return node_->GetValue(index_)[multi_index_];
-}
+template <class K, class V, class Compare>
+FrozenMapIterator<K, V, Compare>::FrozenMapIterator(
+    const FrozenMap<K, V, Compare> *tree, size_t index)
+    : tree_(tree), index_(index) {}
 
-template <class K, class V>
-inline const V &MultimapIterator<K, V>::GetValue() const {
-  return node_->GetValue(index_)[multi_index_];
-}
+template <class K, class V, class Compare>
+FrozenMapIterator<K, V, Compare>::~FrozenMapIterator() {}
 
-template <class K, class V>
-inline std::vector<V> &MultimapIterator<K, V>::MultiValue() {
-  return node_->GetValue(index_);
+template <class K, class V, class Compare>
+inline const K &FrozenMapIterator<K, V, Compare>::GetKey() const {
+  return tree_->keys_[index_];
 }
 
-template <class K, class V>
-inline const std::vector<V> &MultimapIterator<K, V>::GetMultiValue() const {
-  return node_->GetValue(index_);
+template <class K, class V, class Compare>
+inline const V &FrozenMapIterator<K, V, Compare>::GetValue() const {
+  return tree_->values_[index_];
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> MultimapIterator<K, V>::operator++() {
-  Increment();
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare>
+FrozenMapIterator<K, V, Compare>::operator++() {
+  index_ = tree_->NextIndex(index_);
   return *this;
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> MultimapIterator<K, V>::operator++(int) {
-  MultimapIterator<K, V> temp = *this;
-  Increment();
-  return temp;
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare>
+FrozenMapIterator<K, V, Compare>::operator++(int) {
+  FrozenMapIterator<K, V, Compare> iter = *this;
+  index_ = tree_->NextIndex(index_);
+  return iter;
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> MultimapIterator<K, V>::operator--() {
-  Decrement();
+// Decrementing the end iterator yields the last element.
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare>
+FrozenMapIterator<K, V, Compare>::operator--() {
+  index_ = index_ == 0 ? tree_->LastIndex() : tree_->PreviousIndex(index_);
   return *this;
 }
 
-template <class K, class V>
-inline MultimapIterator<K, V> MultimapIterator<K, V>::operator--(int) {
-  MultimapIterator<K, V> temp = *this;
-  Decrement();
-  return temp;
+template <class K, class V, class Compare>
+inline FrozenMapIterator<K, V, Compare>
+FrozenMapIterator<K, V, Compare>::operator--(int) {
+  FrozenMapIterator<K, V, Compare> iter = *this;
+  --*this;
+  return iter;
 }
 
-template <class K, class V>
-inline bool MultimapIterator<K, V>::
-operator==(const MultimapIterator<K, V> &rhs) {
-  return node_ == rhs.node_ && index_ == rhs.index_ &&
-         multi_index_ == rhs.multi_index_;
+template <class K, class V, class Compare>
+inline bool FrozenMapIterator<K, V, Compare>::
+operator==(const FrozenMapIterator<K, V, Compare> &rhs) {
+  return index_ == rhs.index_;
 }
 
-template <class K, class V>
-inline bool MultimapIterator<K, V>::
-operator!=(const MultimapIterator<K, V> &rhs) {
+template <class K, class V, class Compare>
+inline bool FrozenMapIterator<K, V, Compare>::
+operator!=(const FrozenMapIterator<K, V, Compare> &rhs) {
   return !(*this == rhs);
 }
-
-template <class K, class V> void MultimapIterator<K, V>::Increment() {
-  if (index_ == node_->CountKeys() - 1) {
-    if (multi_index_ == node_->GetValue(index_).size() - 1) {
-      if (node_->GetNext() != nullptr) {
-        node_ = node_->GetNext();
-        index_ = 0;
-        multi_index_ = 0;
-      } else {
-        node_ = nullptr;
-        index_ = std::string::npos;
-        multi_index_ = std::string::npos;
-      }
-    } else {
-      multi_index_++;
-    }
-  } else {
-    if (multi_index_ == node_->GetValue(index_).size() - 1) {
-      index_++;
-      multi_index_ = 0;
-    } else {
-      multi_index_++;
-    }
-  }
-}
-
-template <class K, class V> void MultimapIterator<K, V>::Decrement() {
-  if (index_ == 0) {
-    if (multi_index_ == 0) {
-      if (node_->previous_ != nullptr) {
-        node_ = node_->GetPrevious();
-        index_ = node_->CountKeys() - 1;
-        multi_index_ = node_->GetValue(index_).size() - 1;
-      } else {
-        node_ = nullptr;
-        index_ = std::string::npos;
-        multi_index_ = std::string::npos;
-      }
-    } else {
-      multi_index_--;
-    }
-  } else {
-    if (multi_index_ == 0) {
-      index_--;
-      multi_index_ = node_->GetValue(index_).size() - 1;
-    } else {
-      multi_index_--;
-    }
-  }
-}
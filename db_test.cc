@@ -20,7 +20,8 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
-#include <chrono>
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -28,166 +29,23 @@ SOFTWARE. */
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory_resource>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <strings.h>
 
 #include "db_core.h"
 
-static double MapBenchmark(int dimension) {
-  uint64_t seed = time(nullptr);
-
-  RandomGenerator xorshift;
-  xorshift.Seed(seed);
-  size_t N = dimension;
-
-  std::vector<double> keys(N);
-  std::vector<double> vals(N);
-  for (size_t i = 0; i < N; i++) {
-    keys[i] = xorshift.Uniform();
-    vals[i] = xorshift.Uniform();
-  }
-
-  Map<double, double> tree;
-
-  auto t1 = std::chrono::high_resolution_clock::now();
-
-  for (size_t i = 0; i < N; i++) {
-    tree.Put(keys[i], vals[i]);
-  }
-
-  MapIterator<double, double> it;
-  for (size_t i = 0; i < N; i++) {
-    it = tree.Find(keys[xorshift.Uint64() % N]);
-  }
-
-  for (size_t i = 0; i < N; i++) {
-    tree.Erase(tree.Begin());
-  }
-
-  auto t2 = std::chrono::high_resolution_clock::now();
-
-  auto int_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-
-  std::chrono::duration<double, std::milli> fp_ms = t2 - t1;
-
-  return fp_ms.count();
-}
-
-static double StandardMapBenchmark(int dimension) {
-  uint64_t seed = time(nullptr);
-
-  RandomGenerator xorshift;
-  xorshift.Seed(seed);
-  size_t N = dimension;
-
-  std::vector<double> keys(N);
-  std::vector<double> vals(N);
-  for (size_t i = 0; i < N; i++) {
-    keys[i] = xorshift.Uniform();
-    vals[i] = xorshift.Uniform();
-  }
-
-  std::map<double, double> tree;
-
-  auto t1 = std::chrono::high_resolution_clock::now();
-
-  for (size_t i = 0; i < N; i++) {
-    tree.insert(std::make_pair(keys[i], vals[i]));
-  }
-
-  std::map<double, double>::iterator it;
-  for (size_t i = 0; i < N; i++) {
-    it = tree.find(keys[xorshift.Uint64() % N]);
-  }
-
-  for (size_t i = 0; i < N; i++) {
-    tree.erase(tree.begin());
-  }
+// Trees with int keys and long values keep a summary of every subtree.
+template <>
+class MapAggregate<int, long> : public SummaryAggregate<int, long> {};
 
-  auto t2 = std::chrono::high_resolution_clock::now();
-
-  auto int_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-
-  std::chrono::duration<double, std::milli> fp_ms = t2 - t1;
-
-  return fp_ms.count();
-}
-
-static double MultimapBenchmark(int dimension) {
-  Multimap<long, long> tree;
-
-  uint64_t seed = time(nullptr);
-
-  RandomGenerator xorshift;
-  xorshift.Seed(seed);
-  size_t N = dimension;
-
-  std::vector<long> keys(N);
-  std::vector<long> vals(N);
-  for (size_t i = 0; i < N; i++) {
-    keys[i] = xorshift.Uint64() % (N / 10);
-    vals[i] = xorshift.Uint64() % (N / 10);
-  }
-
-  auto t1 = std::chrono::high_resolution_clock::now();
-
-  for (size_t i = 0; i < N; i++) {
-    tree.Put(keys[i], vals[i]);
-  }
-
-  MultimapIterator<long, long> it;
-  for (size_t i = 0; i < N; i++) {
-    it = tree.Find(keys[xorshift.Uint64() % N]);
-  }
-
-  for (size_t i = 0; i < N; i++) {
-    tree.Erase(tree.Begin());
-  }
-
-  auto t2 = std::chrono::high_resolution_clock::now();
-
-  auto int_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-
-  std::chrono::duration<double, std::milli> fp_ms = t2 - t1;
-
-  return fp_ms.count();
-}
-
-static double StandardMultimapBenchmark(int dimension) {
-  std::multimap<long, long> tree;
-  uint64_t seed = time(nullptr);
-
-  RandomGenerator xorshift;
-  xorshift.Seed(seed);
-  size_t N = dimension;
-
-  std::vector<long> keys(N);
-  std::vector<long> vals(N);
-  for (size_t i = 0; i < N; i++) {
-    keys[i] = xorshift.Uint64() % (N / 10);
-    vals[i] = xorshift.Uint64() % (N / 10);
-  }
-
-  auto t1 = std::chrono::high_resolution_clock::now();
-
-  for (size_t i = 0; i < N; i++) {
-    tree.insert(std::make_pair(keys[i], vals[i]));
-  }
-
-  std::multimap<long, long>::iterator it;
-  for (size_t i = 0; i < N; i++) {
-    it = tree.find(keys[xorshift.Uint64() % N]);
-  }
-
-  for (size_t i = 0; i < N; i++) {
-    tree.erase(tree.begin());
+static void Expect(bool condition, const char *what) {
+  if (!condition) {
+    std::cout << "check failed: " << what << std::endl;
+    std::exit(EXIT_FAILURE);
   }
-
-  auto t2 = std::chrono::high_resolution_clock::now();
-
-  auto int_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-
-  std::chrono::duration<double, std::milli> fp_ms = t2 - t1;
-
-  return fp_ms.count();
 }
 
 static void MapSerialization(int powers) {
@@ -333,7 +191,7 @@ static void StringMapSerialization(int powers) {
 
   i = 0;
   for (size_t i = 0; i < N; i++) {
-    tree.Erase(tree.Begin());
+    tree.PopFront();
   }
 
   for (size_t i = 0; i < N; i++) {
@@ -382,33 +240,1763 @@ static void StringMapSerialization(int powers) {
   tree.Clear();
 }
 
+static void MapQueue(int powers) {
+  Map<long, long> tree;
+  std::map<long, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200101);
+  size_t N = pow(10, powers);
+
+  for (size_t i = 0; i < N; i++) {
+    long key = xorshift.Uint64() % N;
+    tree.Put(key, i);
+    reference[key] = i;
+  }
+  Expect(tree.Size() == reference.size() && tree.Verify(), "queue fill");
+
+  long key = 0;
+  long value = 0;
+  size_t step = 0;
+  std::vector<std::pair<long, long>> batch;
+  while (!reference.empty()) {
+    switch (xorshift.Uint64() % 4) {
+    case 0:
+      Expect(tree.PopFront(key, value), "pop front");
+      Expect(key == reference.begin()->first &&
+                 value == reference.begin()->second,
+             "pop front order");
+      reference.erase(reference.begin());
+      break;
+    case 1:
+      Expect(tree.PopBack(key, value), "pop back");
+      Expect(key == reference.rbegin()->first &&
+                 value == reference.rbegin()->second,
+             "pop back order");
+      reference.erase(std::prev(reference.end()));
+      break;
+    case 2:
+      // Grows the front leaf so that it splits under the cached pointer.
+      key = reference.begin()->first - 1 -
+            static_cast<long>(xorshift.Uint64() % 64);
+      tree.Put(key, step);
+      reference[key] = step;
+      break;
+    default:
+      batch.clear();
+      const size_t count = xorshift.Uint64() % 100;
+      Expect(tree.PopFrontN(count, batch) ==
+                 std::min(count, reference.size()),
+             "pop front n count");
+      for (size_t i = 0; i < batch.size(); i++) {
+        Expect(batch[i].first == reference.begin()->first &&
+                   batch[i].second == reference.begin()->second,
+               "pop front n order");
+        reference.erase(reference.begin());
+      }
+    }
+    Expect(tree.Size() == reference.size(), "queue size");
+    if (step++ % 64 == 0) {
+      Expect(tree.Verify(), "queue invariants");
+    }
+  }
+  Expect(tree.Begin() == tree.End() && !tree.PopFront() && !tree.PopBack() &&
+             tree.Verify(),
+         "queue drained");
+  std::cout << "drain tree with pop front/back: ordered" << std::endl;
+}
+
+// A value that counts how often it is copied or moved. A moved-from value
+// reads -1, so tests can tell whether an argument was consumed.
+class Tracked {
+public:
+  Tracked() : value_(0) {}
+  Tracked(long value) : value_(value) {}
+  Tracked(long high, long low) : value_(high * 1000 + low) {}
+  Tracked(const Tracked &other) : value_(other.value_) { copies++; }
+  Tracked(Tracked &&other) noexcept : value_(other.value_) {
+    other.value_ = -1;
+    moves++;
+  }
+  Tracked &operator=(const Tracked &other) {
+    value_ = other.value_;
+    copies++;
+    return *this;
+  }
+  Tracked &operator=(Tracked &&other) noexcept {
+    value_ = other.value_;
+    other.value_ = -1;
+    moves++;
+    return *this;
+  }
+  long Value() const { return value_; }
+  static size_t copies;
+  static size_t moves;
+
+private:
+  long value_;
+};
+
+size_t Tracked::copies = 0;
+size_t Tracked::moves = 0;
+
+static bool SameTracked(Map<long, Tracked> &tree,
+                        const std::map<long, long> &reference) {
+  if (tree.Size() != reference.size()) {
+    return false;
+  }
+  auto expected = reference.begin();
+  for (auto it = tree.Begin(); it != tree.End(); ++it, ++expected) {
+    if (it.GetKey() != expected->first ||
+        it.GetValue().Value() != expected->second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void MapEmplace(int powers) {
+  Map<long, Tracked> tree;
+  std::map<long, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200114);
+  size_t N = pow(10, powers);
+
+  MapIterator<long, Tracked> iter;
+  bool inserted;
+  for (size_t i = 0; i < N; i++) {
+    long key = xorshift.Uint64() % (N / 2 + 1);
+    const bool present = reference.count(key) != 0;
+    const long old_value = present ? reference[key] : 0;
+    const long value = i + 1;
+    long expected = value;
+    switch (i % 5) {
+    case 0:
+      std::tie(iter, inserted) = tree.Put(key, Tracked(value));
+      break;
+    case 1: {
+      Tracked argument(value);
+      std::tie(iter, inserted) = tree.Put(std::move(key), std::move(argument));
+      Expect(argument.Value() == -1, "rvalue put moves its value");
+      break;
+    }
+    case 2:
+      std::tie(iter, inserted) = tree.Emplace(key, value / 1000, value % 1000);
+      break;
+    case 3:
+      std::tie(iter, inserted) = tree.Emplace(key);
+      expected = 0;
+      break;
+    default: {
+      Tracked argument(value);
+      std::tie(iter, inserted) = tree.TryEmplace(key, std::move(argument));
+      Expect(argument.Value() == (present ? value : -1),
+             "try emplace consumes its value only on insertion");
+      if (present) {
+        expected = old_value;
+      }
+      break;
+    }
+    }
+    Expect(inserted == !present && iter.GetKey() == key &&
+               iter.GetValue().Value() == expected,
+           "emplace result");
+    reference[key] = expected;
+  }
+  Expect(Tracked::copies == 0, "rvalue puts and emplaces do not copy");
+  Expect(tree.Verify() && SameTracked(tree, reference), "emplace contents");
+
+  // The const overloads copy exactly once, whether they insert or assign.
+  const Tracked argument(7);
+  tree.Put(-1, argument);
+  Expect(Tracked::copies == 1, "const put copies on insertion");
+  tree.Put(-1, argument);
+  Expect(Tracked::copies == 2, "const put copies on assignment");
+  tree.TryEmplace(-1, argument);
+  Expect(Tracked::copies == 2 && tree.Get(-1).Value() == 7,
+         "try emplace leaves an existing value alone");
+  std::cout << "emplace and try emplace: consistent" << std::endl;
+}
+
+static void MapOperationCounters(int powers) {
+  MapPolicy policy;
+  policy.count_operations = true;
+  Map<long, long> counted(policy);
+  Map<long, long> plain;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200102);
+  size_t N = pow(10, powers);
+
+  for (size_t i = 0; i < N; i++) {
+    long key = xorshift.Uint64() % N;
+    counted.Put(key, i);
+    plain.Put(key, i);
+  }
+  for (size_t i = 0; i < N; i++) {
+    long key = xorshift.Uint64() % N;
+    counted.Erase(key);
+    plain.Erase(key);
+  }
+  const MapStatistics statistics = counted.Stats();
+  Expect(statistics.counters.outer_splits + 1 >= statistics.outer_nodes &&
+             statistics.counters.coalesces > 0,
+         "counted tree");
+  Expect(plain.Stats().counters.outer_splits == 0, "plain tree");
+  counted.ResetCounters();
+  Expect(counted.Stats().counters.outer_splits == 0, "reset counters");
+  std::cout << "operation counters: per tree" << std::endl;
+}
+
+// Exposes the bucket mapping of the histogram to the test below.
+class HistogramProbe : public LatencyHistogram {
+public:
+  using LatencyHistogram::BucketIndex;
+};
+
+// Every value must land in the bucket whose limit is the first one at or
+// above it, within 1/16 of the value, and percentiles must stay within that
+// error of the exact order statistics.
+static void LatencyHistogramBuckets(int powers) {
+  HistogramProbe histogram;
+  std::vector<uint64_t> values;
+  for (uint64_t value = 0; value < 256; value++) {
+    values.push_back(value);
+  }
+  for (int bit = 4; bit < 64; bit++) {
+    const uint64_t power = static_cast<uint64_t>(1) << bit;
+    values.push_back(power - 1);
+    values.push_back(power);
+    values.push_back(power + 1);
+  }
+  values.push_back(std::numeric_limits<uint64_t>::max());
+  for (uint64_t value : values) {
+    const size_t index = HistogramProbe::BucketIndex(value);
+    Expect(index < histogram.CountBuckets() &&
+               value <= histogram.BucketLimit(index) &&
+               (index == 0 || histogram.BucketLimit(index - 1) < value) &&
+               histogram.BucketLimit(index) - value <= value / 16,
+           "histogram bucket bounds");
+  }
+  Expect(HistogramProbe::BucketIndex(std::numeric_limits<uint64_t>::max()) ==
+             histogram.CountBuckets() - 1,
+         "histogram last bucket");
+
+  Expect(histogram.Count() == 0 && histogram.Percentile(0.5) == 0 &&
+             histogram.Minimum() == 0 && histogram.Maximum() == 0,
+         "empty histogram");
+  RandomGenerator xorshift;
+  xorshift.Seed(20200119);
+  const size_t N = pow(10, powers);
+  std::vector<uint64_t> recorded;
+  HistogramProbe first;
+  HistogramProbe second;
+  for (size_t i = 0; i < N; i++) {
+    const uint64_t value = xorshift.Uint64() >> (xorshift.Uint64() % 64);
+    recorded.push_back(value);
+    histogram.Record(value);
+    (i % 2 == 0 ? first : second).Record(value);
+  }
+  std::sort(recorded.begin(), recorded.end());
+  Expect(histogram.Count() == N && histogram.Minimum() == recorded.front() &&
+             histogram.Maximum() == recorded.back(),
+         "histogram count and extremes");
+  const double fractions[] = {0.0, 0.01, 0.25, 0.5, 0.9, 0.99, 0.999, 1.0};
+  for (double fraction : fractions) {
+    const size_t rank = std::max<size_t>(1, fraction * N + 0.5);
+    const uint64_t exact = recorded[rank - 1];
+    const uint64_t percentile = histogram.Percentile(fraction);
+    Expect(exact <= percentile && percentile - exact <= exact / 16,
+           "histogram percentile");
+  }
+  Expect(histogram.Percentile(1.0) == recorded.back(), "histogram maximum");
+  first.Merge(second);
+  for (size_t i = 0; i < histogram.CountBuckets(); i++) {
+    Expect(first.BucketCount(i) == histogram.BucketCount(i),
+           "histogram merge");
+  }
+
+  size_t sampled = 0;
+  for (size_t i = 0; i < 100 * MAP_LATENCY_SAMPLE_INTERVAL; i++) {
+    sampled += histogram.Sample();
+  }
+  Expect(sampled == 100, "histogram sampling");
+  std::cout << "latency histogram buckets: consistent" << std::endl;
+}
+
+static void MapReload(int powers) {
+  MapPolicy policy;
+  policy.hash_index = true;
+  Map<long, long> source;
+  Map<long, long> fresh(policy);
+  Map<long, long> reused(policy);
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200103);
+  size_t N = pow(10, powers);
+
+  for (size_t i = 0; i < N; i++) {
+    source.Put(2 * (xorshift.Uint64() % N), i);
+    reused.Put(2 * (xorshift.Uint64() % N) + 1, i);
+  }
+  source.Save("reload.bin");
+  fresh.Load("reload.bin");
+  reused.Load("reload.bin");
+  reused.Load("reload.bin");
+  Expect(reused.Size() == source.Size() && reused.Verify(), "reload size");
+  Expect(reused.MemoryUsage().total == fresh.MemoryUsage().total,
+         "reload memory usage");
+  for (size_t i = 0; i < N; i++) {
+    Expect(reused.Contains(i) == source.Contains(i), "reload lookup");
+  }
+  std::cout << "load into a filled tree: replaced" << std::endl;
+}
+
+template <class M, class R> static bool SameElements(M &tree, R &reference) {
+  if (tree.Size() != reference.size()) {
+    return false;
+  }
+  auto expected = reference.begin();
+  for (auto it = tree.Begin(); it != tree.End(); ++it, ++expected) {
+    if (it.GetKey() != expected->first || it.GetValue() != expected->second) {
+      return false;
+    }
+  }
+  return expected == reference.end();
+}
+
+static void MapCompaction(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200104);
+  size_t N = pow(10, powers);
+
+  const double fills[] = {0.5, 0.75, 1.0};
+  for (double fill : fills) {
+    Map<long, long> tree;
+    std::map<long, long> reference;
+    for (size_t i = 0; i < N; i++) {
+      long key = xorshift.Uint64() % (2 * N);
+      tree.Put(key, i);
+      reference[key] = i;
+    }
+    for (size_t i = 0; i < N; i++) {
+      long key = xorshift.Uint64() % (2 * N);
+      tree.Erase(key);
+      reference.erase(key);
+    }
+    tree.Compact(fill);
+    Expect(tree.Verify() && SameElements(tree, reference), "compact");
+    Expect(tree.Stats().outer_fill >= 0.95 * std::max(0.5, fill),
+           "compact fill");
+
+    for (size_t i = 0; i < 4 * N; i++) {
+      long key = xorshift.Uint64() % (2 * N);
+      switch (xorshift.Uint64() % 3) {
+      case 0:
+        tree.Put(key, i);
+        reference[key] = i;
+        break;
+      case 1:
+        tree.Erase(key);
+        reference.erase(key);
+        break;
+      default:
+        tree.CompactStep(fill, 1 + xorshift.Uint64() % 8);
+      }
+      if (i % 1024 == 0) {
+        Expect(tree.Verify(), "compact step invariants");
+      }
+    }
+    while (!tree.CompactStep(fill, 64)) {
+    }
+    Expect(tree.Verify() && SameElements(tree, reference), "compact step");
+  }
+  std::cout << "compact and compact step: packed" << std::endl;
+}
+
+// Checks Find and Contains for key against the reference.
+template <class M, class R>
+static bool SameLookup(M &tree, R &reference,
+                       const typename R::key_type &key) {
+  auto expected = reference.find(key);
+  auto it = tree.Find(key);
+  if (expected == reference.end()) {
+    return it == tree.End() && !tree.Contains(key);
+  }
+  return it != tree.End() && it.GetKey() == key &&
+         it.GetValue() == expected->second && tree.Contains(key);
+}
+
+template <class M, class R>
+static bool SameLookups(M &tree, R &reference, size_t keys) {
+  for (size_t key = 0; key < keys; key++) {
+    if (!SameLookup(tree, reference, key)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void MapHashIndex(int powers) {
+  MapPolicy policy;
+  policy.hash_index = true;
+  policy.count_operations = true;
+  Map<long, long> tree(policy);
+  std::map<long, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200106);
+  size_t N = pow(10, powers);
+
+  for (size_t i = 0; i < 4 * N; i++) {
+    const long key = xorshift.Uint64() % N;
+    if (xorshift.Uint64() % 2 == 0) {
+      tree.Put(key, i);
+      reference[key] = i;
+    } else {
+      Expect(tree.Erase(key) == (reference.erase(key) > 0), "index erase");
+    }
+    Expect(SameLookup(tree, reference, key) &&
+               SameLookup(tree, reference, xorshift.Uint64() % N),
+           "index lookup");
+    if (i % 4096 == 0) {
+      Expect(tree.Verify(), "index invariants");
+    }
+  }
+  const MapCounters counters = tree.Stats().counters;
+  Expect(counters.outer_splits > 0 && counters.redistributions > 0 &&
+             counters.coalesces > 0,
+         "index restructuring");
+  Expect(tree.Verify() && SameLookups(tree, reference, N), "index lookups");
+
+  tree.Save("index.bin");
+  Map<long, long> loaded(policy);
+  loaded.Put(N, 0);
+  loaded.Load("index.bin");
+  Expect(loaded.Verify() && SameLookups(loaded, reference, N + 1),
+         "index load");
+  loaded.Clear();
+  std::map<long, long> none;
+  Expect(loaded.Verify() && SameLookups(loaded, none, N), "index clear");
+
+  // The upper part is moved into a tree without index and back.
+  Map<long, long> upper;
+  tree.SplitAt(N / 2, upper);
+  std::map<long, long> low(reference.begin(), reference.lower_bound(N / 2));
+  std::map<long, long> high(reference.lower_bound(N / 2), reference.end());
+  Expect(tree.Verify() && upper.Verify() && SameLookups(tree, low, N) &&
+             SameLookups(upper, high, N),
+         "index split");
+  Expect(tree.Join(upper) && tree.Verify() &&
+             SameLookups(tree, reference, N),
+         "index join");
+
+  Map<long, long> other;
+  for (size_t i = 0; i < N / 2; i++) {
+    const long key = xorshift.Uint64() % (2 * N);
+    other.Put(key, i);
+    reference[key] = i;
+  }
+  tree.Merge(other, [](long &value, long &other_value) {
+    value = other_value;
+  });
+  Expect(tree.Verify() && SameLookups(tree, reference, 2 * N), "index merge");
+  std::cout << "hash index lookups: consistent" << std::endl;
+}
+
+static void ValueLogMapOperations(int powers) {
+  ValueLogMap<long, std::string> tree;
+  std::map<long, std::string> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200107);
+  size_t N = pow(10, powers);
+
+  tree.SetGarbageRatio(0.5);
+  for (size_t i = 0; i < 4 * N; i++) {
+    const long key = xorshift.Uint64() % N;
+    if (xorshift.Uint64() % 4 == 0) {
+      Expect(tree.Erase(key) == (reference.erase(key) > 0), "value log erase");
+    } else {
+      const std::string value = std::to_string(i);
+      tree.Put(key, value);
+      reference[key] = value;
+    }
+    auto expected = reference.find(key);
+    Expect(expected == reference.end()
+               ? !tree.Contains(key)
+               : tree.Contains(key) && tree.Get(key) == expected->second,
+           "value log get");
+    Expect(tree.Garbage() < 64 || tree.Garbage() <= 0.5 * tree.Size(),
+           "value log garbage");
+  }
+  Expect(SameElements(tree, reference), "value log elements");
+
+  // Overwrites replace values in their slots, and appends leave the stored
+  // values where they are.
+  tree.SetGarbageRatio(0.0);
+  const size_t garbage = tree.Garbage();
+  const long first = reference.begin()->first;
+  const std::string *stored = &tree.Get(first);
+  for (auto it = reference.begin(); it != reference.end(); ++it) {
+    it->second += "'";
+    tree.Put(it->first, it->second);
+  }
+  for (size_t i = 0; i < N; i++) {
+    tree.Put(N + i, std::to_string(i));
+    reference[N + i] = std::to_string(i);
+  }
+  Expect(tree.Garbage() == garbage && &tree.Get(first) == stored &&
+             *stored == reference[first],
+         "value log overwrite in place");
+  size_t erased = 0;
+  for (auto it = reference.begin(); it != reference.end();) {
+    if (it->first % 2 == 0) {
+      Expect(tree.Erase(it->first), "value log erase without collection");
+      it = reference.erase(it);
+      erased++;
+    } else {
+      ++it;
+    }
+  }
+  Expect(tree.Garbage() == garbage + erased, "value log without collection");
+  tree.Collect();
+  Expect(tree.Garbage() == 0 && SameElements(tree, reference),
+         "value log collect");
+
+  tree.Save("valuelog.bin");
+  ValueLogMap<long, std::string> loaded;
+  loaded.Put(-1, "stale");
+  loaded.Load("valuelog.bin");
+  Expect(loaded.Garbage() == 0 && SameElements(loaded, reference),
+         "value log load");
+  Map<long, std::string> plain;
+  plain.Load("valuelog.bin");
+  Expect(SameElements(plain, reference), "value log file format");
+  loaded.Load(".");
+  Expect(loaded.Size() == 0, "value log load directory");
+  std::cout << "value log map: consistent" << std::endl;
+}
+
+// Checks Select, Rank and Count against the reference at a sample of ranks.
+// The reference holds even keys only, so key + 1 is always missing.
+template <class R> static bool SameRanks(Map<int, long> &tree, R &reference) {
+  if (tree.Select(reference.size()) != tree.End()) {
+    return false;
+  }
+  const size_t stride = 1 + reference.size() / 256;
+  size_t rank = 0;
+  for (auto it = reference.begin(); it != reference.end(); ++it, ++rank) {
+    if (rank % stride != 0 && rank + 1 != reference.size()) {
+      continue;
+    }
+    MapIterator<int, long> selected = tree.Select(rank);
+    if (selected == tree.End() || selected.GetKey() != it->first ||
+        selected.GetValue() != it->second ||
+        tree.Rank(it->first) != rank || tree.Rank(it->first + 1) != rank + 1 ||
+        tree.Count(reference.begin()->first, it->first) != rank) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void MapOrderStatistics(int powers) {
+  Map<int, long> tree;
+  std::map<int, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200108);
+  size_t N = pow(10, powers);
+
+  for (size_t i = 0; i < N; i++) {
+    const int key = 2 * (xorshift.Uint64() % N);
+    tree.Put(key, i);
+    reference[key] = i;
+  }
+  Expect(SameRanks(tree, reference), "rank after put");
+  for (size_t i = 0; i < N / 2; i++) {
+    const int key = 2 * (xorshift.Uint64() % N);
+    tree.Erase(key);
+    reference.erase(key);
+  }
+  Expect(SameRanks(tree, reference), "rank after erase");
+
+  tree.Save("ranks.bin");
+  Map<int, long> loaded;
+  loaded.Load("ranks.bin");
+  Expect(SameRanks(loaded, reference), "rank after load");
+  tree.Compact(0.5);
+  Expect(SameRanks(tree, reference), "rank after compact");
+
+  Map<int, long> other;
+  for (size_t i = 0; i < N / 2; i++) {
+    const int key = 2 * (xorshift.Uint64() % (2 * N));
+    other.Put(key, i);
+    reference[key] = i;
+  }
+  tree.Merge(other, [](long &value, long &other_value) {
+    value = other_value;
+  });
+  Expect(SameRanks(tree, reference), "rank after merge");
+  std::cout << "rank and select: consistent" << std::endl;
+}
+
+// Compares the aggregate of [low, high) with a walk over the reference.
+template <class R>
+static bool SameAggregate(Map<int, long> &tree, R &reference, int low,
+                          int high) {
+  typedef SummaryAggregate<int, long> Aggregate;
+  ValueSummary<long> expected;
+  for (auto it = reference.lower_bound(low);
+       it != reference.end() && it->first < high; ++it) {
+    expected = Aggregate::Combine(expected,
+                                  Aggregate::Lift(it->first, it->second));
+  }
+  const ValueSummary<long> summary = tree.Aggregate(low, high);
+  return summary.count == expected.count && summary.sum == expected.sum &&
+         summary.minimum == expected.minimum &&
+         summary.maximum == expected.maximum;
+}
+
+// Compares the aggregates of the whole tree and of random ranges within
+// [0, keys) with the reference.
+template <class R>
+static bool SameAggregates(Map<int, long> &tree, R &reference,
+                           RandomGenerator &xorshift, int keys) {
+  if (!SameAggregate(tree, reference, std::numeric_limits<int>::min(),
+                     std::numeric_limits<int>::max())) {
+    return false;
+  }
+  for (size_t i = 0; i < 256; i++) {
+    const int low = xorshift.Uint64() % keys;
+    const int high = low + xorshift.Uint64() % (keys - low + 1);
+    if (!SameAggregate(tree, reference, low, high)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void MapRangeAggregates(int powers) {
+  Map<int, long> tree;
+  std::map<int, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200109);
+  size_t N = pow(10, powers);
+  const int keys = 2 * N;
+
+  for (size_t i = 0; i < N; i++) {
+    const int key = xorshift.Uint64() % keys;
+    const long value = static_cast<long>(xorshift.Uint64() % 2001) - 1000;
+    tree.Put(key, value);
+    reference[key] = value;
+  }
+  Expect(SameAggregates(tree, reference, xorshift, keys),
+         "aggregate after put");
+  for (size_t i = 0; i < N; i++) {
+    const int key = xorshift.Uint64() % keys;
+    switch (xorshift.Uint64() % 3) {
+    case 0:
+      tree.Put(key, i);
+      reference[key] = i;
+      break;
+    case 1:
+      if (tree.Modify(key, [](long &value) { value = -value; })) {
+        reference[key] = -reference[key];
+      }
+      break;
+    default:
+      tree.Upsert(key, [](long &value) { value += 7; });
+      reference[key] += 7;
+    }
+  }
+  Expect(SameAggregates(tree, reference, xorshift, keys),
+         "aggregate after update");
+  for (size_t i = 0; i < N; i++) {
+    const int key = xorshift.Uint64() % keys;
+    tree.Erase(key);
+    reference.erase(key);
+  }
+  Expect(SameAggregates(tree, reference, xorshift, keys),
+         "aggregate after erase");
+
+  tree.Save("aggregates.bin");
+  Map<int, long> loaded;
+  loaded.Load("aggregates.bin");
+  Expect(SameAggregates(loaded, reference, xorshift, keys),
+         "aggregate after load");
+  tree.Compact(0.5);
+  Expect(SameAggregates(tree, reference, xorshift, keys),
+         "aggregate after compact");
+
+  Map<int, long> other;
+  for (size_t i = 0; i < N; i++) {
+    const int key = xorshift.Uint64() % keys;
+    if (std::get<1>(other.Put(key, 1))) {
+      reference[key] += 1;
+    }
+  }
+  tree.Merge(other, [](long &value, long &other_value) {
+    value += other_value;
+  });
+  Expect(SameAggregates(tree, reference, xorshift, keys),
+         "aggregate after merge");
+  std::cout << "range aggregates: consistent" << std::endl;
+}
+
+// Compares ForEach, ForEachBlock, Count, Sum, Min and Max over [low, high)
+// with a walk over the reference.
+static bool SameScan(Map<int, long> &tree, const std::map<int, long> &reference,
+                     int low, int high) {
+  std::vector<std::pair<int, long>> expected;
+  long sum = 0;
+  for (auto it = reference.lower_bound(low);
+       it != reference.end() && it->first < high; ++it) {
+    expected.push_back(*it);
+    sum += it->second;
+  }
+  std::vector<std::pair<int, long>> elements;
+  tree.ForEach(low, high, [&elements](const int &key, const long &value) {
+    elements.emplace_back(key, value);
+  });
+  std::vector<std::pair<int, long>> blocks;
+  bool empty_block = false;
+  tree.ForEachBlock(low, high,
+                    [&](const int *keys, const long *values, size_t count) {
+                      empty_block = empty_block || count == 0;
+                      for (size_t i = 0; i < count; i++) {
+                        blocks.emplace_back(keys[i], values[i]);
+                      }
+                    });
+  long minimum = 0;
+  long maximum = 0;
+  const bool found_minimum = tree.Min(low, high, minimum);
+  const bool found_maximum = tree.Max(low, high, maximum);
+  if (elements != expected || blocks != expected || empty_block ||
+      tree.Count(low, high) != expected.size() || tree.Sum(low, high) != sum ||
+      found_minimum == expected.empty() || found_maximum == expected.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < expected.size(); i++) {
+    if (expected[i].second < minimum || maximum < expected[i].second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Scans empty ranges, ranges within one leaf and ranges across many leaves.
+static void MapRangeScans(int powers) {
+  Map<int, long> tree;
+  std::map<int, long> reference;
+
+  RandomGenerator xorshift;
+  xorshift.Seed(20200117);
+  size_t N = pow(10, powers);
+  const int keys = 4 * N;
+
+  Expect(SameScan(tree, reference, 0, keys), "scan empty tree");
+  for (size_t i = 0; i < N; i++) {
+    const int key = 2 * (xorshift.Uint64() % (keys / 2));
+    const long value = static_cast<long>(xorshift.Uint64() % 2001) - 1000;
+    tree.Put(key, value);
+    reference[key] = value;
+  }
+  const int first = reference.begin()->first;
+  const int last = reference.rbegin()->first;
+  Expect(SameScan(tree, reference, first, first) &&
+             SameScan(tree, reference, last, first) &&
+             SameScan(tree, reference, first + 1, first + 2) &&
+             SameScan(tree, reference, last + 1, keys) &&
+             SameScan(tree, reference, -keys, first),
+         "scan empty ranges");
+  Expect(SameScan(tree, reference, first, first + 1) &&
+             SameScan(tree, reference, last, last + 1) &&
+             SameScan(tree, reference, -keys, 2 * keys),
+         "scan edges");
+  for (size_t i = 0; i < 256; i++) {
+    const int low = xorshift.Uint64() % keys;
+    Expect(SameScan(tree, reference, low, low + 1 + xorshift.Uint64() % 8),
+           "scan within a leaf");
+    Expect(SameScan(tree, reference, low,
+                    low + xorshift.Uint64() % (keys - low + 1)),
+           "scan across leaves");
+  }
+  std::cout << "range scans and reductions: consistent" << std::endl;
+}
+
+// Compares the forward scans from the entry of key on, which prefetch the
+// leaves ahead, with a backward scan, which does not, and the reference.
+static bool SamePrefetchedScan(Map<int, long> &tree,
+                               const std::map<int, long> &reference, int key) {
+  const std::vector<std::pair<int, long>> expected(reference.lower_bound(key),
+                                                   reference.end());
+  std::vector<std::pair<int, long>> forward;
+  for (auto it = tree.LowerBound(key); it != tree.End(); ++it) {
+    forward.emplace_back(it.GetKey(), it.GetValue());
+  }
+  std::vector<std::pair<int, long>> blocks;
+  tree.ForEachBlock(key, std::numeric_limits<int>::max(),
+                    [&](const int *keys, const long *values, size_t count) {
+                      for (size_t i = 0; i < count; i++) {
+                        blocks.emplace_back(keys[i], values[i]);
+                      }
+                    });
+  std::vector<std::pair<int, long>> backward;
+  if (!expected.empty()) {
+    for (auto it = tree.Find(expected.back().first);
+         it != tree.End() && it.GetKey() >= key; --it) {
+      backward.emplace_back(it.GetKey(), it.GetValue());
+    }
+  }
+  std::reverse(backward.begin(), backward.end());
+  return forward == expected && blocks == expected && backward == expected;
+}
+
+// Scans trees of one leaf up to several levels, whose leaves cross parent
+// boundaries within the prefetch distance, before and after erasures leave
+// parents of uneven size.
+static void MapPrefetchedScans(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200119);
+  const size_t N = pow(10, powers);
+
+  const size_t sizes[] = {0, 1, 31, 33, 100, 1000, N};
+  for (size_t size : sizes) {
+    Map<int, long> tree;
+    std::map<int, long> reference;
+    for (size_t i = 0; i < size; i++) {
+      const int key = xorshift.Uint64() % (4 * size);
+      tree.Put(key, static_cast<long>(i));
+      reference[key] = static_cast<long>(i);
+    }
+    Expect(SamePrefetchedScan(tree, reference, std::numeric_limits<int>::min()),
+           "prefetched full scan");
+    for (size_t i = 0; i < size / 2; i++) {
+      const int key = xorshift.Uint64() % (4 * size);
+      tree.Erase(key);
+      reference.erase(key);
+    }
+    Expect(SamePrefetchedScan(tree, reference, std::numeric_limits<int>::min()),
+           "prefetched full scan after erasures");
+    for (size_t i = 0; i < 16 && size > 0; i++) {
+      const int key = xorshift.Uint64() % (4 * size);
+      Expect(SamePrefetchedScan(tree, reference, key),
+             "prefetched scan from a key");
+    }
+  }
+
+  Map<int, long> tree;
+  for (int i = 0; i < static_cast<int>(N); i++) {
+    tree.Put(i, i);
+  }
+  auto it = tree.Begin();
+  int expected = 0;
+  bool consistent = true;
+  for (size_t step = 0; it != tree.End(); step++) {
+    consistent &= it.GetKey() == expected;
+    if (step % 97 == 96 && expected > 40) {
+      for (int i = 0; i < 40; i++) {
+        --it;
+      }
+      expected -= 40;
+    } else {
+      ++it;
+      expected++;
+    }
+  }
+  Expect(consistent && expected == static_cast<int>(N),
+         "scan back and forth across leaves");
+  std::cout << "prefetched scans: consistent" << std::endl;
+}
+
+// Reduces trees from empty to larger than the thread pool can split evenly
+// with 1, 2 and many threads and compares with a sequential walk. The key
+// list reduction also checks that the partial results combine in key order.
+static void MapParallelScans(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200118);
+  const size_t N = pow(10, powers);
+
+  const size_t sizes[] = {0, 1, 5, 31, 1000, N};
+  const size_t thread_counts[] = {1, 2, 16, 0};
+  for (size_t size : sizes) {
+    Map<int, long> tree;
+    std::map<int, long> reference;
+    for (size_t i = 0; i < size; i++) {
+      const int key = xorshift.Uint64() % (4 * size);
+      const long value = static_cast<long>(xorshift.Uint64() % 2001) - 1000;
+      tree.Put(key, value);
+      reference[key] = value;
+    }
+    const int low = size > 0 ? xorshift.Uint64() % (4 * size) : 0;
+    const int high = low + (size > 0 ? xorshift.Uint64() % (4 * size) : 0);
+    long sum = 0;
+    long range_sum = 0;
+    std::vector<int> keys;
+    for (auto it = reference.begin(); it != reference.end(); ++it) {
+      sum += it->second;
+      if (low <= it->first && it->first < high) {
+        range_sum += it->second;
+      }
+      keys.push_back(it->first);
+    }
+    auto add = [](long &partial, const int &, const long &value) {
+      partial += value;
+    };
+    auto plus = [](long left, long right) { return left + right; };
+    for (size_t threads : thread_counts) {
+      Expect(tree.ParallelReduce(0L, add, plus, threads) == sum &&
+                 tree.ParallelReduce(low, high, 0L, add, plus, threads) ==
+                     range_sum,
+             "parallel sum");
+      const std::vector<int> ordered = tree.ParallelReduce(
+          std::vector<int>(),
+          [](std::vector<int> &partial, const int &key, const long &) {
+            partial.push_back(key);
+          },
+          [](std::vector<int> left, const std::vector<int> &right) {
+            left.insert(left.end(), right.begin(), right.end());
+            return left;
+          },
+          threads);
+      Expect(ordered == keys, "parallel reduction order");
+      std::atomic<long> total(0);
+      std::atomic<size_t> count(0);
+      tree.ParallelForEach(
+          [&](const int &, const long &value) {
+            total += value;
+            count++;
+          },
+          threads);
+      Expect(total == sum && count == reference.size(), "parallel for each");
+    }
+  }
+  std::cout << "parallel scans: consistent" << std::endl;
+}
+
+static void MapSplitJoin(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200105);
+  size_t N = pow(10, powers);
+
+  std::map<int, long> reference;
+  for (size_t i = 0; i < N; i++) {
+    reference[2 * (xorshift.Uint64() % N)] = i;
+  }
+  const int first = reference.begin()->first;
+  const int last = reference.rbegin()->first;
+  const int cuts[] = {first,    last,     first - 1,
+                      last + 1, last - 1, static_cast<int>(N) / 2};
+  for (int cut : cuts) {
+    Map<int, long> tree;
+    Map<int, long> upper;
+    for (auto it = reference.begin(); it != reference.end(); ++it) {
+      tree.Put(it->first, it->second);
+    }
+    upper.Put(-1, 0);
+    tree.SplitAt(cut, upper);
+    std::map<int, long> low(reference.begin(), reference.lower_bound(cut));
+    std::map<int, long> high(reference.lower_bound(cut), reference.end());
+    Expect(tree.Verify() && upper.Verify(), "split invariants");
+    Expect(SameElements(tree, low) && SameElements(upper, high), "split");
+    for (size_t i = 0; i < 64; i++) {
+      const int from = xorshift.Uint64() % (2 * N);
+      const int to = from + xorshift.Uint64() % (2 * N - from + 1);
+      Expect(SameAggregate(tree, low, from, to) &&
+                 SameAggregate(upper, high, from, to),
+             "split aggregate");
+    }
+    Expect(upper.Join(tree) && tree.Size() == 0 && tree.Verify() &&
+               upper.Verify() && SameElements(upper, reference),
+           "join");
+    Expect(SameAggregate(upper, reference, first, last + 1), "join aggregate");
+    Expect(!upper.Join(upper) && upper.Size() == reference.size(),
+           "join itself");
+  }
+
+  // Cuts through small trees of random size leave edges of every height and
+  // fill to be joined again.
+  for (size_t round = 0; round < 256; round++) {
+    const size_t size = 1 + xorshift.Uint64() % 3000;
+    Map<int, long> tree;
+    Map<int, long> upper;
+    for (size_t i = 0; i < size; i++) {
+      tree.Put(xorshift.Uint64() % (4 * size), i);
+    }
+    const size_t count = tree.Size();
+    tree.SplitAt(xorshift.Uint64() % (4 * size), upper);
+    Expect(tree.Verify() && upper.Verify() && tree.Join(upper) &&
+               tree.Verify() && tree.Size() == count,
+           "random split and join");
+  }
+
+  Map<int, long> empty;
+  Map<int, long> upper;
+  upper.Put(1, 1);
+  empty.SplitAt(1, upper);
+  Expect(empty.Verify() && upper.Verify() && upper.Size() == 0, "split empty");
+
+  // Each pair overlaps in a third of the keys and merges to size elements.
+  const size_t sizes[] = {1, 30, 49, 1000, N};
+  for (size_t size : sizes) {
+    Map<int, long> tree;
+    Map<int, long> other;
+    std::map<int, long> merged;
+    for (size_t i = 0; i < 2 * size / 3; i++) {
+      tree.Put(i, i);
+      merged[i] += i;
+    }
+    for (size_t i = size / 3; i < size; i++) {
+      other.Put(i, 1);
+      merged[i] += 1;
+    }
+    tree.Merge(other, [](long &value, long &other_value) {
+      value += other_value;
+    });
+    Expect(tree.Verify() && other.Verify() && other.Size() == 0, "merge");
+    Expect(SameElements(tree, merged) &&
+               SameAggregate(tree, merged, 0, static_cast<int>(size)),
+           "merge elements");
+  }
+  std::cout << "split, join and merge: consistent" << std::endl;
+}
+
+// Appends ascending keys through the cached last leaf while popping, erasing,
+// splitting and joining in between, then puts through correct, wrong and End()
+// hints. Each phase is checked against a std::map.
+static void MapAppend(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200115);
+  size_t N = pow(10, powers);
+
+  Map<long, long> tree;
+  std::map<long, long> reference;
+  long next = 0;
+  long key = 0;
+  long value = 0;
+  for (int phase = 0; phase < 4; phase++) {
+    for (size_t i = 0; i < N; i++) {
+      tree.Put(next, i);
+      reference[next] = i;
+      next += 1 + xorshift.Uint64() % 3;
+      const size_t roll = xorshift.Uint64() % 16;
+      if ((phase == 0 || phase == 3) && roll == 0) {
+        Expect(tree.PopBack(key, value) &&
+                   key == reference.rbegin()->first &&
+                   value == reference.rbegin()->second,
+               "append pop back");
+        reference.erase(std::prev(reference.end()));
+      } else if ((phase == 1 || phase == 3) && roll == 1) {
+        auto it = reference.lower_bound(xorshift.Uint64() % next);
+        if (it != reference.end()) {
+          Expect(tree.Erase(it->first), "append erase");
+          reference.erase(it);
+        }
+      } else if ((phase == 2 || phase == 3) && roll == 2) {
+        // Appends to the upper half, prepends the lower half to it and moves
+        // everything back, so both trees drop their cached edge leaves.
+        Map<long, long> upper;
+        tree.SplitAt(xorshift.Uint64() % next, upper);
+        for (size_t j = 0; j < 8; j++) {
+          upper.Put(next, j);
+          reference[next] = j;
+          next++;
+        }
+        Expect(tree.Verify() && upper.Verify() && upper.Join(tree) &&
+                   tree.Join(upper) && upper.Size() == 0,
+               "append split and join");
+      }
+    }
+    Expect(tree.Verify() && SameElements(tree, reference), "append phase");
+  }
+
+  MapIterator<long, long> iter;
+  bool inserted;
+  for (size_t i = 0; i < N; i++) {
+    key = xorshift.Uint64() % (next + 2);
+    const bool present = reference.count(key) != 0;
+    switch (i % 4) {
+    case 0:
+      std::tie(iter, inserted) = tree.Put(tree.LowerBound(key), key, i);
+      break;
+    case 1:
+      std::tie(iter, inserted) =
+          tree.Put(tree.LowerBound(xorshift.Uint64() % next), key, i);
+      break;
+    case 2:
+      std::tie(iter, inserted) = tree.Put(tree.End(), key, i);
+      break;
+    default:
+      std::tie(iter, inserted) =
+          tree.Put(tree.LowerBound(key), std::move(key), i);
+      break;
+    }
+    Expect(inserted == !present && iter.GetKey() == key &&
+               iter.GetValue() == static_cast<long>(i),
+           "hinted put");
+    reference[key] = i;
+  }
+  Expect(tree.Verify() && SameElements(tree, reference), "hinted puts");
+  std::cout << "appends and hinted puts: consistent" << std::endl;
+}
+
+// Sequential detection keeps most keys in the splitting edge leaf, so ascending
+// and descending bulk inserts pack the leaves tighter than even splits do.
+// Ratios at the extremes must still leave both halves of a split non-empty,
+// which Verify checks.
+static void MapSplitPolicy(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200116);
+  const long N = pow(10, powers);
+
+  Map<long, long> even;
+  for (long i = 0; i < N; i++) {
+    even.Put(i, i);
+  }
+  const double even_fill = even.Stats().outer_fill;
+
+  const double ratios[] = {0.6, 0.9, 0.99, 1.0};
+  for (double ratio : ratios) {
+    for (int descending = 0; descending < 2; descending++) {
+      MapPolicy policy;
+      policy.detect_sequential = true;
+      policy.sequential_split_ratio = ratio;
+      Map<long, long> tree(policy);
+      std::map<long, long> reference;
+      for (long i = 0; i < N; i++) {
+        const long key = descending ? N - i : i;
+        tree.Put(key, i);
+        reference[key] = i;
+      }
+      Expect(tree.Verify() && SameElements(tree, reference),
+             "sequential splits");
+      Expect(tree.Stats().outer_fill > even_fill, "sequential fill");
+    }
+  }
+
+  const double extremes[] = {0.0, 0.01, 0.99, 1.0};
+  for (double ratio : extremes) {
+    MapPolicy policy;
+    policy.split_ratio = ratio;
+    policy.detect_sequential = true;
+    policy.sequential_split_ratio = ratio;
+    Map<long, long> tree(policy);
+    std::map<long, long> reference;
+    for (long i = 0; i < N; i++) {
+      // Ascending and descending runs at both edges, random keys between.
+      long key = xorshift.Uint64() % N;
+      if (i % 3 == 0) {
+        key = N + i;
+      } else if (i % 3 == 1) {
+        key = -i;
+      }
+      tree.Put(key, i);
+      reference[key] = i;
+    }
+    Expect(tree.Verify() && SameElements(tree, reference), "extreme splits");
+  }
+  std::cout << "split policies: consistent" << std::endl;
+}
+
+// Orders long keys ascending or descending depending on its state, which the
+// tree keeps from its constructor.
+class Direction {
+public:
+  explicit Direction(bool descending = false) : descending_(descending) {}
+  bool Less(long left, long right) const {
+    return descending_ ? right < left : left < right;
+  }
+  int Compare(long left, long right) const {
+    return Less(left, right) ? -1 : (Less(right, left) ? 1 : 0);
+  }
+
+private:
+  bool descending_;
+};
+
+class CaseInsensitive {
+public:
+  bool Less(const std::string &left, const std::string &right) const {
+    return strcasecmp(left.c_str(), right.c_str()) < 0;
+  }
+  int Compare(const std::string &left, const std::string &right) const {
+    return strcasecmp(left.c_str(), right.c_str());
+  }
+};
+
+// Compares KeySearch with std::lower_bound for every probe.
+template <class K, class C, class L>
+static bool SameLowerBounds(const std::pmr::vector<K> &keys,
+                            const std::vector<K> &probes, const C &compare,
+                            L less) {
+  for (const K &probe : probes) {
+    const size_t expected =
+        std::lower_bound(keys.begin(), keys.end(), probe, less) - keys.begin();
+    if (KeySearch<K, C>::LowerBound(keys, probe, compare) != expected) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Probes every key, its neighbours and the given extra values.
+template <class K>
+static std::vector<K> Probes(const std::pmr::vector<K> &keys,
+                             std::vector<K> probes) {
+  for (size_t i = 0; i < keys.size(); i++) {
+    probes.push_back(keys[i]);
+    probes.push_back(keys[i] - 1);
+    probes.push_back(keys[i] + 1);
+  }
+  return probes;
+}
+
+// Runs the interpolating search over uniform, skewed and duplicate-heavy
+// keys, doubles and keys near the top of uint64_t, and the binary search
+// fallback for string keys and for arithmetic keys in an order of their own.
+static void KeySearchLowerBound(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200120);
+  const size_t N = pow(10, powers);
+  const size_t sizes[] = {0, 1, 2, 3, OUTER_NODE_DEGREE, 1000, N};
+  const long lowest = std::numeric_limits<long>::min() + 1;
+  const long highest = std::numeric_limits<long>::max() - 1;
+  const uint64_t top = std::numeric_limits<uint64_t>::max();
+  for (size_t size : sizes) {
+    for (int distribution = 0; distribution < 3; distribution++) {
+      std::pmr::vector<long> keys;
+      for (size_t i = 0; i < size; i++) {
+        const uint64_t random = xorshift.Uint64();
+        switch (distribution) {
+        case 0:
+          keys.push_back(static_cast<long>(random >> 2) - (1L << 61));
+          break;
+        case 1:
+          keys.push_back(static_cast<long>(random % 1024) << (random % 50));
+          break;
+        default:
+          keys.push_back(random % 4);
+        }
+      }
+      std::sort(keys.begin(), keys.end());
+      std::vector<long> extra = {lowest, -1, 0, 1, highest};
+      for (size_t i = 0; i < 64; i++) {
+        extra.push_back(static_cast<long>(xorshift.Uint64() >> 1));
+      }
+      Expect(SameLowerBounds(keys, Probes(keys, extra), KeyCompare<long>(),
+                             std::less<long>()),
+             "interpolating lower bound");
+    }
+
+    std::pmr::vector<double> doubles;
+    std::pmr::vector<uint64_t> wide;
+    for (size_t i = 0; i < size; i++) {
+      doubles.push_back(xorshift.Uniform() * xorshift.Uniform());
+      wide.push_back(top - xorshift.Uint64() % 4096);
+    }
+    std::sort(doubles.begin(), doubles.end());
+    std::sort(wide.begin(), wide.end());
+    Expect(SameLowerBounds(doubles, Probes(doubles, {-1.0, 0.5, 2.0}),
+                           KeyCompare<double>(), std::less<double>()) &&
+               SameLowerBounds(wide, Probes(wide, {0, top - 4096, top}),
+                               KeyCompare<uint64_t>(), std::less<uint64_t>()),
+           "interpolating lower bound of doubles and wide keys");
+
+    std::pmr::vector<std::string> strings;
+    std::vector<std::string> string_probes = {"", "5", "~"};
+    std::pmr::vector<long> descending;
+    for (size_t i = 0; i < size; i++) {
+      strings.push_back(std::to_string(xorshift.Uint64() % 1000));
+      string_probes.push_back(strings.back());
+      string_probes.push_back(strings.back() + "0");
+      descending.push_back(xorshift.Uint64() % 1000);
+    }
+    std::sort(strings.begin(), strings.end());
+    std::sort(descending.begin(), descending.end(), std::greater<long>());
+    Expect(SameLowerBounds(strings, string_probes, KeyCompare<std::string>(),
+                           std::less<std::string>()) &&
+               SameLowerBounds(descending,
+                               Probes(descending, {lowest, highest}),
+                               Direction(true), std::greater<long>()),
+           "binary search fallback");
+  }
+  std::cout << "key search lower bound: consistent" << std::endl;
+}
+
+static void MapKeyOrder(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200110);
+  size_t N = pow(10, powers);
+
+  Map<long, long> ascending;
+  Map<long, long, Direction> descending(
+      MapPolicy(), std::pmr::get_default_resource(),
+      std::pmr::get_default_resource(), Direction(true));
+  std::map<long, long> reference;
+  std::map<long, long, std::greater<long>> reversed;
+  for (size_t i = 0; i < N; i++) {
+    long key = xorshift.Uint64() % (2 * N);
+    ascending.Put(key, i);
+    descending.Put(key, i);
+    reference[key] = i;
+    reversed[key] = i;
+  }
+  for (size_t i = 0; i < N / 2; i++) {
+    long key = xorshift.Uint64() % (2 * N);
+    Expect(ascending.Erase(key) == (reference.erase(key) == 1) &&
+               descending.Erase(key) == (reversed.erase(key) == 1),
+           "erase in key order");
+  }
+  Expect(ascending.Verify() && descending.Verify(), "key order invariants");
+  Expect(SameElements(ascending, reference) &&
+             SameElements(descending, reversed),
+         "iteration in key order");
+  Expect(SameLookups(descending, reversed, 2 * N), "find in key order");
+  for (size_t i = 0; i < 64; i++) {
+    long key = xorshift.Uint64() % (2 * N + 1);
+    auto expected = reversed.lower_bound(key);
+    auto it = descending.LowerBound(key);
+    Expect(expected == reversed.end()
+               ? it == descending.End()
+               : it != descending.End() && it.GetKey() == expected->first,
+           "lower bound in key order");
+  }
+
+  FrozenMap<long, long, Direction> frozen = descending.Freeze();
+  Expect(SameElements(frozen, reversed), "frozen key order");
+  Expect(frozen.Contains(reversed.begin()->first) &&
+             !frozen.Contains(2 * static_cast<long>(N)),
+         "frozen find in key order");
+
+  // Splitting at cut leaves the keys that come before it in the order of the
+  // tree, which are the greater ones.
+  const long cut = N;
+  Map<long, long, Direction> upper(MapPolicy(),
+                                   std::pmr::get_default_resource(),
+                                   std::pmr::get_default_resource(),
+                                   Direction(true));
+  descending.SplitAt(cut, upper);
+  std::map<long, long, std::greater<long>> low(reversed.begin(),
+                                               reversed.lower_bound(cut));
+  std::map<long, long, std::greater<long>> high(reversed.lower_bound(cut),
+                                                reversed.end());
+  Expect(descending.Verify() && upper.Verify() &&
+             SameElements(descending, low) && SameElements(upper, high),
+         "split in key order");
+  Expect(descending.Join(upper) && descending.Verify() &&
+             SameElements(descending, reversed),
+         "join in key order");
+
+  Map<std::string, long, CaseInsensitive> names;
+  Expect(std::get<1>(names.Put("Apple", 1)) &&
+             !std::get<1>(names.Put("APPLE", 2)) &&
+             std::get<1>(names.Put("banana", 3)),
+         "case-insensitive put");
+  Expect(names.Size() == 2 && names.Contains("apple") &&
+             names.Find("BANANA").GetValue() == 3 &&
+             names.Begin().GetKey() == "Apple",
+         "case-insensitive find");
+  std::cout << "descending and case-insensitive order: consistent"
+            << std::endl;
+}
+
+// Looks up string keys through views and literals, with and without the hash
+// index, and through Get on a const tree.
+static void StringMapTransparentLookup(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200111);
+  size_t N = pow(10, powers - 1);
+
+  for (bool hash_index : {false, true}) {
+    MapPolicy policy;
+    policy.hash_index = hash_index;
+    Map<std::string, long> tree(policy);
+    std::map<std::string, long> reference;
+    for (size_t i = 0; i < N; i++) {
+      std::string key = xorshift.Uuid();
+      tree.Put(key, i);
+      reference[key] = i;
+    }
+    const Map<std::string, long> &constant = tree;
+    for (auto it = reference.begin(); it != reference.end(); ++it) {
+      const std::string_view view(it->first);
+      const char *literal = it->first.c_str();
+      Expect(tree.Find(view).GetValue() == it->second &&
+                 tree.Find(literal).GetValue() == it->second,
+             "transparent find");
+      Expect(tree.Contains(view) && tree.Contains(literal),
+             "transparent contains");
+      Expect(constant.Get(view) == it->second &&
+                 constant.Get(literal) == it->second &&
+                 constant.Get(it->first) == it->second,
+             "const get");
+    }
+    Expect(tree.Find(std::string_view("missing")) == tree.End() &&
+               !tree.Contains("missing"),
+           "transparent find missing");
+    bool thrown = false;
+    try {
+      constant.Get("missing");
+    } catch (const std::out_of_range &) {
+      thrown = true;
+    }
+    Expect(thrown, "const get missing");
+
+    size_t i = 0;
+    for (auto it = reference.begin(); it != reference.end();) {
+      const bool erased = i++ % 2 == 0
+                              ? tree.Erase(std::string_view(it->first))
+                              : tree.Erase(it->first.c_str());
+      Expect(erased, "transparent erase");
+      it = reference.erase(it);
+      if (it != reference.end()) {
+        ++it;
+      }
+    }
+    Expect(!tree.Erase("missing") && !tree.Erase(std::string_view("")),
+           "transparent erase missing");
+    Expect(tree.Verify() && SameElements(tree, reference),
+           "elements after transparent erase");
+  }
+  std::cout << "transparent lookups: consistent" << std::endl;
+}
+
+// Forwards to upstream and counts the calls and the bytes still allocated.
+class CountingResource : public std::pmr::memory_resource {
+public:
+  CountingResource(std::pmr::memory_resource *upstream)
+      : upstream_(upstream), allocations_(0), bytes_(0) {}
+  size_t Allocations() const { return allocations_; }
+  size_t Bytes() const { return bytes_; }
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    allocations_++;
+    bytes_ += bytes;
+    return upstream_->allocate(bytes, alignment);
+  }
+  void do_deallocate(void *block, size_t bytes, size_t alignment) override {
+    bytes_ -= bytes;
+    upstream_->deallocate(block, bytes, alignment);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+private:
+  std::pmr::memory_resource *upstream_;
+  size_t allocations_;
+  size_t bytes_;
+};
+
+// Runs put, erase, split and join between trees on two resources. The default
+// resource counts as well, so anything allocated past the given ones shows.
+static void MapMemoryResources(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200112);
+  size_t N = pow(10, powers - 1);
+
+  CountingResource fallback(std::pmr::new_delete_resource());
+  std::pmr::memory_resource *previous =
+      std::pmr::set_default_resource(&fallback);
+  std::pmr::monotonic_buffer_resource arena(std::pmr::new_delete_resource());
+  HugePageResource pages;
+  CountingResource monotonic(&arena);
+  CountingResource huge(&pages);
+  CountingResource *resources[][2] = {{&monotonic, &huge}, {&huge, &monotonic}};
+  for (auto pair : resources) {
+    MapPolicy policy;
+    policy.hash_index = true;
+    Map<long, long> tree(policy, pair[0]);
+    Map<long, long> upper(policy, pair[1]);
+    std::map<long, long> reference;
+    for (size_t i = 0; i < N; i++) {
+      long key = xorshift.Uint64() % (2 * N);
+      tree.Put(key, i);
+      reference[key] = i;
+    }
+    for (size_t i = 0; i < N / 2; i++) {
+      long key = xorshift.Uint64() % (2 * N);
+      tree.Erase(key);
+      reference.erase(key);
+    }
+    const size_t allocations = pair[1]->Allocations();
+    tree.SplitAt(N, upper);
+    Expect(pair[1]->Allocations() > allocations, "split into other resource");
+    Expect(tree.Verify() && upper.Verify() && tree.Join(upper) &&
+               tree.Verify() && SameElements(tree, reference),
+           "split and join across resources");
+
+    // Keys are copied with the resource of the tree that takes them.
+    Map<std::pmr::string, long> strings(pair[0]);
+    Map<std::pmr::string, long> strings_upper(pair[1]);
+    std::pmr::memory_resource *heap = std::pmr::new_delete_resource();
+    for (size_t i = 0; i < N; i++) {
+      const std::string uuid = xorshift.Uuid();
+      strings.Put(std::pmr::string(uuid.begin(), uuid.end(), heap), i);
+    }
+    for (size_t i = 0; i < N / 2; i++) {
+      strings.PopFront();
+    }
+    const size_t size = strings.Size();
+    strings.SplitAt(std::pmr::string("8", heap), strings_upper);
+    bool own_resource = true;
+    for (auto it = strings_upper.Begin(); it != strings_upper.End(); ++it) {
+      own_resource &= it.GetKey().get_allocator().resource() == pair[1];
+    }
+    Expect(strings.Join(strings_upper) && strings.Verify() &&
+               strings.Size() == size,
+           "split and join strings across resources");
+    for (auto it = strings.Begin(); it != strings.End(); ++it) {
+      own_resource &= it.GetKey().get_allocator().resource() == pair[0];
+    }
+    Expect(own_resource, "keys on the tree resource");
+
+    Multimap<long, long> multi(pair[0]);
+    for (long i = 0; i < 64; i++) {
+      multi.Put(i % 4, i);
+    }
+    const std::pmr::vector<long> &values = multi.Get(1);
+    Expect(values.size() == 16 && values.front() == 1 &&
+               &multi.Find(1).GetMultiValue() == &values &&
+               values.get_allocator().resource() == pair[0],
+           "multimap values");
+  }
+  Expect(monotonic.Bytes() == 0 && huge.Bytes() == 0,
+         "every allocation returned");
+  Expect(monotonic.Allocations() > 0 && huge.Allocations() > 0 &&
+             fallback.Allocations() == 0,
+         "every allocation through the given resource");
+  std::pmr::set_default_resource(previous);
+  std::cout << "monotonic and huge page resources: accounted" << std::endl;
+}
+
+// Allocates blocks of many sizes and alignments from a huge page resource,
+// checks that they are aligned and do not overlap, and frees them in random
+// order. The same requests afterwards must be served from the free lists
+// without new chunks, and blocks that are too large or too aligned for the
+// chunks must come from upstream. Chunks the kernel declines the huge page
+// advice for are used like any other.
+static void HugePageResourceBlocks(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200120);
+  const size_t N = 4 * pow(10, powers - 2);
+
+  struct Block {
+    char *memory;
+    size_t bytes;
+    size_t alignment;
+  };
+  CountingResource upstream(std::pmr::new_delete_resource());
+  std::vector<Block> blocks;
+  {
+    HugePageResource pages(&upstream);
+    const size_t alignments[] = {1, 2, 4, 8, 16, 32, 64, 4096};
+    for (size_t i = 0; i < N; i++) {
+      Block block;
+      const uint64_t kind = xorshift.Uint64() % 32;
+      if (kind == 0) {
+        block.bytes = HugePageResource::kMaxBlock + 1 +
+                      xorshift.Uint64() % HugePageResource::kMaxBlock;
+      } else if (kind == 1) {
+        block.bytes = 1 + xorshift.Uint64() % HugePageResource::kMaxBlock;
+      } else {
+        block.bytes = xorshift.Uint64() % 257;
+      }
+      block.alignment = alignments[xorshift.Uint64() % 8];
+      blocks.push_back(block);
+    }
+
+    size_t upstream_blocks = 0;
+    size_t upstream_bytes = 0;
+    for (const Block &block : blocks) {
+      if (block.bytes > HugePageResource::kMaxBlock ||
+          block.alignment > HugePageResource::kGranularity) {
+        upstream_blocks++;
+        upstream_bytes += block.bytes;
+      }
+    }
+    bool aligned = true;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      blocks[i].memory = static_cast<char *>(
+          pages.allocate(blocks[i].bytes, blocks[i].alignment));
+      const uintptr_t address = reinterpret_cast<uintptr_t>(blocks[i].memory);
+      aligned &= address % blocks[i].alignment == 0;
+      std::fill(blocks[i].memory, blocks[i].memory + blocks[i].bytes,
+                static_cast<char>(i));
+    }
+    Expect(aligned, "blocks aligned");
+    bool intact = true;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      intact &= std::count(blocks[i].memory, blocks[i].memory + blocks[i].bytes,
+                           static_cast<char>(i)) ==
+                static_cast<ptrdiff_t>(blocks[i].bytes);
+    }
+    Expect(intact, "blocks do not overlap");
+    // Chunks only come from upstream when mmap fails.
+    const size_t chunks = pages.Chunks();
+    const size_t chunk_bytes = upstream.Bytes() - upstream_bytes;
+    Expect(chunks > 0 && pages.HugeChunks() <= chunks &&
+               chunk_bytes % HugePageResource::kChunkSize == 0 &&
+               chunk_bytes <= chunks * HugePageResource::kChunkSize &&
+               upstream.Allocations() ==
+                   upstream_blocks +
+                       chunk_bytes / HugePageResource::kChunkSize,
+           "large and over-aligned blocks from upstream");
+
+    std::vector<char *> released;
+    for (size_t i = blocks.size(); i > 1; i--) {
+      std::swap(blocks[i - 1], blocks[xorshift.Uint64() % i]);
+    }
+    for (const Block &block : blocks) {
+      pages.deallocate(block.memory, block.bytes, block.alignment);
+      released.push_back(block.memory);
+    }
+    Expect(upstream.Bytes() == chunk_bytes, "large blocks returned upstream");
+    std::sort(released.begin(), released.end());
+    bool reused = true;
+    for (Block &block : blocks) {
+      block.memory =
+          static_cast<char *>(pages.allocate(block.bytes, block.alignment));
+      if (block.bytes <= HugePageResource::kMaxBlock &&
+          block.alignment <= HugePageResource::kGranularity) {
+        reused &= std::binary_search(released.begin(), released.end(),
+                                     block.memory);
+      }
+    }
+    Expect(reused && pages.Chunks() == chunks, "freed blocks reused");
+    for (const Block &block : blocks) {
+      pages.deallocate(block.memory, block.bytes, block.alignment);
+    }
+  }
+  Expect(upstream.Bytes() == 0, "chunks released with the resource");
+  std::cout << "huge page resource blocks: consistent" << std::endl;
+}
+
+// Checks every lookup of a frozen map for the keys from low to high against
+// the reference.
+template <class R>
+static bool SameFrozenLookups(const FrozenMap<long, long> &frozen,
+                              const R &reference, long low, long high) {
+  for (long key = low; key <= high; key++) {
+    auto expected = reference.lower_bound(key);
+    auto bound = frozen.LowerBound(key);
+    if (expected == reference.end() ? bound != frozen.End()
+                                    : bound == frozen.End() ||
+                                          bound.GetKey() != expected->first) {
+      return false;
+    }
+    const bool present = expected != reference.end() && expected->first == key;
+    auto it = frozen.Find(key);
+    if (frozen.Contains(key) != present ||
+        (present ? it == frozen.End() || it.GetValue() != expected->second
+                 : it != frozen.End())) {
+      return false;
+    }
+    bool thrown = false;
+    long value = 0;
+    try {
+      value = frozen.Get(key);
+    } catch (const std::out_of_range &) {
+      thrown = true;
+    }
+    if (thrown == present || (present && value != expected->second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sizes around powers of two leave the last level of the implicit tree full,
+// empty or partly filled.
+static void FrozenMapOperations(int powers) {
+  RandomGenerator xorshift;
+  xorshift.Seed(20200113);
+  size_t N = pow(10, powers - 1);
+
+  const size_t sizes[] = {0, 1, 2, 3, 4, 7, 8, 15, 16, 31, 32, 33, 100,
+                          1023, 1024, 1 + xorshift.Uint64() % N};
+  for (size_t size : sizes) {
+    Map<long, long> tree;
+    std::map<long, long> reference;
+    while (reference.size() < size) {
+      long key = xorshift.Uint64() % (4 * size);
+      tree.Put(key, key * 3);
+      reference[key] = key * 3;
+    }
+    FrozenMap<long, long> frozen = tree.Freeze();
+    Expect(SameElements(frozen, reference), "frozen elements");
+    Expect(SameFrozenLookups(frozen, reference, -1, 4 * size + 1),
+           "frozen lookups");
+
+    auto expected = reference.rbegin();
+    auto it = frozen.End();
+    for (size_t i = 0; i < size; i++, ++expected) {
+      --it;
+      Expect(it.GetKey() == expected->first, "frozen reverse iteration");
+    }
+    Expect(size == 0 || --it == frozen.End(), "frozen before the first key");
+
+    frozen.Save("frozen.bin");
+    FrozenMap<long, long> loaded;
+    loaded.Load("frozen.bin");
+    Map<long, long> reloaded;
+    reloaded.Load("frozen.bin");
+    Expect(SameElements(loaded, reference) &&
+               SameElements(reloaded, reference) &&
+               SameFrozenLookups(loaded, reference, -1, 4 * size + 1),
+           "frozen save and load");
+    frozen.Clear();
+    Expect(frozen.Size() == 0 && frozen.Begin() == frozen.End() &&
+               SameFrozenLookups(frozen, std::map<long, long>(), -1, 1),
+           "frozen clear");
+  }
+
+  FrozenMap<long, long> empty;
+  FrozenMap<long, long> missing;
+  missing.Load("missing.bin");
+  std::map<long, long> none;
+  Expect(SameFrozenLookups(empty, none, -1, 1) &&
+             SameFrozenLookups(missing, none, -1, 1) &&
+             missing.Begin() == missing.End(),
+         "empty frozen map");
+  std::cout << "frozen map: consistent" << std::endl;
+}
+
 int main(int argc, char **argv) {
 
   size_t max_power = 5;
-  std::cout << "# my_map, map, my_multimap, multimap" << std::endl;
-  for (size_t dim = 1e1; dim <= pow(10, max_power); dim *= 2) {
-    double my_map_average = 0.0;
-    double map_average = 0.0;
-    double my_multimap_average = 0.0;
-    double multimap_average = 0.0;
-    size_t count = 1;
-    for (size_t i = 0; i < count; i++) {
-      my_map_average += MapBenchmark(dim);
-      map_average += StandardMapBenchmark(dim);
-      my_multimap_average += MultimapBenchmark(dim);
-      multimap_average += StandardMultimapBenchmark(dim);
-    }
-    my_map_average /= count;
-    map_average /= count;
-    my_multimap_average /= count;
-    multimap_average /= count;
-    std::cout << dim << "\t" << my_map_average << "\t" << map_average << "\t"
-              << my_multimap_average << "\t" << multimap_average << std::endl;
-  }
 
   MapSerialization(max_power);
   MultimapSerialization(max_power);
   StringMapSerialization(max_power);
+  MapQueue(max_power);
+  MapEmplace(max_power);
+  MapOperationCounters(max_power);
+  LatencyHistogramBuckets(max_power);
+  MapReload(max_power);
+  MapCompaction(max_power);
+  MapHashIndex(max_power);
+  ValueLogMapOperations(max_power);
+  MapOrderStatistics(max_power);
+  MapRangeAggregates(max_power);
+  MapRangeScans(max_power);
+  MapPrefetchedScans(max_power);
+  MapParallelScans(max_power);
+  MapSplitJoin(max_power);
+  MapAppend(max_power);
+  MapSplitPolicy(max_power);
+  KeySearchLowerBound(max_power);
+  MapKeyOrder(max_power);
+  StringMapTransparentLookup(max_power);
+  MapMemoryResources(max_power);
+  HugePageResourceBlocks(max_power);
+  FrozenMapOperations(max_power);
 
   return 0;
 }
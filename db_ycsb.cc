@@ -0,0 +1,439 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+
+#include "db_bench.h"
+#include "db_core.h"
+
+static const size_t kValueLength = 100;
+static const size_t kValuePool = 1024;
+static const size_t kMaxScanLength = 100;
+
+static volatile uint64_t sink;
+
+enum Operation { READ, UPDATE, INSERT, SCAN, READ_MODIFY_WRITE, OPERATIONS };
+
+static const char *kOperationNames[OPERATIONS] = {"read", "update", "insert",
+                                                  "scan", "rmw"};
+
+static uint64_t FnvHash(uint64_t value) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < 8; i++) {
+    hash ^= value & 0xff;
+    hash *= 0x100000001b3ULL;
+    value >>= 8;
+  }
+  return hash;
+}
+
+class ZipfianGenerator {
+public:
+  ZipfianGenerator(uint64_t items, double theta = 0.99);
+  ZipfianGenerator(uint64_t items, double theta, double zetan);
+  uint64_t Next(RandomGenerator &generator, uint64_t items);
+
+private:
+  static double Zeta(uint64_t from, uint64_t to, double theta, double sum);
+  uint64_t items_;
+  double theta_;
+  double alpha_;
+  double zeta2_;
+  double zetan_;
+  double eta_;
+};
+
+ZipfianGenerator::ZipfianGenerator(uint64_t items, double theta)
+    : ZipfianGenerator(items, theta, Zeta(0, items, theta, 0.0)) {}
+
+ZipfianGenerator::ZipfianGenerator(uint64_t items, double theta, double zetan)
+    : items_(items), theta_(theta), alpha_(1.0 / (1.0 - theta)),
+      zeta2_(Zeta(0, 2, theta, 0.0)), zetan_(zetan) {
+  eta_ = (1.0 - std::pow(2.0 / items_, 1.0 - theta_)) /
+         (1.0 - zeta2_ / zetan_);
+}
+
+double ZipfianGenerator::Zeta(uint64_t from, uint64_t to, double theta,
+                              double sum) {
+  for (uint64_t i = from; i < to; i++) {
+    sum += 1.0 / std::pow(i + 1, theta);
+  }
+  return sum;
+}
+
+uint64_t ZipfianGenerator::Next(RandomGenerator &generator, uint64_t items) {
+  if (items > items_) {
+    zetan_ = Zeta(items_, items, theta_, zetan_);
+    items_ = items;
+    eta_ = (1.0 - std::pow(2.0 / items_, 1.0 - theta_)) /
+           (1.0 - zeta2_ / zetan_);
+  }
+  const double u = generator.Uniform();
+  const double uz = u * zetan_;
+  if (uz < 1.0) {
+    return 0;
+  }
+  if (uz < 1.0 + std::pow(0.5, theta_)) {
+    return 1;
+  }
+  const uint64_t next =
+      static_cast<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+  return std::min(next, items_ - 1);
+}
+
+class KeyChooser {
+public:
+  virtual ~KeyChooser() {}
+  virtual uint64_t Next(RandomGenerator &generator, uint64_t records) = 0;
+};
+
+class UniformChooser : public KeyChooser {
+public:
+  uint64_t Next(RandomGenerator &generator, uint64_t records) {
+    return generator.Uint64() % records;
+  }
+};
+
+class ZipfianChooser : public KeyChooser {
+public:
+  ZipfianChooser(uint64_t records) : zipfian_(records) {}
+  uint64_t Next(RandomGenerator &generator, uint64_t records) {
+    return zipfian_.Next(generator, records);
+  }
+
+private:
+  ZipfianGenerator zipfian_;
+};
+
+// Spreads the popular items over the key space by hashing the ranks of a
+// Zipfian distribution over a large fixed item count.
+class ScrambledZipfianChooser : public KeyChooser {
+public:
+  ScrambledZipfianChooser()
+      : zipfian_(10000000000ULL, 0.99, 26.46902820178302) {}
+  uint64_t Next(RandomGenerator &generator, uint64_t records) {
+    return FnvHash(zipfian_.Next(generator, 10000000000ULL)) % records;
+  }
+
+private:
+  ZipfianGenerator zipfian_;
+};
+
+// Prefers the most recently inserted records.
+class LatestChooser : public KeyChooser {
+public:
+  LatestChooser(uint64_t records) : zipfian_(records) {}
+  uint64_t Next(RandomGenerator &generator, uint64_t records) {
+    return records - 1 - zipfian_.Next(generator, records);
+  }
+
+private:
+  ZipfianGenerator zipfian_;
+};
+
+// Sends hot_operations of the requests to the first hot_fraction of the
+// records and the remainder uniformly to the rest.
+class HotspotChooser : public KeyChooser {
+public:
+  HotspotChooser(double hot_fraction = 0.2, double hot_operations = 0.8)
+      : hot_fraction_(hot_fraction), hot_operations_(hot_operations) {}
+  uint64_t Next(RandomGenerator &generator, uint64_t records) {
+    const uint64_t hot = std::max<uint64_t>(1, hot_fraction_ * records);
+    if (generator.Uniform() < hot_operations_ || hot >= records) {
+      return generator.Uint64() % hot;
+    }
+    return hot + generator.Uint64() % (records - hot);
+  }
+
+private:
+  double hot_fraction_;
+  double hot_operations_;
+};
+
+static KeyChooser *NewKeyChooser(const std::string &distribution,
+                                 uint64_t records) {
+  if (distribution == "uniform") {
+    return new UniformChooser();
+  } else if (distribution == "zipfian") {
+    return new ZipfianChooser(records);
+  } else if (distribution == "scrambled") {
+    return new ScrambledZipfianChooser();
+  } else if (distribution == "latest") {
+    return new LatestChooser(records);
+  } else if (distribution == "hotspot") {
+    return new HotspotChooser();
+  }
+  return nullptr;
+}
+
+class WorkloadSpec {
+public:
+  std::string name;
+  std::string distribution;
+  double proportions[OPERATIONS];
+};
+
+// The core workloads A to F of the Yahoo! Cloud Serving Benchmark.
+static const WorkloadSpec kWorkloads[] = {
+    {"a", "zipfian", {0.50, 0.50, 0.00, 0.00, 0.00}},
+    {"b", "zipfian", {0.95, 0.05, 0.00, 0.00, 0.00}},
+    {"c", "zipfian", {1.00, 0.00, 0.00, 0.00, 0.00}},
+    {"d", "latest", {0.95, 0.00, 0.05, 0.00, 0.00}},
+    {"e", "zipfian", {0.00, 0.00, 0.05, 0.95, 0.00}},
+    {"f", "zipfian", {0.50, 0.00, 0.00, 0.00, 0.50}},
+};
+
+static std::string RecordKey(uint64_t record) {
+  return "user" + std::to_string(FnvHash(record));
+}
+
+typedef Map<std::string, std::string> StringMap;
+typedef Multimap<std::string, std::string> StringMultimap;
+
+inline void Insert(StringMap &tree, const std::string &key,
+                   const std::string &value) {
+  tree.Put(key, value);
+}
+
+inline void Insert(StringMultimap &tree, const std::string &key,
+                   const std::string &value) {
+  tree.Put(key, value);
+}
+
+inline bool Read(StringMap &tree, const std::string &key) {
+  MapIterator<std::string, std::string> it = tree.Find(key);
+  if (it == tree.End()) {
+    return false;
+  }
+  sink = it.GetValue().length();
+  return true;
+}
+
+inline bool Read(StringMultimap &tree, const std::string &key) {
+  MultimapIterator<std::string, std::string> it = tree.Find(key);
+  if (it == tree.End()) {
+    return false;
+  }
+  sink = it.GetValue().length();
+  return true;
+}
+
+inline void Update(StringMap &tree, const std::string &key,
+                   const std::string &value) {
+  tree.Modify(key, [&value](std::string &stored) { stored = value; });
+}
+
+inline void Update(StringMultimap &tree, const std::string &key,
+                   const std::string &value) {
+  MultimapIterator<std::string, std::string> it = tree.Find(key);
+  if (it != tree.End()) {
+    tree.Put(it, value);
+  }
+}
+
+inline size_t Scan(StringMap &tree, const std::string &key, size_t length) {
+  size_t count = 0;
+  MapIterator<std::string, std::string> it = tree.Find(key);
+  for (; count < length && it != tree.End(); count++, ++it) {
+    sink = it.GetValue().length();
+  }
+  return count;
+}
+
+inline size_t Scan(StringMultimap &tree, const std::string &key,
+                   size_t length) {
+  size_t count = 0;
+  MultimapIterator<std::string, std::string> it = tree.Find(key);
+  for (; count < length && it != tree.End(); count++, ++it) {
+    sink = it.GetValue().length();
+  }
+  return count;
+}
+
+template <class T> class Driver {
+public:
+  Driver(const std::string &container, const WorkloadSpec &workload,
+         const std::string &distribution, size_t records, size_t operations,
+         uint64_t seed);
+  ~Driver();
+  void Run(BenchmarkReporter &reporter);
+
+private:
+  Operation NextOperation();
+  const std::string &NextValue();
+  double Execute(Operation operation);
+  std::string container_;
+  const WorkloadSpec &workload_;
+  std::string distribution_;
+  size_t records_;
+  size_t operations_;
+  RandomGenerator generator_;
+  KeyChooser *chooser_;
+  std::vector<std::string> values_;
+  size_t value_cursor_;
+  T tree_;
+};
+
+template <class T>
+Driver<T>::Driver(const std::string &container, const WorkloadSpec &workload,
+                  const std::string &distribution, size_t records,
+                  size_t operations, uint64_t seed)
+    : container_(container), workload_(workload), distribution_(distribution),
+      records_(records), operations_(operations), generator_(seed),
+      chooser_(NewKeyChooser(distribution, records)), value_cursor_(0) {
+  for (size_t i = 0; i < kValuePool; i++) {
+    values_.push_back(generator_.Uuid(kValueLength));
+  }
+}
+
+template <class T> Driver<T>::~Driver() { delete chooser_; }
+
+template <class T> Operation Driver<T>::NextOperation() {
+  double u = generator_.Uniform();
+  for (size_t i = 0; i < OPERATIONS; i++) {
+    if (u < workload_.proportions[i]) {
+      return static_cast<Operation>(i);
+    }
+    u -= workload_.proportions[i];
+  }
+  return READ;
+}
+
+template <class T> const std::string &Driver<T>::NextValue() {
+  value_cursor_ = (value_cursor_ + 1) % values_.size();
+  return values_[value_cursor_];
+}
+
+template <class T> double Driver<T>::Execute(Operation operation) {
+  BenchmarkTimer timer;
+  if (operation == INSERT) {
+    const std::string key = RecordKey(records_++);
+    const std::string &value = NextValue();
+    timer.Start();
+    Insert(tree_, key, value);
+    return timer.Stop();
+  }
+  const std::string key = RecordKey(chooser_->Next(generator_, records_));
+  const std::string &value = NextValue();
+  const size_t length = 1 + generator_.Uint64() % kMaxScanLength;
+  timer.Start();
+  if (operation == READ) {
+    Read(tree_, key);
+  } else if (operation == UPDATE) {
+    Update(tree_, key, value);
+  } else if (operation == SCAN) {
+    Scan(tree_, key, length);
+  } else {
+    Read(tree_, key);
+    Update(tree_, key, value);
+  }
+  return timer.Stop();
+}
+
+template <class T> void Driver<T>::Run(BenchmarkReporter &reporter) {
+  for (size_t i = 0; i < records_; i++) {
+    Insert(tree_, RecordKey(i), NextValue());
+  }
+  std::vector<BenchmarkResult> results(OPERATIONS);
+  for (size_t i = 0; i < OPERATIONS; i++) {
+    results[i].container = container_;
+    results[i].key_type = "ycsb-" + workload_.name + "/" + distribution_;
+    results[i].phase = kOperationNames[i];
+    results[i].size = records_;
+    results[i].operations = 0;
+  }
+  BenchmarkResult all = results[READ];
+  all.phase = "all";
+  all.operations = operations_;
+  for (size_t i = 0; i < operations_; i++) {
+    const Operation operation = NextOperation();
+    const double latency = Execute(operation);
+    results[operation].samples.push_back(latency);
+    results[operation].operations++;
+    all.samples.push_back(latency);
+  }
+  for (size_t i = 0; i < OPERATIONS; i++) {
+    if (results[i].operations > 0) {
+      reporter.ReportLatency(results[i]);
+    }
+  }
+  if (all.operations > 0) {
+    reporter.ReportLatency(all);
+  }
+}
+
+template <class T>
+static void RunWorkload(const std::string &container,
+                        const WorkloadSpec &workload,
+                        const BenchmarkOptions &options,
+                        BenchmarkReporter &reporter) {
+  const std::string distribution =
+      options.distribution.empty() ? workload.distribution
+                                   : options.distribution;
+  const std::string name =
+      container + "/ycsb-" + workload.name + "/" + distribution;
+  if (name.find(options.filter) == std::string::npos) {
+    return;
+  }
+  for (size_t i = 0; i < options.sizes.size(); i++) {
+    const size_t records = std::max<size_t>(1, options.sizes[i]);
+    const size_t operations =
+        options.operations > 0 ? options.operations : records;
+    Driver<T> driver(container, workload, distribution, records, operations,
+                     options.seed);
+    driver.Run(reporter);
+  }
+}
+
+int main(int argc, char **argv) {
+  BenchmarkOptions options;
+  options.sizes = {100000};
+  if (!options.Parse(argc, argv)) {
+    std::cerr << "usage: " << argv[0]
+              << " [--format=text|csv|json] [--filter=substring]"
+                 " [--sizes=records,...] [--operations=n]"
+                 " [--distribution=uniform|zipfian|scrambled|latest|hotspot]"
+                 " [--seed=n]"
+              << std::endl;
+    return 1;
+  }
+  if (!options.distribution.empty()) {
+    KeyChooser *chooser = NewKeyChooser(options.distribution, 1);
+    if (chooser == nullptr) {
+      std::cerr << "unknown distribution " << options.distribution
+                << std::endl;
+      return 1;
+    }
+    delete chooser;
+  }
+  BenchmarkReporter reporter(options.format, std::cout);
+  reporter.BeginLatency();
+  for (const WorkloadSpec &workload : kWorkloads) {
+    RunWorkload<StringMap>("bptree", workload, options, reporter);
+    RunWorkload<StringMultimap>("multimap", workload, options, reporter);
+  }
+  reporter.End();
+  return 0;
+}